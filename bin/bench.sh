@@ -0,0 +1,20 @@
+#!/usr/bin/env bash
+
+set -e
+
+cwd=$(cd "$(dirname $(dirname "${BASH_SOURCE[0]}"))" &> /dev/null && pwd)
+
+PERF="$cwd/perf"
+
+mkdir -p $PERF
+
+cd $cwd
+ninja -f $cwd/build.linux.noprofiling.ninja bench_alloc bench_bump_alloc bench_bucket_alloc bench_malloc
+
+# one header, then the rows of every backend
+$cwd/bench_alloc > $PERF/bench.csv
+for bench in bench_bump_alloc bench_bucket_alloc bench_malloc; do
+    $cwd/$bench --no-header >> $PERF/bench.csv
+done
+
+cat $PERF/bench.csv
@@ -1,5 +1,6 @@
 #include <stdatomic.h>
 #include <stdio.h>
+#include "../src/api/alloc.h"
 #include "../src/api/thread.h"
 
 #define NUM_THREADS 10
@@ -8,11 +9,17 @@
 thread_func_result thread_func(void* param) {
     (void)param;
     atomic_ulong *p = (atomic_ulong*)param;
-    unsigned long local_counter = 0;
+    // the thread's own allocator, no other thread allocates from it
+    allocator_ptr_t allocator = thread->allocator();
+    sp_ptr_t local = alloc->alloc(&allocator, sizeof(unsigned long));
+    unsigned long* local_counter = (unsigned long*)alloc->retain(&local);
+    *local_counter = 0;
     for (int i = 0; i < COUNTER; i++) {
-        local_counter += 1;
+        *local_counter += 1;
     }
-    atomic_fetch_add(p, local_counter);
+    atomic_fetch_add(p, *local_counter);
+    alloc->release(&local);
+    alloc->release(&local);
     return (thread_func_result)*p;
 }
 
@@ -0,0 +1,158 @@
+#include <stdatomic.h>
+#include <stdio.h>
+#include "../src/api/alloc.h"
+#include "../src/api/thread.h"
+
+#define NUM_THREADS 4
+#define NUM_TASKS 10000
+#define NUM_SUBTASKS 4
+#define NUM_VALUES 1000000
+#define NUM_MESSAGES 1024
+#define BATCH_SIZE 32
+
+typedef struct shared {
+    thread_pool_ptr_t pool;
+    atomic_ulong counter;
+} shared_t;
+
+static void subtask(void* param) {
+    shared_t* shared = (shared_t*)param;
+    atomic_fetch_add(&shared->counter, 1);
+}
+
+// tasks submitted from a worker go to its own deque, idle workers steal them from there
+static void task(void* param) {
+    shared_t* shared = (shared_t*)param;
+    atomic_fetch_add(&shared->counter, 1);
+    for (int i = 0; i < NUM_SUBTASKS; i++) {
+        thread->pool_submit(&shared->pool, subtask, shared);
+    }
+}
+
+static void square(size_t begin, size_t end, void* ctx) {
+    unsigned long* values = (unsigned long*)ctx;
+    for (size_t i = begin; i < end; i++) {
+        values[i] = (unsigned long)i * i;
+    }
+}
+
+static void sum(size_t begin, size_t end, void* ctx, void* partial) {
+    const unsigned long* values = (const unsigned long*)ctx;
+    unsigned long local = 0;
+    for (size_t i = begin; i < end; i++) {
+        local += values[i];
+    }
+    *(unsigned long*)partial += local;
+}
+
+static void combine_sum(void* result, const void* partial, void* ctx) {
+    (void)ctx;
+    *(unsigned long*)result += *(const unsigned long*)partial;
+}
+
+// a pipeline stage: the previous stage's result comes in as input
+static void count_even(const void* input, void* param, void* result) {
+    (void)input;
+    const unsigned long* values = (const unsigned long*)param;
+    unsigned long even = 0;
+    for (size_t i = 0; i < NUM_VALUES; i++) {
+        even += values[i] % 2 == 0;
+    }
+    *(unsigned long*)result = even;
+}
+
+static void to_percent(const void* input, void* param, void* result) {
+    (void)param;
+    *(double*)result = 100.0 * (double)*(const unsigned long*)input / NUM_VALUES;
+}
+
+typedef struct mailbox {
+    thread_queue_ptr_t inbox;
+    thread_queue_ptr_t outbox;
+    atomic_ulong total;
+} mailbox_t;
+
+// consumers take objects in batches, read them and pass them on, each handle they pop is a reference they own
+static void consume(void* param) {
+    mailbox_t* mailbox = (mailbox_t*)param;
+    sp_ptr_t batch[BATCH_SIZE];
+    size_t count;
+    while ((count = thread->queue_pop_batch(&mailbox->inbox, batch, BATCH_SIZE)) > 0) {
+        for (size_t i = 0; i < count; i++) {
+            unsigned long* message = (unsigned long*)alloc->retain(&batch[i]);
+            atomic_fetch_add(&mailbox->total, *message);
+            alloc->release(&batch[i]);
+            while (!thread->queue_push(&mailbox->outbox, &batch[i])) {
+            }
+            alloc->release(&batch[i]);
+        }
+    }
+}
+
+int main() {
+    shared_t shared;
+    shared.pool = thread->pool_create(NUM_THREADS);
+    atomic_init(&shared.counter, 0);
+    for (int round = 0; round < 3; round++) {
+        for (int i = 0; i < NUM_TASKS; i++) {
+            thread->pool_submit(&shared.pool, task, &shared);
+        }
+        thread->pool_wait(&shared.pool);
+        printf("round %d counter value %lu\n", round, (unsigned long)atomic_load(&shared.counter));
+    }
+
+    allocator_ptr_t allocator = alloc->init();
+    sp_ptr_t buffer = alloc->alloc(&allocator, sizeof(unsigned long) * NUM_VALUES);
+    unsigned long* values = (unsigned long*)alloc->retain(&buffer);
+    thread->parallel_for(&shared.pool, 0, NUM_VALUES, 0, square, values);
+    unsigned long total = 0;
+    thread->parallel_reduce(&shared.pool, 0, NUM_VALUES, 4096, sum, combine_sum, &total, sizeof(total), values);
+    printf("sum of squares below %d is %lu\n", NUM_VALUES, total);
+
+    thread_future_ptr_t even = thread->future_submit(&shared.pool, count_even, values, sizeof(unsigned long));
+    thread_future_ptr_t percent = thread->future_then(&even, to_percent, NULL, sizeof(double));
+    double share = 0;
+    thread->future_wait(&percent, &share);
+    printf("even squares %.1f%%\n", share);
+    thread->future_release(&percent);
+    thread->future_release(&even);
+    alloc->release(&buffer);
+    alloc->release(&buffer);
+    alloc->destroy(&allocator);
+
+    // objects handed between threads need atomic reference counts, and a last reference dropped on a worker waits
+    // for this thread, the allocator's owner, to free it
+    allocator = alloc->init_with(ALLOC_ATOMIC_REF_COUNT);
+    mailbox_t mailbox;
+    mailbox.inbox = thread->queue_create(NUM_MESSAGES);
+    mailbox.outbox = thread->queue_create(NUM_MESSAGES);
+    atomic_init(&mailbox.total, 0);
+    for (int i = 0; i < NUM_MESSAGES; i++) {
+        sp_ptr_t message = alloc->alloc(&allocator, sizeof(unsigned long));
+        *(unsigned long*)alloc->retain(&message) = (unsigned long)i;
+        alloc->release(&message);
+        thread->queue_push(&mailbox.inbox, &message);
+        alloc->release(&message);
+    }
+    for (int i = 0; i < NUM_THREADS; i++) {
+        thread->pool_submit(&shared.pool, consume, &mailbox);
+    }
+    thread->pool_wait(&shared.pool);
+    sp_ptr_t batch[BATCH_SIZE];
+    size_t count;
+    size_t returned = 0;
+    while ((count = thread->queue_pop_batch(&mailbox.outbox, batch, BATCH_SIZE)) > 0) {
+        for (size_t i = 0; i < count; i++) {
+            alloc->release(&batch[i]);
+        }
+        returned += count;
+    }
+    printf("messages returned %zu, total %lu\n", returned, (unsigned long)atomic_load(&mailbox.total));
+    thread->queue_destroy(&mailbox.inbox);
+    thread->queue_destroy(&mailbox.outbox);
+    alloc->gc(&allocator);
+    alloc->destroy(&allocator);
+
+    thread->pool_destroy(&shared.pool);
+    return 0;
+}
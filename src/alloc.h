@@ -3,8 +3,11 @@
 
 #include <stdlib.h>
 #include <stddef.h>
+#include <string.h>
+#include <stdatomic.h>
 
 #include "api/alloc.h"
+#include "sync.h"
 
 typedef struct mem_block {
     struct sp* ptr;
@@ -12,11 +15,85 @@ typedef struct mem_block {
     struct mem_block* prev;
 } mem_block_t;
 
+#define REWIND_HISTORY 16 // rewinds remembered to tell stale marks apart, older ones are merged
+
+typedef struct rewind_record {
+    unsigned long epoch; // the allocator's epoch when the rewind ran
+    unsigned long serial; // the serial it went back to
+} rewind_record_t;
+
 typedef struct allocator {
     mem_block_t* block_list;
     int total_blocks;
+    unsigned int flags;
+    unsigned long serial; // serial number given to the next object
+    struct handle_table* handles; // with ALLOC_HANDLE_TABLE, see handles.h
+    mem_block_t* sweep_cursor; // the next block gc_step frees
+    int sweeping; // a gc_step sweep is under way
+    unsigned long epoch; // one plus the rewinds and resets so far, so that an empty mark is never current
+    rewind_record_t rewinds[REWIND_HISTORY]; // oldest first, with rising serials
+    size_t rewind_count;
 } allocator_t;
 
+static inline void rewinds_init(allocator_t* allocator) {
+    allocator->epoch = 1;
+    allocator->rewind_count = 0;
+}
+
+// a mark goes stale once a later rewind or reset went back past it; the records are kept with rising serials, so
+// the first one at or after the mark's epoch is the lowest any of those went
+static inline int mark_is_stale(const allocator_t* allocator, alloc_mark_t mark) {
+    if (mark.epoch == 0 || mark.epoch > allocator->epoch) {
+        return 1;
+    }
+    for (size_t i = 0; i < allocator->rewind_count; i++) {
+        if (allocator->rewinds[i].epoch >= mark.epoch) {
+            return allocator->rewinds[i].serial < mark.serial;
+        }
+    }
+    return 0;
+}
+
+// serials are handed out again from the one rewound to; once the history is full the two oldest records merge into
+// one that goes as low as the older and reaches as far as the newer, which may call a live mark stale but never
+// the other way round
+static inline void mark_record_rewind(allocator_t* allocator, unsigned long serial) {
+    while (allocator->rewind_count > 0 && allocator->rewinds[allocator->rewind_count - 1].serial >= serial) {
+        allocator->rewind_count--;
+    }
+    if (allocator->rewind_count == REWIND_HISTORY) {
+        allocator->rewinds[1].serial = allocator->rewinds[0].serial;
+        memmove(&allocator->rewinds[0], &allocator->rewinds[1], sizeof(rewind_record_t) * (REWIND_HISTORY - 1));
+        allocator->rewind_count--;
+    }
+    allocator->rewinds[allocator->rewind_count].epoch = allocator->epoch;
+    allocator->rewinds[allocator->rewind_count].serial = serial;
+    allocator->rewind_count++;
+    allocator->epoch++;
+    allocator->serial = serial;
+}
+
+// blocks leaving block_list while a gc_step sweep is under way must not be left under its cursor
+static inline void sweep_skip(allocator_t* allocator, mem_block_t* block) {
+    if (allocator->sweep_cursor == block) {
+        allocator->sweep_cursor = block->next;
+    }
+}
+
+// gc_step sweeps the objects that were live when it started, newer ones go in front of the cursor
+static inline mem_block_t* sweep_start(allocator_t* allocator) {
+    if (!allocator->sweeping) {
+        allocator->sweeping = 1;
+        allocator->sweep_cursor = allocator->block_list;
+    }
+    return allocator->sweep_cursor;
+}
+
+static inline void sweep_stop(allocator_t* allocator) {
+    allocator->sweep_cursor = NULL;
+    allocator->sweeping = 0;
+}
+
 typedef struct sp* sp_ptr;
 
 typedef struct sp {
@@ -25,7 +102,160 @@ typedef struct sp {
     mem_block_t* block;
     allocator_t* allocator;
     size_t size;
-    unsigned long ref_count;
+    atomic_uint ref_count; // 32 bits, so that the handle fits in without growing the object header
+    alloc_handle_t handle;
 } sp_t;
 
+// in the default mode ref_count is only touched with relaxed loads and stores, which compile to plain moves
+static inline void sp_add_reference(sp_t* sp) {
+    if (sp->allocator->flags & ALLOC_ATOMIC_REF_COUNT) {
+        atomic_fetch_add_explicit(&sp->ref_count, 1, memory_order_relaxed);
+        return;
+    }
+    unsigned int count = atomic_load_explicit(&sp->ref_count, memory_order_relaxed);
+    atomic_store_explicit(&sp->ref_count, count + 1, memory_order_relaxed);
+}
+
+// returns 1 when the last reference was dropped and the object can be freed
+static inline int sp_drop_reference(sp_t* sp) {
+    if (sp->allocator->flags & ALLOC_ATOMIC_REF_COUNT) {
+        // release orders this thread's writes before the decrement, the acquire fence
+        // makes every other thread's writes visible to the thread that frees the object
+        if (atomic_fetch_sub_explicit(&sp->ref_count, 1, memory_order_release) == 1) {
+            atomic_thread_fence(memory_order_acquire);
+            return 1;
+        }
+        return 0;
+    }
+    unsigned int count = atomic_load_explicit(&sp->ref_count, memory_order_relaxed);
+    if (count == 0) {
+        return 0;
+    }
+    atomic_store_explicit(&sp->ref_count, count - 1, memory_order_relaxed);
+    return count == 1;
+}
+
+// one size class worth of alloc_t::stats counters; each set has a single writer, a thread or whoever holds a lock,
+// and byte counts wrap so that only their sum over every set is meaningful
+typedef struct class_counters {
+    atomic_ullong allocs;
+    atomic_ullong releases;
+    atomic_ullong live_bytes;
+    atomic_ullong slot_bytes;
+} class_counters_t;
+
+// a relaxed load and store compile to plain moves, readers on other threads still see whole values
+static inline void counter_add(atomic_ullong* counter, unsigned long long value) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + value, memory_order_relaxed);
+}
+
+static inline void counters_alloc(class_counters_t* counters, size_t count, size_t live_bytes, size_t slot_bytes) {
+    counter_add(&counters->allocs, count);
+    counter_add(&counters->live_bytes, live_bytes);
+    counter_add(&counters->slot_bytes, slot_bytes);
+}
+
+static inline void counters_release(class_counters_t* counters, size_t count, size_t live_bytes, size_t slot_bytes) {
+    counter_add(&counters->releases, count);
+    counter_add(&counters->live_bytes, 0ULL - live_bytes);
+    counter_add(&counters->slot_bytes, 0ULL - slot_bytes);
+}
+
+static inline void counters_resize(class_counters_t* counters, size_t old_size, size_t new_size) {
+    counter_add(&counters->live_bytes, (unsigned long long)new_size - old_size);
+}
+
+static inline void counters_read(class_counters_t* counters, alloc_class_stats_t* row) {
+    row->allocs += (unsigned long)atomic_load_explicit(&counters->allocs, memory_order_relaxed);
+    row->releases += (unsigned long)atomic_load_explicit(&counters->releases, memory_order_relaxed);
+    row->live_bytes += (size_t)atomic_load_explicit(&counters->live_bytes, memory_order_relaxed);
+    row->slot_bytes += (size_t)atomic_load_explicit(&counters->slot_bytes, memory_order_relaxed);
+}
+
+// an object occupies one contiguous slot: the sp_t, its mem_block_t, then the payload
+typedef struct object {
+    sp_t sp;
+    mem_block_t block;
+    union {
+        unsigned long serial; // allocation order while the object is live, see alloc_t::mark
+        struct object* next; // links objects whose release was deferred by the backend
+        size_t slot_extent; // storage objects: bytes the owner uses of its own slot
+    };
+} object_t;
+
+// an allocator frees its objects on the thread that owns it; the address of alloc_thread is unique per live thread
+static THREAD_LOCAL char alloc_thread;
+
+static inline const void* alloc_thread_id(void) {
+    return &alloc_thread;
+}
+
+// objects whose last reference was dropped on a thread other than the owner wait on a stack linked through
+// object_t::next; any thread pushes, the owner takes the whole stack at once
+static inline void remote_free_push(_Atomic(object_t*)* head, object_t* first, object_t* last) {
+    object_t* top = atomic_load_explicit(head, memory_order_relaxed);
+    do {
+        last->next = top;
+    } while (!atomic_compare_exchange_weak_explicit(head, &top, first, memory_order_release, memory_order_relaxed));
+}
+
+static inline object_t* remote_free_take(_Atomic(object_t*)* head) {
+    if (atomic_load_explicit(head, memory_order_relaxed) == NULL) {
+        return NULL;
+    }
+    return atomic_exchange_explicit(head, NULL, memory_order_acquire);
+}
+
+#define OBJECT_ALIGNMENT 16
+#define OBJECT_HEADER_SIZE ((sizeof(object_t) + OBJECT_ALIGNMENT - 1) & ~(size_t)(OBJECT_ALIGNMENT - 1))
+#define OBJECT_PAYLOAD(object) ((void*)((char*)(object) + OBJECT_HEADER_SIZE))
+#define OBJECT_MAX_ALIGNMENT 4096
+
+// resize moves a payload that outgrows its slot into a storage object, which stays out of block_list and whose
+// mem_block_t points back at its owner; every other payload is at least OBJECT_HEADER_SIZE into its own slot
+static inline object_t* object_storage(const object_t* object) {
+    object_t* storage = (object_t*)((char*)object->sp.ptr - OBJECT_HEADER_SIZE);
+    if (storage == object || storage->block.ptr != &object->sp) {
+        return NULL;
+    }
+    return storage;
+}
+
+// turns a slot holding size bytes of payload at OBJECT_PAYLOAD into the storage of owner
+static inline void object_init_storage(object_t* storage, object_t* owner, size_t size) {
+    storage->sp.self = NULL;
+    storage->sp.ptr = OBJECT_PAYLOAD(storage);
+    storage->sp.block = NULL;
+    storage->sp.allocator = owner->sp.allocator;
+    storage->sp.size = size;
+    atomic_init(&storage->sp.ref_count, 0);
+    storage->sp.handle = 0;
+    storage->block.ptr = &owner->sp;
+    storage->block.next = NULL;
+    storage->block.prev = NULL;
+    storage->slot_extent = 0;
+}
+
+// alloc_aligned takes powers of two up to OBJECT_MAX_ALIGNMENT, returns 0 for anything else
+static inline size_t object_alignment(size_t alignment) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0 || alignment > OBJECT_MAX_ALIGNMENT) {
+        return 0;
+    }
+    return alignment < OBJECT_ALIGNMENT ? OBJECT_ALIGNMENT : alignment;
+}
+
+// fills in fragmentation and the totals once the rows of a stats snapshot are summed up
+static inline void stats_finish(alloc_stats_t* stats) {
+    for (size_t i = 0; i < stats->class_count; i++) {
+        alloc_class_stats_t* row = &stats->classes[i];
+        size_t used = row->live_bytes + (size_t)(row->allocs - row->releases) * OBJECT_HEADER_SIZE;
+        row->fragmentation = row->slot_bytes > used ? row->slot_bytes - used : 0;
+        stats->allocs += row->allocs;
+        stats->releases += row->releases;
+        stats->live_bytes += row->live_bytes;
+        stats->slot_bytes += row->slot_bytes;
+        stats->fragmentation += row->fragmentation;
+    }
+}
+
 #endif // ALLOC_H
\ No newline at end of file
@@ -10,17 +10,110 @@
 #include <pthread.h>
 #endif
 
+// retain/release update reference counts atomically, so that any thread can hold and drop references
+#define ALLOC_ATOMIC_REF_COUNT 0x1
+#define ALLOC_HUGE_PAGES 0x2 // back the arenas of the bucket and bump backends with 2MB pages
+// set in flags() when ALLOC_HUGE_PAGES was requested, neither means the arenas got regular pages
+#define ALLOC_HUGE_PAGES_RESERVED 0x4 // arenas use reserved huge pages (MAP_HUGETLB, MEM_LARGE_PAGES)
+#define ALLOC_HUGE_PAGES_TRANSPARENT 0x8 // arenas are advised to use transparent huge pages (MADV_HUGEPAGE)
+#define ALLOC_HANDLE_TABLE 0x10 // objects also get a 32-bit handle, left out of flags() when the table cannot be mapped
+
 typedef const struct sp* sp_ptr_t;
 typedef const struct allocator* allocator_ptr_t;
 typedef const struct alloc* alloc_ptr_t;
 
+// a slot index and a generation in 32 bits, 0 is never a valid handle
+typedef unsigned int alloc_handle_t;
+
+// a checkpoint returned by mark: the allocation serial and, for arena backends, the arena position
+typedef struct alloc_mark {
+    unsigned long serial;
+    const void* region;
+    size_t offset;
+    unsigned long epoch; // tells a mark that an earlier rewind or reset went back past, 0 for the empty mark
+} alloc_mark_t;
+
+#define ALLOC_STATS_CLASSES 32 // rows in alloc_stats_t, enough for the size classes of every backend
+
+typedef struct alloc_class_stats {
+    size_t block_size; // slot size of the class, 0 for objects that get a slot of their own size
+    unsigned long allocs;
+    unsigned long releases;
+    size_t live_bytes; // payload bytes of live objects
+    size_t slot_bytes; // bytes of the slots live objects occupy
+    size_t fragmentation; // bytes of those slots used by neither an object header nor a payload
+    size_t free_blocks; // blocks on free lists, ready to be handed out again
+} alloc_class_stats_t;
+
+typedef struct alloc_stats {
+    unsigned long allocs;
+    unsigned long releases;
+    size_t live_bytes;
+    size_t slot_bytes;
+    size_t fragmentation;
+    size_t reserved_bytes; // bytes mapped from the OS
+    size_t peak_reserved_bytes; // high-water mark of reserved_bytes
+    size_t class_count; // rows of classes in use
+    alloc_class_stats_t classes[ALLOC_STATS_CLASSES];
+} alloc_stats_t;
+
 typedef struct alloc
 {
     allocator_ptr_t (*init)(void);
+    allocator_ptr_t (*init_with)(unsigned int flags);
     sp_ptr_t (*alloc)(const allocator_ptr_t* ptr, size_t size);
+    size_t (*alloc_batch)(const allocator_ptr_t* ptr, size_t size, size_t count, sp_ptr_t* out);
+    sp_ptr_t (*alloc_aligned)(const allocator_ptr_t* ptr, size_t size, size_t alignment);
     void* (*retain)(const sp_ptr_t* pts);
+    // grows or shrinks the payload, in place when the slot allows it; the sp_t stays the same, a moved payload
+    // is 16 byte aligned and the new payload is returned, NULL leaves the object untouched
+    void* (*resize)(const sp_ptr_t* ptr, size_t size);
+    // the last release frees the object on the thread that created the allocator; on any other thread the object
+    // is queued and freed by the owner's next alloc, gc, gc_step, rewind or compact
     void (*release)(const sp_ptr_t* ptr);
+    void (*release_batch)(sp_ptr_t* sps, size_t count);
+    // with ALLOC_HANDLE_TABLE a handle stays valid until the last reference to its object is dropped, also when the
+    // object then waits for its owner to free it; after that it resolves to NULL
+    // without any read of the object's memory, so a stale handle released twice is harmless
+    alloc_handle_t (*handle)(const sp_ptr_t* ptr); // 0 without a table or once it is full
+    sp_ptr_t (*resolve)(const allocator_ptr_t* ptr, alloc_handle_t handle);
+    void* (*handle_retain)(const allocator_ptr_t* ptr, alloc_handle_t handle);
+    void (*handle_release)(const allocator_ptr_t* ptr, alloc_handle_t handle);
+    // gc, gc_step, compact, mark, rewind and reset belong to the owner; on any other thread they do nothing, gc_step
+    // returns 1, compact 0 and mark the same empty mark as for a NULL allocator
     void (*gc)(const allocator_ptr_t* ptr);
+    // gc in steps: a sweep covers the objects live when its first step ran, each step frees at most max_blocks of
+    // them (0 for no limit) and returns 1 once the sweep is finished; objects allocated in between are left alone,
+    // ones released in between are skipped, and gc or reset finish a sweep at once
+    int (*gc_step)(const allocator_ptr_t* ptr, size_t max_blocks);
+    // moves payloads that live apart from their sp_t, the ones resize moved out, into the densest memory of their
+    // class, then gives pages nobody uses back to the OS; returns the bytes moved, and payload pointers taken before
+    // the call go stale. A budget (0 for no limit) bounds the work of a call, the bytes moved plus a few dozen for
+    // every object looked at, and the next call goes on where it stopped; a call without one goes over every object
+    // and returns 0 once nothing is left to move.
+    // With ALLOC_HANDLE_TABLE objects that have a handle and no alignment of their own move whole, so their sp_t
+    // pointers go stale as well and have to be resolved from the handle again
+    size_t (*compact)(const allocator_ptr_t* ptr, size_t budget);
+    alloc_mark_t (*mark)(const allocator_ptr_t* ptr);
+    // frees the objects allocated after the mark that are still live. The bump backend moves its arena back to the
+    // mark, giving up whole regions, and visits those objects only to drop their counters and handles; the bucket
+    // and reference backends have no arena position to go back to, so there rewind is a bulk release of those
+    // objects to the mark, costing what releasing each of them would. Serials are handed out again from the mark's,
+    // so nested marks rewind in any order, but a mark an earlier rewind or reset went back past is stale and
+    // rewinding to it does nothing. Objects older than the mark keep their payloads: the bump backend keeps the
+    // arena a payload resize moved after the mark went to until a rewind past its object or a reset
+    void (*rewind)(const allocator_ptr_t* ptr, alloc_mark_t mark);
+    // frees everything and makes every mark but one taken on an empty allocator stale; the bump backend drops its
+    // objects in O(regions) without walking them, on the others reset is gc followed by the stale marks
+    void (*reset)(const allocator_ptr_t* ptr);
+    // makes the calling thread the owner, the one that frees objects and whose releases are not queued; what other
+    // threads queued so far is freed right away. The old owner has to be done with the allocator, and the handoff
+    // needs the usual synchronization, such as a join or a queue
+    void (*adopt)(const allocator_ptr_t* ptr);
+    // gives back the blocks the calling thread keeps cached for the allocator, for threads that are about to exit
+    void (*flush)(const allocator_ptr_t* ptr);
+    unsigned int (*flags)(const allocator_ptr_t* ptr);
+    void (*stats)(const allocator_ptr_t* ptr, alloc_stats_t* stats);
     void (*destroy)(const allocator_ptr_t* ptr);
 } alloc_t;
 
@@ -22,7 +22,17 @@ typedef pthread_t handle_t;
 
 typedef const struct thread_sp* thread_sp_ptr_t;
 typedef const struct allocator* allocator_ptr_t;
+typedef const struct sp* sp_ptr_t;
 typedef const struct thread* thread_ptr_t;
+typedef const struct thread_pool* thread_pool_ptr_t;
+typedef const struct thread_future* thread_future_ptr_t;
+typedef const struct thread_queue* thread_queue_ptr_t;
+typedef void (*thread_task_ptr_t)(void* param);
+typedef void (*thread_range_ptr_t)(size_t begin, size_t end, void* ctx);
+typedef void (*thread_reduce_ptr_t)(size_t begin, size_t end, void* ctx, void* partial);
+typedef void (*thread_combine_ptr_t)(void* result, const void* partial, void* ctx);
+// input is the result of the future a continuation was chained to, NULL for submitted ones
+typedef void (*thread_future_func_t)(const void* input, void* param, void* result);
 
 typedef struct thread
 {
@@ -30,6 +40,39 @@ typedef struct thread
     void (*start)(const thread_sp_ptr_t* ptr);
     void (*join)(const thread_sp_ptr_t* ptr);
     void (*destroy)(const thread_sp_ptr_t* ptr);
+    // a pool keeps thread_num workers running, submitted tasks are spread over their work-stealing deques
+    thread_pool_ptr_t (*pool_create)(int thread_num);
+    int (*pool_submit)(const thread_pool_ptr_t* ptr, thread_task_ptr_t task, void* param); // 0 if the task was not queued
+    void (*pool_wait)(const thread_pool_ptr_t* ptr); // until every submitted task finished, not from inside a task
+    void (*pool_destroy)(const thread_pool_ptr_t* ptr); // runs the tasks still queued, then joins the workers
+    // every thread started by start and every pool worker creates an allocator with alloc->init and owns it; the
+    // thread that joins it adopts, gc's and destroys it. This returns the calling thread's one, NULL on threads the
+    // module did not start
+    allocator_ptr_t (*allocator)(void);
+    // body runs on chunks of grain indexes of [begin, end) that the pool's workers and the caller claim as they go,
+    // grain 0 picks one; returns once every chunk is done, 0 if nothing ran
+    int (*parallel_for)(const thread_pool_ptr_t* ptr, size_t begin, size_t end, size_t grain, thread_range_ptr_t body, void* ctx);
+    // result holds the identity on entry; every thread folds its chunks into its own copy of it, and the copies are
+    // combined into result once all chunks are done
+    int (*parallel_reduce)(const thread_pool_ptr_t* ptr, size_t begin, size_t end, size_t grain, thread_reduce_ptr_t body,
+        thread_combine_ptr_t combine, void* result, size_t result_size, void* ctx);
+    // a future runs func on the pool and keeps the result_size bytes it writes to result; every future returned
+    // has to be released, the task and its continuations hold references of their own
+    thread_future_ptr_t (*future_submit)(const thread_pool_ptr_t* ptr, thread_future_func_t func, void* param, size_t result_size);
+    thread_future_ptr_t (*future_then)(const thread_future_ptr_t* ptr, thread_future_func_t func, void* param, size_t result_size);
+    int (*future_try_get)(const thread_future_ptr_t* ptr, void* result); // 0 while the future is not done
+    void (*future_wait)(const thread_future_ptr_t* ptr, void* result); // result may be NULL
+    void (*future_release)(const thread_future_ptr_t* ptr);
+    // a bounded queue of object handles shared by any number of producers and consumers; push retains the object,
+    // pop hands that reference to the caller. Objects crossing threads need ALLOC_ATOMIC_REF_COUNT, and only the
+    // allocator's owner frees them: a last release on any other thread, queue_destroy's included, leaves the object
+    // queued on the allocator until the owner's next alloc, gc, gc_step, rewind or compact, see alloc_t::release
+    thread_queue_ptr_t (*queue_create)(size_t capacity); // rounded up to a power of two
+    int (*queue_push)(const thread_queue_ptr_t* ptr, const sp_ptr_t* sp); // 0 if the queue is full
+    sp_ptr_t (*queue_pop)(const thread_queue_ptr_t* ptr); // NULL if the queue is empty
+    size_t (*queue_push_batch)(const thread_queue_ptr_t* ptr, const sp_ptr_t* sps, size_t count); // leading handles pushed
+    size_t (*queue_pop_batch)(const thread_queue_ptr_t* ptr, sp_ptr_t* out, size_t count); // handles written to out
+    void (*queue_destroy)(const thread_queue_ptr_t* ptr); // releases the objects still queued
 } thread_t;
 
 
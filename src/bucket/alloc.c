@@ -1,13 +1,29 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
 
 #define MEMORY_SIZE (4096 * 100) // 400KB initial memory block
+#define MAX_CHUNK_SIZE ((size_t)4096 * 65536) // 256MB, chunk sizes double up to this limit
+#define THREAD_CACHE_BATCH 16 // blocks moved between a thread cache and the shared buckets at once
+#define THREAD_CACHE_LIMIT 64 // blocks a thread cache keeps per size class before draining a batch
+#define PAGE_SIZE 4096
+#define LARGE_SPAN_PAGES 64 // spans up to 256KB are cached by page count, bigger ones go straight back to the OS
+#define LARGE_CACHE_LIMIT ((size_t)4096 * 4096) // 16MB of released spans kept for reuse
+#define SLAB_SIZE ((size_t)4096 * 16) // 64KB slabs, aligned to their size so a block finds its slab by masking
+#define SLAB_BITMAP_WORDS (SLAB_SIZE / 16 / 64)
+#define COMPACT_SCAN_COST 64 // budget bytes compact charges for every object or slab it looks at
 
 #include "../api/alloc.h"
 #include "../alloc.h"
+#include "../sync.h"
+#include "../pages.h"
+#include "../handles.h"
 
-#define BUCKET_COUNT 9
+#define BUCKET_COUNT 28 // four size classes per power of two, 16 bytes apart up to 64
+#define MAX_BUCKET_SIZE 4096
+#define LARGE_ROW BUCKET_COUNT // counters of objects in large spans follow those of the size classes
 extern const size_t bucket_sizes[BUCKET_COUNT];
 
 typedef struct free_list_node {
@@ -15,46 +31,386 @@ typedef struct free_list_node {
     struct free_list_node* prev;
 } free_list_node_t;
 
+typedef struct chunk {
+    struct chunk* next;
+    size_t size;
+} chunk_t;
+
+typedef struct large_span {
+    struct large_span* next;
+} large_span_t;
+
+typedef struct slab {
+    struct slab* next;
+    struct slab* prev;
+    size_t block_size;
+    int bucket_index;
+    unsigned int capacity;
+    unsigned int free_count;
+    unsigned int hint; // lowest bitmap word that may still have a free bit
+    unsigned long long free_bitmap[SLAB_BITMAP_WORDS];
+} slab_t;
+
+#define SLAB_HEADER_SIZE ((sizeof(slab_t) + OBJECT_ALIGNMENT - 1) & ~(size_t)(OBJECT_ALIGNMENT - 1))
+#define SLAB_OF(ptr) ((slab_t*)((uintptr_t)(ptr) & ~(uintptr_t)(SLAB_SIZE - 1)))
+
 typedef struct bucket {
-    free_list_node_t* free_list;
+    slab_t* partial;
+    slab_t* full;
     size_t block_size;
 } bucket_t;
 
+typedef struct thread_cache_bin {
+    free_list_node_t* free_list;
+    size_t count;
+} thread_cache_bin_t;
+
+typedef struct thread_cache {
+    struct thread_cache* next;
+    const void* owner;
+    thread_cache_bin_t bins[BUCKET_COUNT];
+    class_counters_t counters[BUCKET_COUNT + 1];
+} thread_cache_t;
+
 typedef struct bucket_allocator {
     allocator_t base;
     bucket_t buckets[BUCKET_COUNT];
     void* memory_block;
     size_t memory_offset;
     size_t memory_size;
+    chunk_t* chunks;
+    size_t next_chunk_size;
+    unsigned int arena_flags; // ALLOC_HUGE_PAGES and the page mode the chunks got, kept apart from base.flags which is read without the lock
+    large_span_t* large_spans[LARGE_SPAN_PAGES + 1];
+    size_t large_cached;
+    slab_t* empty_slabs;
+    mem_block_t* compact_cursor; // the next block a compact with a budget looks at, NULL to start at the head
+    class_counters_t counters[BUCKET_COUNT + 1]; // for threads without a cache and for gc, under the lock
+    atomic_size_t reserved_bytes;
+    atomic_size_t peak_reserved_bytes;
+    unsigned long id;
+    // the thread that frees objects, see alloc_thread_id; block_list, total_blocks and serial are its alone
+    _Atomic(const void*) owner;
+    thread_cache_t* thread_caches;
+    lock_t lock;
+    // written by foreign threads only, kept off the cache lines the owner uses on every call
+    char remote_free_pad[CACHE_LINE_SIZE];
+    _Atomic(object_t*) remote_free;
+    _Atomic(mem_block_t*) remote_alloc;
 } bucket_allocator_t;
 
 static allocator_ptr_t _init(void);
+static allocator_ptr_t _init_with(unsigned int flags);
 static sp_ptr_t _alloc(const allocator_ptr_t* ptr, size_t size);
+static size_t _alloc_batch(const allocator_ptr_t* ptr, size_t size, size_t count, sp_ptr_t* out);
+static sp_ptr_t _alloc_aligned(const allocator_ptr_t* ptr, size_t size, size_t alignment);
 static void* _retain(const sp_ptr_t* ptr);
+static void* _resize(const sp_ptr_t* ptr, size_t size);
 static void _release(const sp_ptr_t* ptr);
+static void _release_batch(sp_ptr_t* sps, size_t count);
+static alloc_handle_t _handle(const sp_ptr_t* sp);
+static sp_ptr_t _resolve(const allocator_ptr_t* ptr, alloc_handle_t handle);
+static void* _handle_retain(const allocator_ptr_t* ptr, alloc_handle_t handle);
+static void _handle_release(const allocator_ptr_t* ptr, alloc_handle_t handle);
 static void _gc(const allocator_ptr_t* ptr);
+static int _gc_step(const allocator_ptr_t* ptr, size_t max_blocks);
+static size_t _compact(const allocator_ptr_t* ptr, size_t budget);
+static alloc_mark_t _mark(const allocator_ptr_t* ptr);
+static void _rewind(const allocator_ptr_t* ptr, alloc_mark_t mark);
+static void _reset(const allocator_ptr_t* ptr);
+static void _adopt(const allocator_ptr_t* ptr);
+static void _flush(const allocator_ptr_t* ptr);
+static unsigned int _flags(const allocator_ptr_t* ptr);
+static void _stats(const allocator_ptr_t* ptr, alloc_stats_t* stats);
 static void _destroy(const allocator_ptr_t* ptr);
 
 static alloc_t reference_counting_allocator = {
     .init = _init,
+    .init_with = _init_with,
     .alloc = _alloc,
+    .alloc_batch = _alloc_batch,
+    .alloc_aligned = _alloc_aligned,
     .retain = _retain,
+    .resize = _resize,
     .release = _release,
+    .release_batch = _release_batch,
+    .handle = _handle,
+    .resolve = _resolve,
+    .handle_retain = _handle_retain,
+    .handle_release = _handle_release,
     .gc = _gc,
+    .gc_step = _gc_step,
+    .compact = _compact,
+    .mark = _mark,
+    .rewind = _rewind,
+    .reset = _reset,
+    .adopt = _adopt,
+    .flush = _flush,
+    .flags = _flags,
+    .stats = _stats,
     .destroy = _destroy
 };
 
 alloc_ptr_t alloc = &reference_counting_allocator;
 
-const size_t bucket_sizes[BUCKET_COUNT] = {16, 32, 64, 128, 256, 512, 1024, 2048, 4096};
+static atomic_ulong next_allocator_id = 1;
+
+static THREAD_LOCAL thread_cache_t* thread_cache = NULL;
+static THREAD_LOCAL unsigned long thread_cache_id = 0;
+
+const size_t bucket_sizes[BUCKET_COUNT] = {
+    16, 32, 48, 64,
+    80, 96, 112, 128,
+    160, 192, 224, 256,
+    320, 384, 448, 512,
+    640, 768, 896, 1024,
+    1280, 1536, 1792, 2048,
+    2560, 3072, 3584, 4096
+};
+
+static int _bit_scan_reverse(size_t value) {
+#if defined(_MSC_VER) && !defined(__clang__)
+    unsigned long index;
+    _BitScanReverse64(&index, (unsigned long long)value);
+    return (int)index;
+#else
+    return 63 - __builtin_clzll((unsigned long long)value);
+#endif
+}
 
 static int find_bucket_index(size_t size) {
-    for (int i = 0; i < BUCKET_COUNT; i++) {
-        if (size <= bucket_sizes[i]) {
-            return i;
+    if (size <= 64) {
+        return size == 0 ? 0 : (int)((size - 1) >> 4);
+    }
+    if (size > MAX_BUCKET_SIZE) {
+        return -1;
+    }
+    // size - 1 lies in [2^p, 2^(p + 1)), split into four classes of 2^(p - 2) bytes
+    int shift = _bit_scan_reverse(size - 1) - 2;
+    return (shift - 4) * 4 + (int)((size - 1) >> shift);
+}
+
+static void* _map_pages(size_t size) {
+    void* memory_block = NULL;
+#ifdef _WIN32
+    memory_block = VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+#else
+    memory_block = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory_block == MAP_FAILED) {
+        memory_block = NULL;
+    }
+#endif
+    return memory_block;
+}
+
+static void _unmap_pages(void* ptr, size_t size) {
+#ifdef _WIN32
+    (void)size;
+    VirtualFree(ptr, 0, MEM_RELEASE);
+#else
+    munmap(ptr, size);
+#endif
+}
+
+static chunk_t* _map_chunk(size_t size, unsigned int* flags) {
+    size = pages_arena_size(size, *flags);
+    chunk_t* chunk = (chunk_t*)pages_map_arena(size, flags);
+    if (chunk == NULL) {
+        return NULL;
+    }
+    chunk->next = NULL;
+    chunk->size = size;
+    return chunk;
+}
+
+static void _unmap_chunk(chunk_t* chunk) {
+    pages_unmap_arena(chunk, chunk->size);
+}
+
+static void _reserve(bucket_allocator_t* allocator, size_t size) {
+    size_t reserved = atomic_fetch_add_explicit(&allocator->reserved_bytes, size, memory_order_relaxed) + size;
+    size_t peak = atomic_load_explicit(&allocator->peak_reserved_bytes, memory_order_relaxed);
+    while (reserved > peak && !atomic_compare_exchange_weak_explicit(&allocator->peak_reserved_bytes, &peak, reserved, memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+static void _unreserve(bucket_allocator_t* allocator, size_t size) {
+    atomic_fetch_sub_explicit(&allocator->reserved_bytes, size, memory_order_relaxed);
+}
+
+static size_t _large_span_size(size_t size) {
+    return (size + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1);
+}
+
+// large spans are reused only by exact page count, so the span size can always be derived from sp_t::size
+static void* _alloc_large(bucket_allocator_t* allocator, size_t size) {
+    size_t span_size = _large_span_size(size);
+    size_t pages = span_size / PAGE_SIZE;
+    if (pages <= LARGE_SPAN_PAGES) {
+        lock_acquire(&allocator->lock);
+        large_span_t* span = allocator->large_spans[pages];
+        if (span != NULL) {
+            allocator->large_spans[pages] = span->next;
+            allocator->large_cached -= span_size;
+        }
+        lock_release(&allocator->lock);
+        if (span != NULL) {
+            return span;
         }
     }
-    return -1;
+    void* span = _map_pages(span_size);
+    if (span != NULL) {
+        _reserve(allocator, span_size);
+    }
+    return span;
+}
+
+// requires allocator->lock, returns 0 when the span has to be unmapped instead
+static int _cache_large(bucket_allocator_t* allocator, void* ptr, size_t span_size) {
+    size_t pages = span_size / PAGE_SIZE;
+    if (pages > LARGE_SPAN_PAGES || allocator->large_cached + span_size > LARGE_CACHE_LIMIT) {
+        return 0;
+    }
+    large_span_t* span = (large_span_t*)ptr;
+    span->next = allocator->large_spans[pages];
+    allocator->large_spans[pages] = span;
+    allocator->large_cached += span_size;
+    return 1;
+}
+
+static void _free_large(bucket_allocator_t* allocator, void* ptr, size_t size) {
+    size_t span_size = _large_span_size(size);
+    lock_acquire(&allocator->lock);
+    int cached = _cache_large(allocator, ptr, span_size);
+    lock_release(&allocator->lock);
+    if (!cached) {
+        _unreserve(allocator, span_size);
+        _unmap_pages(ptr, span_size);
+    }
+}
+
+static int _grow(bucket_allocator_t* allocator, size_t size) {
+    size_t chunk_size = allocator->next_chunk_size;
+    while (chunk_size < sizeof(chunk_t) + size) {
+        chunk_size *= 2;
+    }
+    chunk_t* chunk = _map_chunk(chunk_size, &allocator->arena_flags);
+    if (chunk == NULL) {
+        return 0;
+    }
+    _reserve(allocator, chunk->size);
+    chunk->next = allocator->chunks;
+    allocator->chunks = chunk;
+    allocator->memory_block = chunk;
+    allocator->memory_size = chunk->size;
+    allocator->memory_offset = sizeof(chunk_t);
+    if (allocator->next_chunk_size < MAX_CHUNK_SIZE) {
+        allocator->next_chunk_size *= 2;
+    }
+    return 1;
+}
+
+static size_t _heap_offset(bucket_allocator_t* allocator, size_t alignment) {
+    uintptr_t address = (uintptr_t)allocator->memory_block + allocator->memory_offset;
+    uintptr_t aligned = (address + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    return allocator->memory_offset + (size_t)(aligned - address);
+}
+
+static void* _alloc_from_heap(bucket_allocator_t* allocator, size_t size, size_t alignment) {
+    size_t offset = _heap_offset(allocator, alignment);
+    if (offset + size > allocator->memory_size) {
+        if (!_grow(allocator, size + alignment)) {
+            return NULL;
+        }
+        offset = _heap_offset(allocator, alignment);
+    }
+    allocator->memory_offset = offset + size;
+    return (char*)allocator->memory_block + offset;
+}
+
+static int _bit_scan_forward(unsigned long long value) {
+#if defined(_MSC_VER) && !defined(__clang__)
+    unsigned long index;
+    _BitScanForward64(&index, value);
+    return (int)index;
+#else
+    return __builtin_ctzll(value);
+#endif
+}
+
+static void _slab_push(slab_t** list, slab_t* slab) {
+    slab->prev = NULL;
+    slab->next = *list;
+    if (*list != NULL) {
+        (*list)->prev = slab;
+    }
+    *list = slab;
+}
+
+static void _slab_remove(slab_t** list, slab_t* slab) {
+    if (slab->next != NULL) {
+        slab->next->prev = slab->prev;
+    }
+    if (slab->prev != NULL) {
+        slab->prev->next = slab->next;
+    } else {
+        *list = slab->next;
+    }
+    slab->next = NULL;
+    slab->prev = NULL;
+}
+
+// gives the pages of an empty slab back to the OS, the header page stays resident
+static void _purge_slab(slab_t* slab) {
+#ifdef _WIN32
+    VirtualAlloc((char*)slab + PAGE_SIZE, SLAB_SIZE - PAGE_SIZE, MEM_RESET, PAGE_READWRITE);
+#else
+    madvise((char*)slab + PAGE_SIZE, SLAB_SIZE - PAGE_SIZE, MADV_DONTNEED);
+#endif
+}
+
+static slab_t* _new_slab(bucket_allocator_t* allocator, int bucket_index) {
+    slab_t* slab = allocator->empty_slabs;
+    if (slab != NULL) {
+        allocator->empty_slabs = slab->next;
+    } else {
+        slab = _alloc_from_heap(allocator, SLAB_SIZE, SLAB_SIZE);
+        if (slab == NULL) {
+            return NULL;
+        }
+    }
+    size_t block_size = allocator->buckets[bucket_index].block_size;
+    slab->next = NULL;
+    slab->prev = NULL;
+    slab->block_size = block_size;
+    slab->bucket_index = bucket_index;
+    slab->capacity = (unsigned int)((SLAB_SIZE - SLAB_HEADER_SIZE) / block_size);
+    slab->free_count = slab->capacity;
+    slab->hint = 0;
+    memset(slab->free_bitmap, 0, sizeof(slab->free_bitmap));
+    for (unsigned int i = 0; i < slab->capacity / 64; i++) {
+        slab->free_bitmap[i] = ~0ULL;
+    }
+    if (slab->capacity % 64) {
+        slab->free_bitmap[slab->capacity / 64] = (1ULL << (slab->capacity % 64)) - 1;
+    }
+    return slab;
+}
+
+static void* _alloc_from_slab(bucket_t* bucket, slab_t* slab) {
+    unsigned int word = slab->hint;
+    while (slab->free_bitmap[word] == 0) {
+        word++;
+    }
+    unsigned int index = word * 64 + (unsigned int)_bit_scan_forward(slab->free_bitmap[word]);
+    slab->free_bitmap[word] &= slab->free_bitmap[word] - 1;
+    slab->hint = word;
+    slab->free_count--;
+    if (slab->free_count == 0) {
+        _slab_remove(&bucket->partial, slab);
+        _slab_push(&bucket->full, slab);
+    }
+    return (char*)slab + SLAB_HEADER_SIZE + (size_t)index * slab->block_size;
 }
 
 static void* _alloc_from_bucket(bucket_allocator_t* allocator, int bucket_index) {
@@ -62,23 +418,15 @@ static void* _alloc_from_bucket(bucket_allocator_t* allocator, int bucket_index)
         return NULL;
     }
     bucket_t* bucket = &allocator->buckets[bucket_index];
-    void* ptr = NULL;
-    if (bucket->free_list != NULL) {
-        free_list_node_t* free_node = bucket->free_list;
-        bucket->free_list = free_node->next;
-        if (bucket->free_list) {
-            bucket->free_list->prev = NULL;
-        }
-        ptr = (void*)free_node;
-    } else {
-        size_t block_size = bucket->block_size;
-        if (allocator->memory_offset + block_size > allocator->memory_size) {
+    slab_t* slab = bucket->partial;
+    if (slab == NULL) {
+        slab = _new_slab(allocator, bucket_index);
+        if (slab == NULL) {
             return NULL;
         }
-        ptr = (char*)allocator->memory_block + allocator->memory_offset;
-        allocator->memory_offset += block_size;
+        _slab_push(&bucket->partial, slab);
     }
-    return ptr;
+    return _alloc_from_slab(bucket, slab);
 }
 
 static void _free_to_bucket(bucket_allocator_t* allocator, int bucket_index, void* ptr) {
@@ -86,158 +434,1063 @@ static void _free_to_bucket(bucket_allocator_t* allocator, int bucket_index, voi
         return;
     }
     bucket_t* bucket = &allocator->buckets[bucket_index];
+    slab_t* slab = SLAB_OF(ptr);
+    unsigned int index = (unsigned int)(((char*)ptr - (char*)slab - SLAB_HEADER_SIZE) / slab->block_size);
+    slab->free_bitmap[index / 64] |= 1ULL << (index % 64);
+    if (index / 64 < slab->hint) {
+        slab->hint = index / 64;
+    }
+    slab->free_count++;
+    if (slab->free_count == 1) {
+        _slab_remove(&bucket->full, slab);
+        _slab_push(&bucket->partial, slab);
+    }
+    // the last partial slab of a class is kept so that a single alloc/release pair does not thrash
+    if (slab->free_count == slab->capacity && (slab->prev != NULL || slab->next != NULL)) {
+        _slab_remove(&bucket->partial, slab);
+        // purging part of a huge page would split it or fail, so huge page arenas keep empty slabs resident
+        if (!(allocator->base.flags & ALLOC_HUGE_PAGES)) {
+            _purge_slab(slab);
+        }
+        slab->next = allocator->empty_slabs;
+        allocator->empty_slabs = slab;
+    }
+}
+
+static thread_cache_t* _get_thread_cache(bucket_allocator_t* allocator) {
+    if (thread_cache != NULL && thread_cache_id == allocator->id) {
+        return thread_cache;
+    }
+    lock_acquire(&allocator->lock);
+    thread_cache_t* cache = allocator->thread_caches;
+    while (cache != NULL && cache->owner != alloc_thread_id()) {
+        cache = cache->next;
+    }
+    if (cache == NULL) {
+        // caches are carved on their own cache lines so that threads never share one
+        size_t size = (sizeof(thread_cache_t) + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1);
+        cache = _alloc_from_heap(allocator, size, CACHE_LINE_SIZE);
+        if (cache != NULL) {
+            memset(cache, 0, sizeof(thread_cache_t));
+            cache->owner = alloc_thread_id();
+            cache->next = allocator->thread_caches;
+            allocator->thread_caches = cache;
+        }
+    }
+    lock_release(&allocator->lock);
+    if (cache != NULL) {
+        thread_cache = cache;
+        thread_cache_id = allocator->id;
+    }
+    return cache;
+}
+
+static void _refill_thread_cache(bucket_allocator_t* allocator, thread_cache_bin_t* bin, int bucket_index, size_t count) {
+    lock_acquire(&allocator->lock);
+    for (size_t i = 0; i < count; i++) {
+        free_list_node_t* node = _alloc_from_bucket(allocator, bucket_index);
+        if (node == NULL) {
+            break;
+        }
+        node->next = bin->free_list;
+        bin->free_list = node;
+        bin->count++;
+    }
+    lock_release(&allocator->lock);
+}
+
+static void _drain_thread_cache(bucket_allocator_t* allocator, thread_cache_bin_t* bin, int bucket_index, size_t count) {
+    lock_acquire(&allocator->lock);
+    while (count-- > 0 && bin->free_list != NULL) {
+        free_list_node_t* node = bin->free_list;
+        bin->free_list = node->next;
+        bin->count--;
+        _free_to_bucket(allocator, bucket_index, node);
+    }
+    lock_release(&allocator->lock);
+}
+
+// hands the blocks parked in the calling thread's cache back to their slabs, a thread without one gets none
+static void _flush_thread_cache(bucket_allocator_t* allocator) {
+    thread_cache_t* cache = thread_cache;
+    if (cache == NULL || thread_cache_id != allocator->id) {
+        lock_acquire(&allocator->lock);
+        cache = allocator->thread_caches;
+        while (cache != NULL && cache->owner != alloc_thread_id()) {
+            cache = cache->next;
+        }
+        lock_release(&allocator->lock);
+    }
+    if (cache == NULL) {
+        return;
+    }
+    for (int i = 0; i < BUCKET_COUNT; i++) {
+        _drain_thread_cache(allocator, &cache->bins[i], i, cache->bins[i].count);
+    }
+}
+
+static void* _alloc_block(bucket_allocator_t* allocator, int bucket_index) {
+    thread_cache_t* cache = _get_thread_cache(allocator);
+    if (cache == NULL) {
+        lock_acquire(&allocator->lock);
+        void* ptr = _alloc_from_bucket(allocator, bucket_index);
+        lock_release(&allocator->lock);
+        return ptr;
+    }
+    thread_cache_bin_t* bin = &cache->bins[bucket_index];
+    if (bin->free_list == NULL) {
+        _refill_thread_cache(allocator, bin, bucket_index, THREAD_CACHE_BATCH);
+        if (bin->free_list == NULL) {
+            return NULL;
+        }
+    }
+    free_list_node_t* node = bin->free_list;
+    bin->free_list = node->next;
+    bin->count--;
+    return node;
+}
+
+static void _free_block(bucket_allocator_t* allocator, int bucket_index, void* ptr) {
+    if (bucket_index < 0 || bucket_index >= BUCKET_COUNT || ptr == NULL) {
+        return;
+    }
+    thread_cache_t* cache = _get_thread_cache(allocator);
+    if (cache == NULL) {
+        lock_acquire(&allocator->lock);
+        _free_to_bucket(allocator, bucket_index, ptr);
+        lock_release(&allocator->lock);
+        return;
+    }
+    thread_cache_bin_t* bin = &cache->bins[bucket_index];
     free_list_node_t* node = (free_list_node_t*)ptr;
-    node->next = bucket->free_list;
-    node->prev = NULL;
-    if (bucket->free_list) {
-        bucket->free_list->prev = node;
+    node->next = bin->free_list;
+    bin->free_list = node;
+    bin->count++;
+    if (bin->count > THREAD_CACHE_LIMIT) {
+        _drain_thread_cache(allocator, bin, bucket_index, THREAD_CACHE_BATCH);
+    }
+}
+
+// the calling thread's counters, or the shared ones with the lock held when the thread has no cache
+static class_counters_t* _acquire_counters(bucket_allocator_t* allocator, int bucket_index) {
+    int row = bucket_index == -1 ? LARGE_ROW : bucket_index;
+    thread_cache_t* cache = _get_thread_cache(allocator);
+    if (cache != NULL) {
+        return &cache->counters[row];
+    }
+    lock_acquire(&allocator->lock);
+    return &allocator->counters[row];
+}
+
+static void _release_counters(bucket_allocator_t* allocator, class_counters_t* counters) {
+    if (counters >= allocator->counters && counters <= &allocator->counters[LARGE_ROW]) {
+        lock_release(&allocator->lock);
+    }
+}
+
+static size_t _slot_size(int bucket_index, size_t extent) {
+    return bucket_index == -1 ? _large_span_size(extent) : bucket_sizes[bucket_index];
+}
+
+static void _count_alloc(bucket_allocator_t* allocator, int bucket_index, size_t count, size_t size, size_t extent) {
+    class_counters_t* counters = _acquire_counters(allocator, bucket_index);
+    counters_alloc(counters, count, count * size, count * _slot_size(bucket_index, extent));
+    _release_counters(allocator, counters);
+}
+
+// bytes of the object's own slot in use, the payload of an aligned object starts further than OBJECT_HEADER_SIZE
+// in, and once resize moved the payload out its storage remembers the extent
+static size_t _object_extent(const object_t* object) {
+    const object_t* storage = object_storage(object);
+    if (storage != NULL) {
+        return storage->slot_extent;
+    }
+    return (size_t)((char*)object->sp.ptr - (char*)object) + object->sp.size;
+}
+
+// every block sits in a slab of its class, so an object that resize shrank or an aligned one, which may be in a
+// bigger class than its extent, is found by its slab all the same
+static int _object_bucket_index(const object_t* object, size_t extent) {
+    if (extent > MAX_BUCKET_SIZE) {
+        return -1;
+    }
+    return SLAB_OF(object)->bucket_index;
+}
+
+// a freed slot stops passing for an sp_t, a copy of its pointer released later is turned away by the self check
+static void _free_object(bucket_allocator_t* allocator, object_t* object) {
+    size_t extent = _object_extent(object);
+    int bucket_index = _object_bucket_index(object, extent);
+    object_t* storage = object_storage(object);
+    object->sp.self = NULL;
+    class_counters_t* counters = _acquire_counters(allocator, bucket_index);
+    counters_release(counters, 1, storage != NULL ? 0 : object->sp.size, _slot_size(bucket_index, extent));
+    _release_counters(allocator, counters);
+    if (storage != NULL) {
+        _free_object(allocator, storage);
+    }
+    if (bucket_index == -1) {
+        _free_large(allocator, object, extent);
+    } else {
+        _free_block(allocator, bucket_index, object);
+    }
+}
+
+// only the owner gets here, the object's handle is left to the caller
+static void _unlink_block(bucket_allocator_t* allocator, mem_block_t* current) {
+    sweep_skip(&allocator->base, current);
+    if (allocator->compact_cursor == current) {
+        allocator->compact_cursor = current->next;
+    }
+    if (current->next != NULL) {
+        current->next->prev = current->prev;
+    }
+    if (current->prev != NULL) {
+        current->prev->next = current->next;
+    } else {
+        allocator->base.block_list = current->next;
+    }
+    allocator->base.total_blocks--;
+}
+
+// objects released by threads other than the owner are pushed here and stay in block_list until drained; the
+// caller holds the lock from the first write to object_t::next on, see _link_remote_allocs
+static void _push_remote_free(bucket_allocator_t* allocator, object_t* first, object_t* last) {
+    // their handles go right away, a queued object must not resolve while it waits for the owner
+    if (allocator->base.handles != NULL) {
+        for (object_t* object = first; object != last; object = object->next) {
+            handles_detach(allocator->base.handles, &object->sp);
+        }
+        handles_detach(allocator->base.handles, &last->sp);
+    }
+    remote_free_push(&allocator->remote_free, first, last);
+}
+
+// the handle table is shared with the threads that allocate or release off the owner, so it changes under the lock
+static void _detach_handles(bucket_allocator_t* allocator, object_t* first) {
+    if (allocator->base.handles == NULL) {
+        return;
+    }
+    lock_acquire(&allocator->lock);
+    for (object_t* object = first; object != NULL; object = object->next) {
+        handles_detach(allocator->base.handles, &object->sp);
+    }
+    lock_release(&allocator->lock);
+}
+
+static void _attach_handles(bucket_allocator_t* allocator, mem_block_t* first, mem_block_t* last) {
+    if (allocator->base.handles == NULL) {
+        return;
+    }
+    lock_acquire(&allocator->lock);
+    for (mem_block_t* block = first; ; block = block->prev) {
+        handles_attach(allocator->base.handles, block->ptr);
+        if (block == last) {
+            break;
+        }
+    }
+    lock_release(&allocator->lock);
+}
+
+// links first..last, already chained through next/prev with last being the newest and numbered, at the head of
+// block_list; only the owner gets here, so it takes no lock
+static void _link_owned_blocks(bucket_allocator_t* allocator, mem_block_t* first, mem_block_t* last, size_t count) {
+    last->prev = NULL;
+    first->next = allocator->base.block_list;
+    if (allocator->base.block_list != NULL) {
+        allocator->base.block_list->prev = first;
+    }
+    allocator->base.block_list = last;
+    allocator->base.total_blocks += (int)count;
+}
+
+// objects allocated by threads other than the owner wait here, newest first and chained through mem_block_t::next,
+// until the owner links them; they count in total_blocks from then on
+static void _push_remote_alloc(bucket_allocator_t* allocator, mem_block_t* first, mem_block_t* last) {
+    mem_block_t* head = atomic_load_explicit(&allocator->remote_alloc, memory_order_relaxed);
+    do {
+        first->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&allocator->remote_alloc, &head, last, memory_order_release, memory_order_relaxed));
+}
+
+static void _link_remote_allocs(bucket_allocator_t* allocator) {
+    if (atomic_load_explicit(&allocator->remote_alloc, memory_order_relaxed) == NULL) {
+        return;
+    }
+    mem_block_t* newest = atomic_exchange_explicit(&allocator->remote_alloc, NULL, memory_order_acquire);
+    if (newest == NULL) {
+        return;
+    }
+    mem_block_t* oldest = newest;
+    size_t count = 1;
+    while (oldest->next != NULL) {
+        oldest->next->prev = oldest;
+        oldest = oldest->next;
+        count++;
+    }
+    // the serial shares its field with the remote free link, and the thread that allocated one of these may drop
+    // its last reference meanwhile; it pushes under the lock, so an object still referenced here is not being
+    // pushed, and one already released keeps its link and goes with the next drain
+    lock_acquire(&allocator->lock);
+    for (mem_block_t* block = oldest; ; block = block->prev) {
+        object_t* object = (object_t*)block->ptr;
+        if (atomic_load_explicit(&object->sp.ref_count, memory_order_relaxed) != 0) {
+            object->serial = allocator->base.serial++;
+        }
+        if (block == newest) {
+            break;
+        }
+    }
+    lock_release(&allocator->lock);
+    _link_owned_blocks(allocator, oldest, newest, count);
+}
+
+// an object another thread allocated and released again is queued twice, and its alloc push came first, so taking
+// the remote frees before linking the remote allocs finds every freed object in block_list
+static void _drain_remote_free(bucket_allocator_t* allocator) {
+    object_t* object = remote_free_take(&allocator->remote_free);
+    _link_remote_allocs(allocator);
+    if (object == NULL) {
+        return;
+    }
+    // their handles went when they were queued
+    for (object_t* current = object; current != NULL; current = current->next) {
+        _unlink_block(allocator, &current->block);
+    }
+    while (object != NULL) {
+        object_t* next = object->next;
+        _free_object(allocator, object);
+        object = next;
     }
-    bucket->free_list = node;
 }
 
 allocator_ptr_t _init(void) {
-    void* memory_block = NULL;
-#ifdef _WIN32
-    memory_block = VirtualAlloc(NULL, MEMORY_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
-#else
-    memory_block = mmap(NULL, MEMORY_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-#endif
-    if (memory_block == NULL) {
+    return _init_with(0);
+}
+
+allocator_ptr_t _init_with(unsigned int flags) {
+    flags &= ~(unsigned int)ALLOC_HUGE_PAGE_MODES;
+    unsigned int arena_flags = flags & ALLOC_HUGE_PAGES;
+    chunk_t* chunk = _map_chunk(MEMORY_SIZE, &arena_flags);
+    if (chunk == NULL) {
         return NULL;
     }
 
-    bucket_allocator_t* allocator = (bucket_allocator_t*)memory_block;
-    allocator->memory_block = memory_block;
-    allocator->memory_size = MEMORY_SIZE;
-    allocator->memory_offset = sizeof(bucket_allocator_t);
+    // the allocator lives in its first chunk, right after the chunk header
+    bucket_allocator_t* allocator = (bucket_allocator_t*)(chunk + 1);
+    allocator->memory_block = chunk;
+    allocator->memory_size = chunk->size;
+    allocator->memory_offset = sizeof(chunk_t) + sizeof(bucket_allocator_t);
+    allocator->chunks = chunk;
+    allocator->next_chunk_size = chunk->size * 2;
+    allocator->arena_flags = arena_flags;
+    memset(allocator->large_spans, 0, sizeof(allocator->large_spans));
+    allocator->large_cached = 0;
+    allocator->empty_slabs = NULL;
+    allocator->compact_cursor = NULL;
+    memset(allocator->counters, 0, sizeof(allocator->counters));
+    atomic_init(&allocator->reserved_bytes, chunk->size);
+    atomic_init(&allocator->peak_reserved_bytes, chunk->size);
     allocator->base.block_list = NULL;
     allocator->base.total_blocks = 0;
+    allocator->base.flags = flags;
+    allocator->base.serial = 0;
+    allocator->base.sweep_cursor = NULL;
+    allocator->base.sweeping = 0;
+    rewinds_init(&allocator->base);
+    allocator->base.handles = NULL;
+    if (flags & ALLOC_HANDLE_TABLE) {
+        allocator->base.handles = handles_create();
+        if (allocator->base.handles == NULL) {
+            allocator->base.flags &= ~(unsigned int)ALLOC_HANDLE_TABLE;
+        }
+    }
+    allocator->id = atomic_fetch_add(&next_allocator_id, 1);
+    atomic_init(&allocator->owner, alloc_thread_id());
+    allocator->thread_caches = NULL;
+    lock_init(&allocator->lock);
+    atomic_init(&allocator->remote_free, NULL);
+    atomic_init(&allocator->remote_alloc, NULL);
 
     for (int i = 0; i < BUCKET_COUNT; i++) {
-        allocator->buckets[i].free_list = NULL;
+        allocator->buckets[i].partial = NULL;
+        allocator->buckets[i].full = NULL;
         allocator->buckets[i].block_size = bucket_sizes[i];
     }
     return (allocator_ptr_t)&allocator->base;
 }
 
+static void _init_object(bucket_allocator_t* allocator, object_t* object, size_t size) {
+    sp_t* smart_pointer = &object->sp;
+    mem_block_t* mem_block = &object->block;
+    smart_pointer->self = (sp_ptr_t)smart_pointer;
+    atomic_init(&smart_pointer->ref_count, 1);
+    smart_pointer->size = size;
+    smart_pointer->ptr = OBJECT_PAYLOAD(object);
+    smart_pointer->allocator = &allocator->base;
+    smart_pointer->block = mem_block;
+    mem_block->ptr = smart_pointer;
+}
+
+static int _is_owner(bucket_allocator_t* allocator) {
+    return atomic_load_explicit(&allocator->owner, memory_order_relaxed) == alloc_thread_id();
+}
+
+static void _drain_remote_free_if_owner(bucket_allocator_t* allocator) {
+    if ((atomic_load_explicit(&allocator->remote_free, memory_order_relaxed) != NULL
+        || atomic_load_explicit(&allocator->remote_alloc, memory_order_relaxed) != NULL) && _is_owner(allocator)) {
+        _drain_remote_free(allocator);
+    }
+}
+
+// new objects, chained like in _link_owned_blocks, go straight into block_list on the owner and are queued for it
+// on any other thread
+static void _link_blocks(bucket_allocator_t* allocator, mem_block_t* first, mem_block_t* last, size_t count) {
+    last->prev = NULL;
+    _attach_handles(allocator, first, last);
+    if (_is_owner(allocator)) {
+        for (mem_block_t* block = first; ; block = block->prev) {
+            ((object_t*)block->ptr)->serial = allocator->base.serial++;
+            if (block == last) {
+                break;
+            }
+        }
+        _link_owned_blocks(allocator, first, last, count);
+    } else {
+        _push_remote_alloc(allocator, first, last);
+    }
+}
+
 sp_ptr_t _alloc(const allocator_ptr_t* ptr, size_t size) {
     if (!ptr || !(*ptr)) return NULL;
     bucket_allocator_t* bucket_allocator = (bucket_allocator_t*)((char*)(*ptr) - offsetof(bucket_allocator_t, base));
-    
-    int user_bucket_index = find_bucket_index(size);
-    if (user_bucket_index == -1) return NULL;
+    if (size > SIZE_MAX - OBJECT_HEADER_SIZE) return NULL;
+    _drain_remote_free_if_owner(bucket_allocator);
 
-    int sp_bucket_index = find_bucket_index(sizeof(sp_t));
-    if (sp_bucket_index == -1) return NULL;
+    // the payload shares one slot with its sp_t and mem_block_t, so an allocation is a single pop
+    size_t slot_size = OBJECT_HEADER_SIZE + size;
+    int bucket_index = find_bucket_index(slot_size);
+    object_t* object = bucket_index == -1
+        ? _alloc_large(bucket_allocator, slot_size)
+        : _alloc_block(bucket_allocator, bucket_index);
+    if (!object) return NULL;
 
-    int mb_bucket_index = find_bucket_index(sizeof(mem_block_t));
-    if (mb_bucket_index == -1) return NULL;
+    _init_object(bucket_allocator, object, size);
+    _count_alloc(bucket_allocator, bucket_index, 1, size, slot_size);
+    _link_blocks(bucket_allocator, &object->block, &object->block, 1);
+    return &object->sp;
+}
 
-    void* user_ptr = _alloc_from_bucket(bucket_allocator, user_bucket_index);
-    if (!user_ptr) return NULL;
+size_t _alloc_batch(const allocator_ptr_t* ptr, size_t size, size_t count, sp_ptr_t* out) {
+    if (!ptr || !(*ptr) || !out || count == 0) return 0;
+    bucket_allocator_t* bucket_allocator = (bucket_allocator_t*)((char*)(*ptr) - offsetof(bucket_allocator_t, base));
+    if (size > SIZE_MAX - OBJECT_HEADER_SIZE) return 0;
+    _drain_remote_free_if_owner(bucket_allocator);
 
-    sp_t* smart_pointer = _alloc_from_bucket(bucket_allocator, sp_bucket_index);
-    if (!smart_pointer) {
-        _free_to_bucket(bucket_allocator, user_bucket_index, user_ptr);
-        return NULL;
+    size_t slot_size = OBJECT_HEADER_SIZE + size;
+    int bucket_index = find_bucket_index(slot_size);
+    thread_cache_t* cache = bucket_index == -1 ? NULL : _get_thread_cache(bucket_allocator);
+    size_t allocated = 0;
+    mem_block_t* last = NULL;
+    while (allocated < count) {
+        object_t* object = NULL;
+        if (cache != NULL) {
+            // the whole run is moved from the shared bucket into the thread cache under one lock
+            thread_cache_bin_t* bin = &cache->bins[bucket_index];
+            if (bin->free_list == NULL) {
+                size_t missing = count - allocated;
+                _refill_thread_cache(bucket_allocator, bin, bucket_index, missing > THREAD_CACHE_BATCH ? missing : THREAD_CACHE_BATCH);
+            }
+            if (bin->free_list != NULL) {
+                object = (object_t*)bin->free_list;
+                bin->free_list = bin->free_list->next;
+                bin->count--;
+            }
+        } else {
+            object = bucket_index == -1
+                ? _alloc_large(bucket_allocator, slot_size)
+                : _alloc_block(bucket_allocator, bucket_index);
+        }
+        if (object == NULL) {
+            break;
+        }
+        _init_object(bucket_allocator, object, size);
+        // out[0] ends up deepest in block_list, as if the objects were allocated one by one
+        object->block.next = last;
+        if (last != NULL) {
+            last->prev = &object->block;
+        }
+        last = &object->block;
+        out[allocated++] = &object->sp;
     }
-
-    mem_block_t* mem_block = _alloc_from_bucket(bucket_allocator, mb_bucket_index);
-    if (!mem_block) {
-        _free_to_bucket(bucket_allocator, user_bucket_index, user_ptr);
-        _free_to_bucket(bucket_allocator, sp_bucket_index, smart_pointer);
-        return NULL;
+    if (allocated > 0) {
+        _count_alloc(bucket_allocator, bucket_index, allocated, size, slot_size);
+        _link_blocks(bucket_allocator, ((sp_t*)out[0])->block, last, allocated);
     }
-    smart_pointer->self = (sp_ptr_t)smart_pointer;
-    smart_pointer->ref_count = 1;
-    smart_pointer->size = size;
-    smart_pointer->ptr = user_ptr;
-    smart_pointer->allocator = (allocator_t*)(*ptr);
-    smart_pointer->block = mem_block;
-    mem_block->ptr = smart_pointer;
-    mem_block->next = bucket_allocator->base.block_list;
-    mem_block->prev = NULL;
-    if (bucket_allocator->base.block_list != NULL) {
-        bucket_allocator->base.block_list->prev = mem_block;
+    return allocated;
+}
+
+sp_ptr_t _alloc_aligned(const allocator_ptr_t* ptr, size_t size, size_t alignment) {
+    alignment = object_alignment(alignment);
+    if (!ptr || !(*ptr) || alignment == 0) return NULL;
+    // slots are 16 byte aligned already
+    if (alignment == OBJECT_ALIGNMENT) return _alloc(ptr, size);
+    bucket_allocator_t* bucket_allocator = (bucket_allocator_t*)((char*)(*ptr) - offsetof(bucket_allocator_t, base));
+    if (size > SIZE_MAX - OBJECT_HEADER_SIZE - 2 * alignment) return NULL;
+    _drain_remote_free_if_owner(bucket_allocator);
+
+    // a block is only known to be 16 byte aligned, so its class has room for the worst case padding
+    int bucket_index = find_bucket_index(OBJECT_HEADER_SIZE + alignment - OBJECT_ALIGNMENT + size);
+    object_t* object;
+    size_t offset;
+    if (bucket_index != -1) {
+        object = _alloc_block(bucket_allocator, bucket_index);
+        if (!object) return NULL;
+        uintptr_t payload = ((uintptr_t)object + OBJECT_HEADER_SIZE + alignment - 1) & ~(uintptr_t)(alignment - 1);
+        offset = (size_t)(payload - (uintptr_t)object);
+    } else {
+        // large spans are page aligned, the extent has to stay above MAX_BUCKET_SIZE for the span to be found again
+        offset = (OBJECT_HEADER_SIZE + alignment - 1) & ~(alignment - 1);
+        if (offset + size <= MAX_BUCKET_SIZE) {
+            offset += (MAX_BUCKET_SIZE - offset - size + alignment) & ~(alignment - 1);
+        }
+        object = _alloc_large(bucket_allocator, offset + size);
+        if (!object) return NULL;
     }
-    bucket_allocator->base.block_list = mem_block;
-    bucket_allocator->base.total_blocks++;
 
-    return smart_pointer;
+    _init_object(bucket_allocator, object, size);
+    _count_alloc(bucket_allocator, bucket_index, 1, size, offset + size);
+    object->sp.ptr = (char*)object + offset;
+    // stale bytes in the padding must not look like a storage link to object_storage
+    memset(OBJECT_PAYLOAD(object), 0, offset - OBJECT_HEADER_SIZE);
+    _link_blocks(bucket_allocator, &object->block, &object->block, 1);
+    return &object->sp;
 }
 
 void _release(const sp_ptr_t* sp) {
     if (!sp || !(*sp) || (*sp)->self != (sp_ptr_t)*sp) return;
     sp_ptr_t* sp_ptr = (sp_ptr_t*)sp;
     sp_t* ptr = (sp_t*)(*sp);
-    if (ptr->ref_count == 0) return;
-    ptr->ref_count--;
-    if (ptr->ref_count <= 0) {
+    if (sp_drop_reference(ptr)) {
         bucket_allocator_t* allocator = (bucket_allocator_t*)((char*)ptr->allocator - offsetof(bucket_allocator_t, base));
-        mem_block_t* current = ptr->block;
-
-        // Update the block list FIRST
-        if (current->next != NULL) {
-            current->next->prev = current->prev;
+        if (!_is_owner(allocator)) {
+            lock_acquire(&allocator->lock);
+            _push_remote_free(allocator, (object_t*)ptr, (object_t*)ptr);
+            lock_release(&allocator->lock);
+            *sp_ptr = NULL;
+            return;
         }
-        if (current->prev != NULL) {
-            current->prev->next = current->next;
-        } else {
-            allocator->base.block_list = current->next;
-        }
-        allocator->base.total_blocks--;
+
+        // Update the block list FIRST, an object another thread allocated may still wait to be linked
+        object_t* object = (object_t*)ptr;
+        _link_remote_allocs(allocator);
+        _unlink_block(allocator, ptr->block);
+        object->next = NULL;
+        _detach_handles(allocator, object);
 
         // Now free the memory
-        int user_bucket_index = find_bucket_index(ptr->size);
-        _free_to_bucket(allocator, user_bucket_index, ptr->ptr);
+        _free_object(allocator, object);
+        *sp_ptr = NULL;
+    }
+}
 
-        // int sp_bucket_index = find_bucket_index(sizeof(sp_t));
-        // _free_to_bucket(allocator, sp_bucket_index, ptr);
+void _release_batch(sp_ptr_t* sps, size_t count) {
+    if (!sps) return;
+    size_t i = 0;
+    while (i < count) {
+        // collect the run of objects that belong to one allocator and drop their last reference
+        bucket_allocator_t* allocator = NULL;
+        int owned = 0;
+        object_t* first = NULL;
+        object_t* last = NULL;
+        for (; i < count; i++) {
+            sp_t* ptr = (sp_t*)sps[i];
+            if (!ptr || ptr->self != (sp_ptr_t)ptr) continue;
+            bucket_allocator_t* owner = (bucket_allocator_t*)((char*)ptr->allocator - offsetof(bucket_allocator_t, base));
+            if (allocator != NULL && owner != allocator) break;
+            if (allocator == NULL) {
+                allocator = owner;
+                owned = _is_owner(allocator);
+                if (!owned) {
+                    lock_acquire(&allocator->lock);
+                }
+            }
+            if (!sp_drop_reference(ptr)) continue;
+            object_t* object = (object_t*)ptr;
+            object->next = NULL;
+            if (last != NULL) {
+                last->next = object;
+            } else {
+                first = object;
+            }
+            last = object;
+            sps[i] = NULL;
+        }
+        if (!owned) {
+            if (first != NULL) {
+                _push_remote_free(allocator, first, last);
+            }
+            if (allocator != NULL) {
+                lock_release(&allocator->lock);
+            }
+            continue;
+        }
+        if (first == NULL) {
+            continue;
+        }
+        _link_remote_allocs(allocator);
+        for (object_t* object = first; object != NULL; object = object->next) {
+            _unlink_block(allocator, &object->block);
+        }
+        _detach_handles(allocator, first);
+        while (first != NULL) {
+            object_t* next = first->next;
+            _free_object(allocator, first);
+            first = next;
+        }
+    }
+}
 
-        int mb_bucket_index = find_bucket_index(sizeof(mem_block_t));
-        _free_to_bucket(allocator, mb_bucket_index, current);
-        *sp_ptr = NULL;
+void* _resize(const sp_ptr_t* sp, size_t size) {
+    if (!sp || !(*sp) || (*sp)->self != (sp_ptr_t)*sp) return NULL;
+    if (size > SIZE_MAX - OBJECT_HEADER_SIZE - PAGE_SIZE) return NULL;
+    object_t* object = (object_t*)*sp;
+    bucket_allocator_t* allocator = (bucket_allocator_t*)((char*)object->sp.allocator - offsetof(bucket_allocator_t, base));
+    object_t* storage = object_storage(object);
+    // the slot the payload is in right now, either the object's own or its storage
+    object_t* slot = storage != NULL ? storage : object;
+    size_t offset = (size_t)((char*)slot->sp.ptr - (char*)slot);
+    size_t extent = offset + slot->sp.size;
+    int bucket_index = _object_bucket_index(slot, extent);
+    if (bucket_index == -1) {
+        // the span size is derived from the extent, so the span keeps its page count
+        size_t new_extent = offset + size;
+        if (new_extent > MAX_BUCKET_SIZE && _large_span_size(new_extent) == _large_span_size(extent)) {
+            class_counters_t* counters = _acquire_counters(allocator, bucket_index);
+            counters_resize(counters, slot->sp.size, size);
+            _release_counters(allocator, counters);
+            slot->sp.size = size;
+            object->sp.size = size;
+            return object->sp.ptr;
+        }
+    } else if (offset + size <= bucket_sizes[bucket_index]) {
+        // the payload stays where it is, the block keeps its class however far it shrinks
+        class_counters_t* counters = _acquire_counters(allocator, bucket_index);
+        counters_resize(counters, slot->sp.size, size);
+        _release_counters(allocator, counters);
+        slot->sp.size = size;
+        object->sp.size = size;
+        return object->sp.ptr;
+    }
+
+    size_t slot_size = OBJECT_HEADER_SIZE + size;
+    int new_index = find_bucket_index(slot_size);
+    object_t* moved = new_index == -1
+        ? _alloc_large(allocator, slot_size)
+        : _alloc_block(allocator, new_index);
+    if (!moved) return NULL;
+    _count_alloc(allocator, new_index, 1, size, slot_size);
+    if (storage == NULL) {
+        // the payload bytes leave the object's own slot, those of a storage go with its release below
+        class_counters_t* counters = _acquire_counters(allocator, bucket_index);
+        counters_resize(counters, object->sp.size, 0);
+        _release_counters(allocator, counters);
+    }
+    object_init_storage(moved, object, size);
+    moved->slot_extent = _object_extent(object);
+    memcpy(OBJECT_PAYLOAD(moved), object->sp.ptr, size < object->sp.size ? size : object->sp.size);
+    object->sp.ptr = OBJECT_PAYLOAD(moved);
+    object->sp.size = size;
+    if (storage != NULL) {
+        _free_object(allocator, storage);
     }
+    return object->sp.ptr;
 }
 
 void* _retain(const sp_ptr_t *sp) {
     if (!sp || !(*sp) || (*sp)->self != (sp_ptr_t)*sp) return NULL;
     sp_t* ptr = (sp_t*)*sp;
-    ptr->ref_count++;
+    sp_add_reference(ptr);
     return ptr->ptr;
 }
 
+// requires allocator->lock, and clears self like _free_object
+static void _sweep_object(bucket_allocator_t* allocator, object_t* object) {
+    size_t extent = _object_extent(object);
+    int bucket_index = _object_bucket_index(object, extent);
+    object_t* storage = object_storage(object);
+    object->sp.self = NULL;
+    counters_release(&allocator->counters[bucket_index == -1 ? LARGE_ROW : bucket_index], 1,
+        storage != NULL ? 0 : object->sp.size, _slot_size(bucket_index, extent));
+    if (storage != NULL) {
+        _sweep_object(allocator, storage);
+    }
+    if (bucket_index == -1) {
+        size_t span_size = _large_span_size(extent);
+        if (!_cache_large(allocator, object, span_size)) {
+            _unreserve(allocator, span_size);
+            _unmap_pages(object, span_size);
+        }
+    } else {
+        _free_to_bucket(allocator, bucket_index, object);
+    }
+}
+
+alloc_handle_t _handle(const sp_ptr_t* sp) {
+    if (!sp || !(*sp) || (*sp)->self != (sp_ptr_t)*sp) return 0;
+    return (*sp)->handle;
+}
+
+sp_ptr_t _resolve(const allocator_ptr_t* ptr, alloc_handle_t handle) {
+    if (!ptr || !(*ptr)) return NULL;
+    return handles_lookup((*ptr)->handles, handle);
+}
+
+void* _handle_retain(const allocator_ptr_t* ptr, alloc_handle_t handle) {
+    sp_ptr_t sp = _resolve(ptr, handle);
+    return _retain(&sp);
+}
+
+void _handle_release(const allocator_ptr_t* ptr, alloc_handle_t handle) {
+    sp_ptr_t sp = _resolve(ptr, handle);
+    _release(&sp);
+}
+
 void _gc(const allocator_ptr_t* ptr) {
-    if (!ptr || !(*ptr) || (*ptr)->block_list == NULL || (*ptr)->total_blocks == 0) return;
+    if (!ptr || !(*ptr)) return;
     bucket_allocator_t* allocator = (bucket_allocator_t*)((char*)(*ptr) - offsetof(bucket_allocator_t, base));
+    if (!_is_owner(allocator)) return;
+    // queued remote frees are in block_list once the remote allocs are linked, and are swept below
+    remote_free_take(&allocator->remote_free);
+    _link_remote_allocs(allocator);
+    if (allocator->base.block_list == NULL || allocator->base.total_blocks == 0) return;
+    lock_acquire(&allocator->lock);
     mem_block_t* current = allocator->base.block_list;
     while (current) {
         mem_block_t* next = current->next;
-        
-        sp_t* sp = current->ptr;
-        
-        int user_bucket_index = find_bucket_index(sp->size);
-        _free_to_bucket(allocator, user_bucket_index, sp->ptr);
-
-        int sp_bucket_index = find_bucket_index(sizeof(sp_t));
-        _free_to_bucket(allocator, sp_bucket_index, sp);
-
-        int mb_bucket_index = find_bucket_index(sizeof(mem_block_t));
-        _free_to_bucket(allocator, mb_bucket_index, current);
-        
+        handles_detach(allocator->base.handles, current->ptr);
+        _sweep_object(allocator, (object_t*)current->ptr);
         current = next;
     }
     allocator->base.block_list = NULL;
     allocator->base.total_blocks = 0;
+    allocator->compact_cursor = NULL;
+    sweep_stop(&allocator->base);
+    lock_release(&allocator->lock);
+}
+
+int _gc_step(const allocator_ptr_t* ptr, size_t max_blocks) {
+    if (!ptr || !(*ptr)) return 1;
+    bucket_allocator_t* allocator = (bucket_allocator_t*)((char*)(*ptr) - offsetof(bucket_allocator_t, base));
+    if (!_is_owner(allocator)) return 1;
+    // queued remote frees are still in block_list, they are freed here so that the sweep does not free them again
+    _drain_remote_free(allocator);
+    lock_acquire(&allocator->lock);
+    mem_block_t* current = sweep_start(&allocator->base);
+    for (size_t count = 0; current != NULL && (max_blocks == 0 || count < max_blocks); count++) {
+        _unlink_block(allocator, current);
+        handles_detach(allocator->base.handles, current->ptr);
+        _sweep_object(allocator, (object_t*)current->ptr);
+        current = allocator->base.sweep_cursor;
+    }
+    int finished = current == NULL;
+    if (finished) {
+        sweep_stop(&allocator->base);
+    }
+    lock_release(&allocator->lock);
+    return finished;
+}
+
+// the slab of the class that a block in from moves to, NULL when none is denser; the fullest partial slab is picked
+// once and kept in *target until it fills up, so a call looks at the partial list once per slab it fills, and every
+// slab it looks at is charged to *spent
+static slab_t* _denser_slab(bucket_t* bucket, slab_t** target, slab_t* from, size_t* spent) {
+    slab_t* best = *target;
+    if (best == NULL || best->free_count == 0 || best->free_count == best->capacity) {
+        best = NULL;
+        for (slab_t* slab = bucket->partial; slab != NULL; slab = slab->next) {
+            *spent += COMPACT_SCAN_COST;
+            if (best == NULL || slab->free_count < best->free_count) {
+                best = slab;
+            }
+        }
+        *target = best;
+    }
+    return best != NULL && best != from && best->free_count < from->free_count ? best : NULL;
+}
+
+// moves an object that has a handle, sp_t and all, to the target slab; its handle and its neighbours in block_list
+// are pointed at the copy, and the old slot stops passing for an sp_t before it is freed
+static object_t* _move_object(bucket_allocator_t* allocator, object_t* object, bucket_t* bucket, slab_t* target) {
+    size_t extent = _object_extent(object);
+    slab_t* slab = SLAB_OF(object);
+    object_t* dense = _alloc_from_slab(bucket, target);
+    memcpy(dense, object, extent);
+    dense->sp.self = (sp_ptr_t)&dense->sp;
+    dense->sp.ptr = OBJECT_PAYLOAD(dense);
+    dense->sp.block = &dense->block;
+    dense->block.ptr = &dense->sp;
+    if (dense->block.next != NULL) {
+        dense->block.next->prev = &dense->block;
+    }
+    if (dense->block.prev != NULL) {
+        dense->block.prev->next = &dense->block;
+    } else {
+        allocator->base.block_list = &dense->block;
+    }
+    if (allocator->base.sweep_cursor == &object->block) {
+        allocator->base.sweep_cursor = &dense->block;
+    }
+    if (allocator->compact_cursor == &object->block) {
+        allocator->compact_cursor = &dense->block;
+    }
+    handle_entry_t* entry = handles_slot(allocator->base.handles, dense->sp.handle & HANDLE_INDEX_MASK);
+    atomic_store_explicit(&entry->sp, &dense->sp, memory_order_release);
+    object->sp.self = NULL;
+    _free_to_bucket(allocator, slab->bucket_index, object);
+    return dense;
+}
+
+// each movable payload goes from a sparse slab to a denser one of its class, which is how slabs end up empty:
+// storage objects resize moved out, and with a handle table objects that have a handle, as a whole. With a budget
+// the objects looked at count against it as well, and the next call goes on from where this one stopped
+size_t _compact(const allocator_ptr_t* ptr, size_t budget) {
+    if (!ptr || !(*ptr)) return 0;
+    bucket_allocator_t* allocator = (bucket_allocator_t*)((char*)(*ptr) - offsetof(bucket_allocator_t, base));
+    if (!_is_owner(allocator)) return 0;
+    _drain_remote_free(allocator);
+    // blocks parked in the calling thread's cache still count as taken in their slabs
+    _flush_thread_cache(allocator);
+    size_t moved = 0;
+    size_t spent = 0;
+    slab_t* targets[BUCKET_COUNT] = { NULL };
+    large_span_t* spans[LARGE_SPAN_PAGES + 1];
+    lock_acquire(&allocator->lock);
+    mem_block_t* current = budget != 0 && allocator->compact_cursor != NULL ? allocator->compact_cursor : allocator->base.block_list;
+    for (; current != NULL; current = current->next) {
+        if (budget != 0 && spent >= budget) {
+            break;
+        }
+        spent += COMPACT_SCAN_COST;
+        object_t* object = (object_t*)current->ptr;
+        object_t* storage = object_storage(object);
+        // an aligned payload would lose its alignment in another slot
+        if (storage == NULL && object->sp.handle != 0 && object->sp.ptr == OBJECT_PAYLOAD(object)) {
+            if (_object_extent(object) > MAX_BUCKET_SIZE) {
+                continue;
+            }
+            slab_t* slab = SLAB_OF(object);
+            bucket_t* bucket = &allocator->buckets[slab->bucket_index];
+            slab_t* target = _denser_slab(bucket, &targets[slab->bucket_index], slab, &spent);
+            if (target == NULL) {
+                continue;
+            }
+            object_t* dense = _move_object(allocator, object, bucket, target);
+            moved += _object_extent(dense);
+            spent += _object_extent(dense);
+            current = &dense->block;
+            continue;
+        }
+        if (storage == NULL || _object_extent(storage) > MAX_BUCKET_SIZE) {
+            continue;
+        }
+        slab_t* slab = SLAB_OF(storage);
+        bucket_t* bucket = &allocator->buckets[slab->bucket_index];
+        slab_t* target = _denser_slab(bucket, &targets[slab->bucket_index], slab, &spent);
+        if (target == NULL) {
+            continue;
+        }
+        // the move stays within the class, so the counters do not change
+        object_t* dense = _alloc_from_slab(bucket, target);
+        object_init_storage(dense, object, storage->sp.size);
+        dense->slot_extent = storage->slot_extent;
+        memcpy(OBJECT_PAYLOAD(dense), OBJECT_PAYLOAD(storage), storage->sp.size);
+        object->sp.ptr = OBJECT_PAYLOAD(dense);
+        _free_to_bucket(allocator, slab->bucket_index, storage);
+        moved += dense->sp.size;
+        spent += dense->sp.size;
+    }
+    allocator->compact_cursor = current;
+    // the partial slab a class keeps around is let go as well once it is empty
+    for (int i = 0; i < BUCKET_COUNT; i++) {
+        slab_t* slab = allocator->buckets[i].partial;
+        if (slab != NULL && slab->next == NULL && slab->free_count == slab->capacity) {
+            _slab_remove(&allocator->buckets[i].partial, slab);
+            if (!(allocator->base.flags & ALLOC_HUGE_PAGES)) {
+                _purge_slab(slab);
+            }
+            slab->next = allocator->empty_slabs;
+            allocator->empty_slabs = slab;
+        }
+    }
+    for (size_t pages = 1; pages <= LARGE_SPAN_PAGES; pages++) {
+        spans[pages] = allocator->large_spans[pages];
+        allocator->large_spans[pages] = NULL;
+    }
+    allocator->large_cached = 0;
+    lock_release(&allocator->lock);
+    for (size_t pages = 1; pages <= LARGE_SPAN_PAGES; pages++) {
+        while (spans[pages] != NULL) {
+            large_span_t* next = spans[pages]->next;
+            _unreserve(allocator, pages * PAGE_SIZE);
+            _unmap_pages(spans[pages], pages * PAGE_SIZE);
+            spans[pages] = next;
+        }
+    }
+    return moved;
+}
+
+alloc_mark_t _mark(const allocator_ptr_t* ptr) {
+    alloc_mark_t mark = { 0, NULL, 0, 0 };
+    if (!ptr || !(*ptr)) return mark;
+    bucket_allocator_t* allocator = (bucket_allocator_t*)((char*)(*ptr) - offsetof(bucket_allocator_t, base));
+    if (!_is_owner(allocator)) return mark;
+    // objects other threads allocated before the mark get their serials first
+    _drain_remote_free(allocator);
+    mark.serial = allocator->base.serial;
+    mark.epoch = allocator->base.epoch;
+    return mark;
+}
+
+// there is no arena position to go back to here, so rewinding is a bulk release of every live object allocated
+// after the mark, which form the head of block_list; their handles go under one lock
+void _rewind(const allocator_ptr_t* ptr, alloc_mark_t mark) {
+    if (!ptr || !(*ptr)) return;
+    bucket_allocator_t* allocator = (bucket_allocator_t*)((char*)(*ptr) - offsetof(bucket_allocator_t, base));
+    if (!_is_owner(allocator) || mark_is_stale(&allocator->base, mark)) return;
+    // objects on the remote free list reuse the serial field as a link, so they go first
+    _drain_remote_free(allocator);
+    object_t* freed = NULL;
+    mem_block_t* current = allocator->base.block_list;
+    while (current && ((object_t*)current->ptr)->serial >= mark.serial) {
+        mem_block_t* next = current->next;
+        object_t* object = (object_t*)current->ptr;
+        _unlink_block(allocator, current);
+        object->next = freed;
+        freed = object;
+        current = next;
+    }
+    _detach_handles(allocator, freed);
+    while (freed != NULL) {
+        object_t* next = freed->next;
+        _free_object(allocator, freed);
+        freed = next;
+    }
+    mark_record_rewind(&allocator->base, mark.serial);
+}
+
+// gc, which also makes the marks taken so far stale
+void _reset(const allocator_ptr_t* ptr) {
+    if (!ptr || !(*ptr)) return;
+    bucket_allocator_t* allocator = (bucket_allocator_t*)((char*)(*ptr) - offsetof(bucket_allocator_t, base));
+    if (!_is_owner(allocator)) return;
+    _gc(ptr);
+    mark_record_rewind(&allocator->base, 0);
+}
+
+void _adopt(const allocator_ptr_t* ptr) {
+    if (!ptr || !(*ptr)) return;
+    bucket_allocator_t* allocator = (bucket_allocator_t*)((char*)(*ptr) - offsetof(bucket_allocator_t, base));
+    atomic_store_explicit(&allocator->owner, alloc_thread_id(), memory_order_relaxed);
+    _drain_remote_free(allocator);
+}
+
+// the cache itself stays, its counters are part of stats
+void _flush(const allocator_ptr_t* ptr) {
+    if (!ptr || !(*ptr)) return;
+    bucket_allocator_t* allocator = (bucket_allocator_t*)((char*)(*ptr) - offsetof(bucket_allocator_t, base));
+    _flush_thread_cache(allocator);
+}
+
+unsigned int _flags(const allocator_ptr_t* ptr) {
+    if (!ptr || !(*ptr)) return 0;
+    bucket_allocator_t* allocator = (bucket_allocator_t*)((char*)(*ptr) - offsetof(bucket_allocator_t, base));
+    lock_acquire(&allocator->lock);
+    unsigned int flags = allocator->base.flags | allocator->arena_flags;
+    lock_release(&allocator->lock);
+    return flags;
+}
+
+void _stats(const allocator_ptr_t* ptr, alloc_stats_t* stats) {
+    if (!stats) return;
+    memset(stats, 0, sizeof(alloc_stats_t));
+    if (!ptr || !(*ptr)) return;
+    bucket_allocator_t* allocator = (bucket_allocator_t*)((char*)(*ptr) - offsetof(bucket_allocator_t, base));
+    stats->class_count = LARGE_ROW + 1;
+    lock_acquire(&allocator->lock);
+    for (int row = 0; row <= LARGE_ROW; row++) {
+        alloc_class_stats_t* class_stats = &stats->classes[row];
+        class_stats->block_size = row == LARGE_ROW ? 0 : bucket_sizes[row];
+        counters_read(&allocator->counters[row], class_stats);
+        for (thread_cache_t* cache = allocator->thread_caches; cache != NULL; cache = cache->next) {
+            counters_read(&cache->counters[row], class_stats);
+        }
+    }
+    for (int i = 0; i < BUCKET_COUNT; i++) {
+        // blocks parked in thread caches are neither free in their slab nor live
+        size_t free_blocks = 0;
+        size_t taken_blocks = 0;
+        slab_t* lists[2] = { allocator->buckets[i].partial, allocator->buckets[i].full };
+        for (int list = 0; list < 2; list++) {
+            for (slab_t* slab = lists[list]; slab != NULL; slab = slab->next) {
+                free_blocks += slab->free_count;
+                taken_blocks += slab->capacity - slab->free_count;
+            }
+        }
+        size_t live_blocks = (size_t)(stats->classes[i].allocs - stats->classes[i].releases);
+        stats->classes[i].free_blocks = free_blocks + (taken_blocks > live_blocks ? taken_blocks - live_blocks : 0);
+    }
+    for (size_t pages = 1; pages <= LARGE_SPAN_PAGES; pages++) {
+        for (large_span_t* span = allocator->large_spans[pages]; span != NULL; span = span->next) {
+            stats->classes[LARGE_ROW].free_blocks++;
+        }
+    }
+    stats->reserved_bytes = atomic_load_explicit(&allocator->reserved_bytes, memory_order_relaxed);
+    stats->peak_reserved_bytes = atomic_load_explicit(&allocator->peak_reserved_bytes, memory_order_relaxed);
+    lock_release(&allocator->lock);
+    stats_finish(stats);
 }
 
 void _destroy(const allocator_ptr_t* ptr) {
     if (!ptr || !(*ptr)) return;
     bucket_allocator_t* allocator = (bucket_allocator_t*)((char*)*ptr - offsetof(bucket_allocator_t, base));
-#ifdef _WIN32
-    VirtualFree(allocator->memory_block, 0, MEM_RELEASE);
-#else
-    munmap(allocator->memory_block, allocator->memory_size);
-#endif
+    if (thread_cache_id == allocator->id) {
+        thread_cache = NULL;
+        thread_cache_id = 0;
+    }
+    // objects other threads allocated may still wait to be linked, the large spans among them are unmapped below
+    _link_remote_allocs(allocator);
+    lock_destroy(&allocator->lock);
+    handles_destroy(allocator->base.handles);
+    // large spans live outside the chunks, both the live and the cached ones
+    mem_block_t* current = allocator->base.block_list;
+    while (current) {
+        mem_block_t* next = current->next;
+        object_t* object = (object_t*)current->ptr;
+        size_t extent = _object_extent(object);
+        object_t* storage = object_storage(object);
+        if (storage != NULL && _object_extent(storage) > MAX_BUCKET_SIZE) {
+            _unmap_pages(storage, _large_span_size(_object_extent(storage)));
+        }
+        if (extent > MAX_BUCKET_SIZE) {
+            _unmap_pages(object, _large_span_size(extent));
+        }
+        current = next;
+    }
+    for (size_t pages = 1; pages <= LARGE_SPAN_PAGES; pages++) {
+        large_span_t* span = allocator->large_spans[pages];
+        while (span) {
+            large_span_t* next = span->next;
+            _unmap_pages(span, pages * PAGE_SIZE);
+            span = next;
+        }
+    }
+    // the first chunk holds the allocator itself and is the last one in the list
+    chunk_t* chunk = allocator->chunks;
+    while (chunk) {
+        chunk_t* next = chunk->next;
+        _unmap_chunk(chunk);
+        chunk = next;
+    }
     *((allocator_ptr_t*)ptr) = NULL;
 }
@@ -1,152 +1,660 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 
-#define MEMORY_SIZE 4096 // 4KB
+#define MEMORY_SIZE 4096 // 4KB first region
+#define MAX_REGION_SIZE ((size_t)4096 * 16384) // 64MB, region sizes double up to this limit
 
 #include "../api/alloc.h"
 #include "../alloc.h"
+#include "../pages.h"
+#include "../handles.h"
+
+typedef struct region {
+    struct region* next;
+    size_t size;
+} region_t;
+
+// every allocator owns its chain of regions, the newest one is bumped and the allocator lives in the oldest
+typedef struct bump_allocator {
+    allocator_t base;
+    region_t* regions;
+    region_t* spare_regions; // regions dropped by rewind or reset, reused before mapping new ones
+    size_t memory_offset;
+    size_t next_region_size;
+    unsigned int arena_flags; // ALLOC_HUGE_PAGES and the page mode the regions got
+    class_counters_t counters; // every slot is bumped the same way, so there is a single class
+    size_t reserved_bytes;
+    size_t peak_reserved_bytes;
+    unsigned long mark_serial; // serial of the newest mark, resize leaves the slots of older objects where they are
+    // end of the newest storage that resize bumped for an object older than the newest mark, rewind keeps the arena
+    // up to there while such an object may still be live; pinned_region is NULL when there is none
+    const region_t* pinned_region;
+    size_t pinned_offset;
+    unsigned long pinned_serial; // lowest serial of the objects that pinned the arena
+    _Atomic(const void*) owner; // the thread that created the allocator, objects are dropped on it alone
+    lock_t lock; // guards the handle table, which other threads' last releases detach from
+    // written by foreign threads only, kept off the cache lines the owner uses on every call
+    char remote_free_pad[CACHE_LINE_SIZE];
+    _Atomic(object_t*) remote_free;
+} bump_allocator_t;
+
+#define FIRST_OFFSET (sizeof(region_t) + ((sizeof(bump_allocator_t) + OBJECT_ALIGNMENT - 1) & ~(size_t)(OBJECT_ALIGNMENT - 1)))
 
 static allocator_ptr_t _init(void);
+static allocator_ptr_t _init_with(unsigned int flags);
 static sp_ptr_t _alloc(const allocator_ptr_t* ptr, size_t size);
+static size_t _alloc_batch(const allocator_ptr_t* ptr, size_t size, size_t count, sp_ptr_t* out);
+static sp_ptr_t _alloc_aligned(const allocator_ptr_t* ptr, size_t size, size_t alignment);
 static void* _retain(const sp_ptr_t* ptr);
+static void* _resize(const sp_ptr_t* ptr, size_t size);
 static void _release(const sp_ptr_t* ptr);
+static void _release_batch(sp_ptr_t* sps, size_t count);
+static alloc_handle_t _handle(const sp_ptr_t* sp);
+static sp_ptr_t _resolve(const allocator_ptr_t* ptr, alloc_handle_t handle);
+static void* _handle_retain(const allocator_ptr_t* ptr, alloc_handle_t handle);
+static void _handle_release(const allocator_ptr_t* ptr, alloc_handle_t handle);
 static void _gc(const allocator_ptr_t* ptr);
+static int _gc_step(const allocator_ptr_t* ptr, size_t max_blocks);
+static size_t _compact(const allocator_ptr_t* ptr, size_t budget);
+static alloc_mark_t _mark(const allocator_ptr_t* ptr);
+static void _rewind(const allocator_ptr_t* ptr, alloc_mark_t mark);
+static void _reset(const allocator_ptr_t* ptr);
+static void _adopt(const allocator_ptr_t* ptr);
+static void _flush(const allocator_ptr_t* ptr);
+static unsigned int _flags(const allocator_ptr_t* ptr);
+static void _stats(const allocator_ptr_t* ptr, alloc_stats_t* stats);
 static void _destroy(const allocator_ptr_t* ptr);
 
 static alloc_t reference_counting_allocator = {
     .init = _init,
+    .init_with = _init_with,
     .alloc = _alloc,
+    .alloc_batch = _alloc_batch,
+    .alloc_aligned = _alloc_aligned,
     .retain = _retain,
+    .resize = _resize,
     .release = _release,
+    .release_batch = _release_batch,
+    .handle = _handle,
+    .resolve = _resolve,
+    .handle_retain = _handle_retain,
+    .handle_release = _handle_release,
     .gc = _gc,
+    .gc_step = _gc_step,
+    .compact = _compact,
+    .mark = _mark,
+    .rewind = _rewind,
+    .reset = _reset,
+    .adopt = _adopt,
+    .flush = _flush,
+    .flags = _flags,
+    .stats = _stats,
     .destroy = _destroy
 };
 
-static void* memory_block = NULL;
-static size_t memory_offset = 0;
-
 alloc_ptr_t alloc = &reference_counting_allocator;
 
-static void* _malloc(size_t size) {
+static region_t* _map_region(size_t size, unsigned int* flags) {
+    size = pages_arena_size(size, *flags);
+    void* memory_block = pages_map_arena(size, flags);
     if (memory_block == NULL) {
         return NULL;
     }
-    if (memory_offset + size > MEMORY_SIZE) {
+    region_t* region = (region_t*)memory_block;
+    region->next = NULL;
+    region->size = size;
+    return region;
+}
+
+static void _unmap_region(region_t* region) {
+    pages_unmap_arena(region, region->size);
+}
+
+static void* _malloc(bump_allocator_t* allocator, size_t size) {
+    // no region gets that large, and the sums below cannot wrap for anything smaller
+    if (size > SIZE_MAX / 2) {
         return NULL;
     }
-    void* ptr = (char*)memory_block + memory_offset;
-    memory_offset += size;
+    if (allocator->memory_offset + size > allocator->regions->size) {
+        region_t* region = allocator->spare_regions;
+        if (region != NULL && region->size >= sizeof(region_t) + size) {
+            allocator->spare_regions = region->next;
+        } else {
+            size_t region_size = allocator->next_region_size;
+            while (region_size < sizeof(region_t) + size) {
+                if (region_size > SIZE_MAX / 2) {
+                    return NULL;
+                }
+                region_size *= 2;
+            }
+            region = _map_region(region_size, &allocator->arena_flags);
+            if (region == NULL) {
+                return NULL;
+            }
+            allocator->reserved_bytes += region->size;
+            if (allocator->reserved_bytes > allocator->peak_reserved_bytes) {
+                allocator->peak_reserved_bytes = allocator->reserved_bytes;
+            }
+            if (allocator->next_region_size < MAX_REGION_SIZE) {
+                allocator->next_region_size *= 2;
+            }
+        }
+        region->next = allocator->regions;
+        allocator->regions = region;
+        allocator->memory_offset = sizeof(region_t);
+    }
+    void* ptr = (char*)allocator->regions + allocator->memory_offset;
+    allocator->memory_offset += size;
     return ptr;
 }
 
 allocator_ptr_t _init(void) {
-    if (memory_block == NULL) {
-#ifdef _WIN32
-        memory_block = VirtualAlloc(NULL, MEMORY_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
-#else
-        memory_block = mmap(NULL, MEMORY_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-#endif
-        if (memory_block == NULL) {
-            return NULL;
+    return _init_with(0);
+}
+
+allocator_ptr_t _init_with(unsigned int flags) {
+    flags &= ~(unsigned int)ALLOC_HUGE_PAGE_MODES;
+    unsigned int arena_flags = flags & ALLOC_HUGE_PAGES;
+    region_t* region = _map_region(MEMORY_SIZE, &arena_flags);
+    if (region == NULL) {
+        return NULL;
+    }
+    bump_allocator_t* allocator = (bump_allocator_t*)(region + 1);
+    allocator->regions = region;
+    allocator->spare_regions = NULL;
+    allocator->memory_offset = FIRST_OFFSET;
+    allocator->next_region_size = region->size * 2;
+    allocator->arena_flags = arena_flags;
+    memset(&allocator->counters, 0, sizeof(allocator->counters));
+    allocator->reserved_bytes = region->size;
+    allocator->peak_reserved_bytes = region->size;
+    allocator->mark_serial = 0;
+    allocator->pinned_region = NULL;
+    allocator->pinned_offset = 0;
+    allocator->pinned_serial = 0;
+    atomic_init(&allocator->owner, alloc_thread_id());
+    lock_init(&allocator->lock);
+    atomic_init(&allocator->remote_free, NULL);
+    allocator->base.block_list = NULL;
+    allocator->base.total_blocks = 0;
+    allocator->base.flags = flags;
+    allocator->base.serial = 0;
+    allocator->base.sweep_cursor = NULL;
+    allocator->base.sweeping = 0;
+    rewinds_init(&allocator->base);
+    allocator->base.handles = NULL;
+    if (flags & ALLOC_HANDLE_TABLE) {
+        allocator->base.handles = handles_create();
+        if (allocator->base.handles == NULL) {
+            allocator->base.flags &= ~(unsigned int)ALLOC_HANDLE_TABLE;
         }
     }
-    memory_offset = 0;
-    allocator_t* allocator = _malloc(sizeof(allocator_t));
-    if (!allocator) return NULL;
-    allocator->block_list = NULL;
-    allocator->total_blocks = 0;
-    return allocator;
+    return &allocator->base;
 }
 
-sp_ptr_t _alloc(const allocator_ptr_t* ptr, size_t size) {
-    if (!ptr || !(*ptr)) return NULL;
-    void* _ptr = _malloc(size);
-    if (!_ptr) {
-        return NULL;
+static size_t _slot_size(size_t size) {
+    return OBJECT_HEADER_SIZE + ((size + OBJECT_ALIGNMENT - 1) & ~(size_t)(OBJECT_ALIGNMENT - 1));
+}
+
+// the slot of an object whose payload moved out keeps the size it had, recorded in the storage
+static size_t _object_slot_size(const object_t* object) {
+    object_t* storage = object_storage(object);
+    return _slot_size(storage != NULL ? storage->slot_extent - OBJECT_HEADER_SIZE : object->sp.size);
+}
+
+// the handle table changes under the lock, an allocator without one takes none
+static void _attach_handle(bump_allocator_t* allocator, sp_t* sp) {
+    if (allocator->base.handles == NULL) {
+        sp->handle = 0;
+        return;
     }
-    mem_block_t* block = _malloc(sizeof(mem_block_t));
-    if (!block) {
-        // free(ptr); // Cannot free from bump allocator
-        return NULL;
+    lock_acquire(&allocator->lock);
+    handles_attach(allocator->base.handles, sp);
+    lock_release(&allocator->lock);
+}
+
+static void _detach_handle(bump_allocator_t* allocator, sp_t* sp) {
+    if (allocator->base.handles == NULL || sp->handle == 0) {
+        return;
     }
-    struct sp* smart_pointer = _malloc(sizeof(struct sp));
-    if (!smart_pointer) {
-        // free(ptr); // Cannot free from bump allocator
-        // free(block); // Cannot free from bump allocator
-        return NULL;
+    lock_acquire(&allocator->lock);
+    handles_detach(allocator->base.handles, sp);
+    lock_release(&allocator->lock);
+}
+
+// the slot stays where it is until its region is dropped, only the counters and the handle let go of it; it stops
+// passing for an sp_t, so that a copy of its pointer released later is turned away by the self check
+static void _drop_object(bump_allocator_t* allocator, object_t* object) {
+    object_t* storage = object_storage(object);
+    _detach_handle(allocator, &object->sp);
+    object->sp.self = NULL;
+    if (storage != NULL) {
+        counters_release(&allocator->counters, 1, storage->sp.size, _slot_size(storage->sp.size));
+    }
+    counters_release(&allocator->counters, 1, storage != NULL ? 0 : object->sp.size, _object_slot_size(object));
+}
+
+static void _unlink_block(allocator_t* allocator, mem_block_t* current) {
+    sweep_skip(allocator, current);
+    if (current->next != NULL) {
+        current->next->prev = current->prev;
+    }
+    if (current->prev != NULL) {
+        current->prev->next = current->next;
+    } else {
+        allocator->block_list = current->next;
+    }
+    allocator->total_blocks--;
+}
+
+static int _is_owner(bump_allocator_t* allocator) {
+    return atomic_load_explicit(&allocator->owner, memory_order_relaxed) == alloc_thread_id();
+}
+
+// drops the objects other threads released the last reference to, they are still in block_list; their handles went
+// when they were queued
+static void _drain_remote_free(bump_allocator_t* allocator) {
+    object_t* object = remote_free_take(&allocator->remote_free);
+    while (object != NULL) {
+        object_t* next = object->next;
+        _unlink_block(&allocator->base, &object->block);
+        _drop_object(allocator, object);
+        object = next;
     }
-    allocator_t* _allocator = (allocator_t*)(*ptr);
+}
+
+static void _drain_remote_free_if_owner(bump_allocator_t* allocator) {
+    if (atomic_load_explicit(&allocator->remote_free, memory_order_relaxed) != NULL && _is_owner(allocator)) {
+        _drain_remote_free(allocator);
+    }
+}
+
+static sp_t* _init_object(allocator_t* allocator, object_t* object, size_t size) {
+    struct sp* smart_pointer = &object->sp;
+    mem_block_t* block = &object->block;
     smart_pointer->self = (sp_ptr_t)smart_pointer;
-    smart_pointer->ref_count = 1;
+    atomic_init(&smart_pointer->ref_count, 1);
     smart_pointer->size = size;
-    smart_pointer->ptr = _ptr;
-    smart_pointer->allocator = _allocator;
+    smart_pointer->ptr = OBJECT_PAYLOAD(object);
+    smart_pointer->allocator = allocator;
     smart_pointer->block = block;
     block->ptr = smart_pointer;
-    block->next = (*ptr)->block_list;
+    _attach_handle((bump_allocator_t*)allocator, smart_pointer);
+    object->serial = allocator->serial++;
+    block->next = allocator->block_list;
     block->prev = NULL;
-    if ((*ptr)->block_list != NULL) {
-        (*ptr)->block_list->prev = block;
+    if (allocator->block_list != NULL) {
+        allocator->block_list->prev = block;
     }
-    _allocator->block_list = block;
-    _allocator->total_blocks++;
+    allocator->block_list = block;
+    allocator->total_blocks++;
+    counters_alloc(&((bump_allocator_t*)allocator)->counters, 1, size, _slot_size(size));
     return smart_pointer;
 }
 
+sp_ptr_t _alloc(const allocator_ptr_t* ptr, size_t size) {
+    if (!ptr || !(*ptr)) return NULL;
+    if (size > SIZE_MAX - OBJECT_HEADER_SIZE - OBJECT_ALIGNMENT) return NULL;
+    _drain_remote_free_if_owner((bump_allocator_t*)(*ptr));
+    // the payload shares one slot with its sp_t and mem_block_t
+    object_t* object = _malloc((bump_allocator_t*)(*ptr), _slot_size(size));
+    if (!object) {
+        return NULL;
+    }
+    return _init_object((allocator_t*)(*ptr), object, size);
+}
+
+size_t _alloc_batch(const allocator_ptr_t* ptr, size_t size, size_t count, sp_ptr_t* out) {
+    if (!ptr || !(*ptr) || !out || count == 0) return 0;
+    if (size > SIZE_MAX - OBJECT_HEADER_SIZE - OBJECT_ALIGNMENT) return 0;
+    size_t slot_size = _slot_size(size);
+    if (count > SIZE_MAX / slot_size) return 0;
+    // the whole run is carved with a single bump, falling back to one slot at a time near the end of the region
+    bump_allocator_t* allocator = (bump_allocator_t*)(*ptr);
+    _drain_remote_free_if_owner(allocator);
+    char* run = _malloc(allocator, slot_size * count);
+    for (size_t i = 0; i < count; i++) {
+        object_t* object = run ? (object_t*)(run + i * slot_size) : _malloc(allocator, slot_size);
+        if (!object) {
+            return i;
+        }
+        out[i] = _init_object((allocator_t*)(*ptr), object, size);
+    }
+    return count;
+}
+
+sp_ptr_t _alloc_aligned(const allocator_ptr_t* ptr, size_t size, size_t alignment) {
+    alignment = object_alignment(alignment);
+    if (!ptr || !(*ptr) || alignment == 0) return NULL;
+    if (size > SIZE_MAX - OBJECT_HEADER_SIZE - 2 * alignment) return NULL;
+    bump_allocator_t* allocator = (bump_allocator_t*)(*ptr);
+    _drain_remote_free_if_owner(allocator);
+    size_t slot_size = _slot_size(size);
+    // room for the worst case padding is bumped, then everything past the slot is handed back
+    char* memory = _malloc(allocator, slot_size + alignment - OBJECT_ALIGNMENT);
+    if (!memory) {
+        return NULL;
+    }
+    uintptr_t payload = ((uintptr_t)memory + OBJECT_HEADER_SIZE + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    object_t* object = (object_t*)(payload - OBJECT_HEADER_SIZE);
+    allocator->memory_offset = (size_t)((char*)object + slot_size - (char*)allocator->regions);
+    return _init_object((allocator_t*)(*ptr), object, size);
+}
+
 void* _retain(const sp_ptr_t* sp) {
     if (!sp || !(*sp) || (*sp)->self != (sp_ptr_t)*sp) return NULL;
     sp_t* ptr = (sp_t*)*sp;
-    ptr->ref_count++;
+    sp_add_reference(ptr);
     return ptr->ptr;
 }
 
+void* _resize(const sp_ptr_t* sp, size_t size) {
+    if (!sp || !(*sp) || (*sp)->self != (sp_ptr_t)*sp) return NULL;
+    if (size > SIZE_MAX - OBJECT_HEADER_SIZE - OBJECT_ALIGNMENT) return NULL;
+    object_t* object = (object_t*)*sp;
+    bump_allocator_t* allocator = (bump_allocator_t*)object->sp.allocator;
+    object_t* storage = object_storage(object);
+    object_t* slot = storage != NULL ? storage : object;
+    // the newest slot grows and shrinks with the bump pointer, any other one only within its rounding; so does the
+    // slot of an object older than the newest mark, which rewinding to that mark would otherwise hand out again
+    size_t slot_offset = (size_t)((char*)slot - (char*)allocator->regions);
+    class_counters_t* counters = &allocator->counters;
+    int older_than_mark = object->serial < allocator->mark_serial;
+    if (!older_than_mark && (char*)slot + _slot_size(slot->sp.size) == (char*)allocator->regions + allocator->memory_offset
+        && _slot_size(size) <= allocator->regions->size - slot_offset) {
+        allocator->memory_offset = slot_offset + _slot_size(size);
+    } else if (_slot_size(size) > _slot_size(slot->sp.size)) {
+        // slots are never freed here, the old one is reclaimed with its region by rewind, reset or destroy
+        object_t* moved = _malloc(allocator, _slot_size(size));
+        if (!moved) {
+            return NULL;
+        }
+        counters_alloc(counters, 1, size, _slot_size(size));
+        if (storage != NULL) {
+            counters_release(counters, 1, storage->sp.size, _slot_size(storage->sp.size));
+        } else {
+            counters_resize(counters, object->sp.size, 0);
+        }
+        size_t slot_extent = storage != NULL ? storage->slot_extent : OBJECT_HEADER_SIZE + object->sp.size;
+        object_init_storage(moved, object, size);
+        moved->slot_extent = slot_extent;
+        memcpy(OBJECT_PAYLOAD(moved), object->sp.ptr, object->sp.size);
+        object->sp.ptr = OBJECT_PAYLOAD(moved);
+        object->sp.size = size;
+        if (older_than_mark) {
+            if (allocator->pinned_region == NULL || object->serial < allocator->pinned_serial) {
+                allocator->pinned_serial = object->serial;
+            }
+            allocator->pinned_region = allocator->regions;
+            allocator->pinned_offset = allocator->memory_offset;
+        }
+        return object->sp.ptr;
+    }
+    counters_resize(counters, slot->sp.size, size);
+    counter_add(&counters->slot_bytes, (unsigned long long)_slot_size(size) - _slot_size(slot->sp.size));
+    slot->sp.size = size;
+    object->sp.size = size;
+    return object->sp.ptr;
+}
+
 void _release(const sp_ptr_t* sp) {
     if (!sp || !(*sp) || (*sp)->self != (sp_ptr_t)*sp) return;
     sp_ptr_t* sp_ptr = (sp_ptr_t*)sp;
     sp_t* ptr = (sp_t*)(*sp);
-    ptr->ref_count--;
-    if (ptr->ref_count <= 0) {
+    if (sp_drop_reference(ptr)) {
         allocator_t* allocator = (allocator_t*)ptr->allocator;
+        // block_list and the counters belong to the owner, so another thread's last release is queued for it; its
+        // handle goes right away, a queued object must not resolve while it waits for the owner
+        if (!_is_owner((bump_allocator_t*)allocator)) {
+            _detach_handle((bump_allocator_t*)allocator, ptr);
+            remote_free_push(&((bump_allocator_t*)allocator)->remote_free, (object_t*)ptr, (object_t*)ptr);
+            *sp_ptr = NULL;
+            return;
+        }
         mem_block_t* current = ptr->block;
         if (current && current->ptr == ptr) {
-            if (current->next != NULL) {
-                current->next->prev = current->prev;
-            }
-            if (current->prev != NULL) {
-                current->prev->next = current->next;
-            } else {
-                allocator->block_list = current->next;
-            }
-            // free(current); // Cannot free from bump allocator
-            allocator->total_blocks--;
+            _unlink_block(allocator, current);
+            _drop_object((bump_allocator_t*)allocator, (object_t*)ptr);
         }
-        // free(ptr->ptr); // Cannot free from bump allocator
         // free(ptr); // Cannot free from bump allocator
         *sp_ptr = NULL;
     }
 }
 
+void _release_batch(sp_ptr_t* sps, size_t count) {
+    if (!sps) return;
+    for (size_t i = 0; i < count; i++) {
+        _release(&sps[i]);
+    }
+}
+
+alloc_handle_t _handle(const sp_ptr_t* sp) {
+    if (!sp || !(*sp) || (*sp)->self != (sp_ptr_t)*sp) return 0;
+    return (*sp)->handle;
+}
+
+sp_ptr_t _resolve(const allocator_ptr_t* ptr, alloc_handle_t handle) {
+    if (!ptr || !(*ptr)) return NULL;
+    return handles_lookup((*ptr)->handles, handle);
+}
+
+void* _handle_retain(const allocator_ptr_t* ptr, alloc_handle_t handle) {
+    sp_ptr_t sp = _resolve(ptr, handle);
+    return _retain(&sp);
+}
+
+void _handle_release(const allocator_ptr_t* ptr, alloc_handle_t handle) {
+    sp_ptr_t sp = _resolve(ptr, handle);
+    _release(&sp);
+}
+
 void _gc(const allocator_ptr_t* ptr) {
     if (!ptr || !(*ptr) || (*ptr)->block_list == NULL || (*ptr)->total_blocks == 0) return;
+    if (!_is_owner((bump_allocator_t*)(*ptr))) return;
     allocator_t* allocator = (allocator_t*)(*ptr);
+    // queued remote frees are still in block_list and are dropped below
+    atomic_store_explicit(&((bump_allocator_t*)allocator)->remote_free, NULL, memory_order_relaxed);
     mem_block_t* current = (mem_block_t*)allocator->block_list;
     while (current) {
         mem_block_t* next = (mem_block_t*)current->next;
-        // struct sp* ptr = (struct sp*)current->ptr;
-        // free(ptr->ptr); // Cannot free from bump allocator
-        // free(ptr); // Cannot free from bump allocator
-        // free(current); // Cannot free from bump allocator
+        // free(current->ptr); // Cannot free from bump allocator
+        _drop_object((bump_allocator_t*)allocator, (object_t*)current->ptr);
         allocator->total_blocks--;
         current = next;
     }
     allocator->block_list = NULL;
+    sweep_stop(allocator);
+}
+
+int _gc_step(const allocator_ptr_t* ptr, size_t max_blocks) {
+    if (!ptr || !(*ptr) || !_is_owner((bump_allocator_t*)(*ptr))) return 1;
+    allocator_t* allocator = (allocator_t*)(*ptr);
+    // queued remote frees are still in block_list, they are dropped here so that the sweep does not drop them again
+    _drain_remote_free((bump_allocator_t*)allocator);
+    mem_block_t* current = sweep_start(allocator);
+    for (size_t count = 0; current != NULL && (max_blocks == 0 || count < max_blocks); count++) {
+        _unlink_block(allocator, current);
+        _drop_object((bump_allocator_t*)allocator, (object_t*)current->ptr);
+        current = allocator->sweep_cursor;
+    }
+    if (current != NULL) {
+        return 0;
+    }
+    sweep_stop(allocator);
+    return 1;
+}
+
+// slots are never reused, so nothing is moved; the regions rewind and reset dropped go back to the OS
+size_t _compact(const allocator_ptr_t* ptr, size_t budget) {
+    (void)budget;
+    if (!ptr || !(*ptr)) return 0;
+    bump_allocator_t* allocator = (bump_allocator_t*)*ptr;
+    if (!_is_owner(allocator)) return 0;
+    _drain_remote_free(allocator);
+    region_t* region = allocator->spare_regions;
+    allocator->spare_regions = NULL;
+    while (region) {
+        region_t* next = region->next;
+        allocator->reserved_bytes -= region->size;
+        _unmap_region(region);
+        region = next;
+    }
+    return 0;
+}
+
+alloc_mark_t _mark(const allocator_ptr_t* ptr) {
+    alloc_mark_t mark = { 0, NULL, 0, 0 };
+    if (!ptr || !(*ptr)) return mark;
+    bump_allocator_t* allocator = (bump_allocator_t*)*ptr;
+    if (!_is_owner(allocator)) return mark;
+    mark.serial = allocator->base.serial;
+    mark.epoch = allocator->base.epoch;
+    allocator->mark_serial = mark.serial;
+    mark.region = allocator->regions;
+    mark.offset = allocator->memory_offset;
+    return mark;
+}
+
+// moves every region newer than the given one to the spare list
+static void _drop_regions(bump_allocator_t* allocator, const region_t* keep) {
+    while (allocator->regions != keep && allocator->regions->next != NULL) {
+        region_t* region = allocator->regions;
+        allocator->regions = region->next;
+        region->next = allocator->spare_regions;
+        allocator->spare_regions = region;
+    }
+}
+
+// the arena goes back to the mark, or only as far as the pin when an object older than the mark that is still live
+// had its payload moved past it
+static void _rewind_position(bump_allocator_t* allocator, alloc_mark_t mark, const region_t** region, size_t* offset) {
+    *region = (const region_t*)mark.region;
+    *offset = mark.offset;
+    if (allocator->pinned_region == NULL) {
+        return;
+    }
+    if (mark.serial <= allocator->pinned_serial) {
+        // every object that pinned the arena is newer than the mark and goes with the rewind
+        allocator->pinned_region = NULL;
+        return;
+    }
+    // regions are listed newest first, so whichever of the two comes first is further on
+    for (const region_t* current = allocator->regions; current != NULL; current = current->next) {
+        if (current == allocator->pinned_region) {
+            if (current != *region || allocator->pinned_offset > *offset) {
+                *region = allocator->pinned_region;
+                *offset = allocator->pinned_offset;
+            }
+            return;
+        }
+        if (current == *region) {
+            return;
+        }
+    }
+}
+
+void _rewind(const allocator_ptr_t* ptr, alloc_mark_t mark) {
+    if (!ptr || !(*ptr) || mark.region == NULL) return;
+    bump_allocator_t* allocator = (bump_allocator_t*)*ptr;
+    if (!_is_owner(allocator) || mark_is_stale(&allocator->base, mark)) return;
+    // objects on the remote free list reuse the serial field as a link, so they go first
+    _drain_remote_free(allocator);
+    // objects allocated after the mark are the head of block_list, only their list nodes are dropped
+    mem_block_t* current = allocator->base.block_list;
+    while (current && ((object_t*)current->ptr)->serial >= mark.serial) {
+        sweep_skip(&allocator->base, current);
+        _drop_object(allocator, (object_t*)current->ptr);
+        allocator->base.total_blocks--;
+        current = current->next;
+    }
+    allocator->base.block_list = current;
+    if (current != NULL) {
+        current->prev = NULL;
+    }
+    const region_t* region;
+    size_t offset;
+    _rewind_position(allocator, mark, &region, &offset);
+    _drop_regions(allocator, region);
+    allocator->memory_offset = offset;
+    allocator->mark_serial = mark.serial;
+    mark_record_rewind(&allocator->base, mark.serial);
+}
+
+void _reset(const allocator_ptr_t* ptr) {
+    if (!ptr || !(*ptr)) return;
+    bump_allocator_t* allocator = (bump_allocator_t*)*ptr;
+    if (!_is_owner(allocator)) return;
+    allocator->base.block_list = NULL;
+    allocator->base.total_blocks = 0;
+    atomic_store_explicit(&allocator->remote_free, NULL, memory_order_relaxed);
+    sweep_stop(&allocator->base);
+    if (allocator->base.handles != NULL) {
+        lock_acquire(&allocator->lock);
+        handles_clear(allocator->base.handles);
+        lock_release(&allocator->lock);
+    }
+    // every object still counted as live goes at once
+    class_counters_t* counters = &allocator->counters;
+    atomic_store_explicit(&counters->releases, atomic_load_explicit(&counters->allocs, memory_order_relaxed), memory_order_relaxed);
+    atomic_store_explicit(&counters->live_bytes, 0, memory_order_relaxed);
+    atomic_store_explicit(&counters->slot_bytes, 0, memory_order_relaxed);
+    _drop_regions(allocator, NULL);
+    allocator->memory_offset = FIRST_OFFSET;
+    allocator->mark_serial = 0;
+    allocator->pinned_region = NULL;
+    mark_record_rewind(&allocator->base, 0);
+}
+
+void _adopt(const allocator_ptr_t* ptr) {
+    if (!ptr || !(*ptr)) return;
+    bump_allocator_t* allocator = (bump_allocator_t*)*ptr;
+    atomic_store_explicit(&allocator->owner, alloc_thread_id(), memory_order_relaxed);
+    _drain_remote_free(allocator);
+}
+
+// slots are bumped from the allocator's regions, no thread keeps any
+void _flush(const allocator_ptr_t* ptr) {
+    (void)ptr;
+}
+
+unsigned int _flags(const allocator_ptr_t* ptr) {
+    if (!ptr || !(*ptr)) return 0;
+    bump_allocator_t* allocator = (bump_allocator_t*)*ptr;
+    return allocator->base.flags | allocator->arena_flags;
+}
+
+void _stats(const allocator_ptr_t* ptr, alloc_stats_t* stats) {
+    if (!stats) return;
+    memset(stats, 0, sizeof(alloc_stats_t));
+    if (!ptr || !(*ptr)) return;
+    bump_allocator_t* allocator = (bump_allocator_t*)*ptr;
+    stats->class_count = 1;
+    counters_read(&allocator->counters, &stats->classes[0]);
+    stats->reserved_bytes = allocator->reserved_bytes;
+    stats->peak_reserved_bytes = allocator->peak_reserved_bytes;
+    stats_finish(stats);
 }
 
 void _destroy(const allocator_ptr_t* ptr) {
     if (!ptr || !(*ptr)) return;
     allocator_ptr_t* allocator_ptr = (allocator_ptr_t*)ptr;
-    //allocator_t* allocator = (allocator_t*)*ptr;
+    bump_allocator_t* allocator = (bump_allocator_t*)*ptr;
     *allocator_ptr = NULL;
-    // free(allocator); // Cannot free from bump allocator
+    handles_destroy(allocator->base.handles);
+    lock_destroy(&allocator->lock);
+    region_t* region = allocator->spare_regions;
+    while (region) {
+        region_t* next = region->next;
+        _unmap_region(region);
+        region = next;
+    }
+    // the oldest region holds the allocator itself and is the last one in the list
+    region = allocator->regions;
+    while (region) {
+        region_t* next = region->next;
+        _unmap_region(region);
+        region = next;
+    }
 }
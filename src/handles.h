@@ -0,0 +1,171 @@
+#ifndef HANDLES_H
+#define HANDLES_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+#include "api/alloc.h"
+#include "alloc.h"
+#include "pages.h"
+
+#define HANDLE_INDEX_BITS 22 // a table holds up to 4M live handles
+#define HANDLE_INDEX_MASK ((1u << HANDLE_INDEX_BITS) - 1)
+#define HANDLE_GENERATION_MASK ((1u << (32 - HANDLE_INDEX_BITS)) - 1)
+#define HANDLE_SEGMENT_SIZE 4096 // entries mapped at a time
+#define HANDLE_SEGMENT_COUNT ((HANDLE_INDEX_MASK + 1) / HANDLE_SEGMENT_SIZE)
+
+// generation is the one the entry's current or next object gets, sp is NULL while the entry is free
+typedef struct handle_entry {
+    _Atomic(sp_t*) sp;
+    atomic_uint generation;
+    unsigned int next_free;
+} handle_entry_t;
+
+// segments are never moved once mapped, so a lookup needs no lock; handles are handed out and dropped by whoever
+// owns block_list, and freed entries are reused oldest first so that a generation takes long to come around again
+typedef struct handle_table {
+    _Atomic(handle_entry_t*) segments[HANDLE_SEGMENT_COUNT];
+    unsigned int used; // entries past this one were never handed out
+    unsigned int free_head; // oldest free entry plus one, 0 when there is none
+    unsigned int free_tail;
+} handle_table_t;
+
+// NULL for an index whose segment was never mapped, which a handle from outside may well have
+static inline handle_entry_t* handles_entry(handle_table_t* table, unsigned int index) {
+    handle_entry_t* segment = atomic_load_explicit(&table->segments[index / HANDLE_SEGMENT_SIZE], memory_order_acquire);
+    return segment != NULL ? &segment[index % HANDLE_SEGMENT_SIZE] : NULL;
+}
+
+// for indexes below used, whose segment was mapped before they were handed out
+static inline handle_entry_t* handles_slot(handle_table_t* table, unsigned int index) {
+    handle_entry_t* segment = atomic_load_explicit(&table->segments[(index & HANDLE_INDEX_MASK) / HANDLE_SEGMENT_SIZE], memory_order_relaxed);
+    return &segment[index % HANDLE_SEGMENT_SIZE];
+}
+
+// NULL when the table cannot be mapped, the allocator then runs without one
+static inline handle_table_t* handles_create(void) {
+    unsigned int flags = 0;
+    handle_table_t* table = (handle_table_t*)pages_map_arena(sizeof(handle_table_t), &flags);
+    if (table == NULL) {
+        return NULL;
+    }
+    for (size_t i = 0; i < HANDLE_SEGMENT_COUNT; i++) {
+        atomic_init(&table->segments[i], NULL);
+    }
+    table->used = 0;
+    table->free_head = 0;
+    table->free_tail = 0;
+    return table;
+}
+
+static inline void handles_destroy(handle_table_t* table) {
+    if (table == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < HANDLE_SEGMENT_COUNT; i++) {
+        handle_entry_t* segment = atomic_load_explicit(&table->segments[i], memory_order_relaxed);
+        if (segment != NULL) {
+            pages_unmap_arena(segment, sizeof(handle_entry_t) * HANDLE_SEGMENT_SIZE);
+        }
+    }
+    pages_unmap_arena(table, sizeof(handle_table_t));
+}
+
+// gives the object a handle, or leaves sp->handle at 0 when the table is full
+static inline void handles_attach(handle_table_t* table, sp_t* sp) {
+    sp->handle = 0;
+    if (table == NULL) {
+        return;
+    }
+    unsigned int index;
+    handle_entry_t* entry;
+    if (table->free_head != 0) {
+        index = table->free_head - 1;
+        entry = handles_slot(table, index);
+        table->free_head = entry->next_free;
+        if (table->free_head == 0) {
+            table->free_tail = 0;
+        }
+    } else {
+        if (table->used > HANDLE_INDEX_MASK) {
+            return;
+        }
+        index = table->used;
+        if (index % HANDLE_SEGMENT_SIZE == 0) {
+            unsigned int flags = 0;
+            handle_entry_t* segment = (handle_entry_t*)pages_map_arena(sizeof(handle_entry_t) * HANDLE_SEGMENT_SIZE, &flags);
+            if (segment == NULL) {
+                return;
+            }
+            for (size_t i = 0; i < HANDLE_SEGMENT_SIZE; i++) {
+                atomic_init(&segment[i].sp, NULL);
+                atomic_init(&segment[i].generation, 1);
+                segment[i].next_free = 0;
+            }
+            atomic_store_explicit(&table->segments[index / HANDLE_SEGMENT_SIZE], segment, memory_order_release);
+        }
+        table->used++;
+        entry = handles_slot(table, index);
+    }
+    atomic_store_explicit(&entry->sp, sp, memory_order_release);
+    sp->handle = (atomic_load_explicit(&entry->generation, memory_order_relaxed) << HANDLE_INDEX_BITS) | index;
+}
+
+static inline void handles_free(handle_table_t* table, unsigned int index) {
+    handle_entry_t* entry = handles_slot(table, index);
+    // generation 0 is skipped so that no handle is ever 0
+    unsigned int generation = (atomic_load_explicit(&entry->generation, memory_order_relaxed) + 1) & HANDLE_GENERATION_MASK;
+    atomic_store_explicit(&entry->sp, NULL, memory_order_relaxed);
+    atomic_store_explicit(&entry->generation, generation == 0 ? 1 : generation, memory_order_release);
+    entry->next_free = 0;
+    if (table->free_tail != 0) {
+        handles_slot(table, table->free_tail - 1)->next_free = index + 1;
+    } else {
+        table->free_head = index + 1;
+    }
+    table->free_tail = index + 1;
+}
+
+// frees the object's handle, does nothing for an object that has none or already lost it
+static inline void handles_detach(handle_table_t* table, sp_t* sp) {
+    if (table == NULL || sp->handle == 0) {
+        return;
+    }
+    handles_free(table, sp->handle & HANDLE_INDEX_MASK);
+    sp->handle = 0;
+}
+
+// drops every handle at once without touching the objects, for backends that let go of all of them together
+static inline void handles_clear(handle_table_t* table) {
+    if (table == NULL) {
+        return;
+    }
+    for (unsigned int index = 0; index < table->used; index++) {
+        if (atomic_load_explicit(&handles_slot(table, index)->sp, memory_order_relaxed) != NULL) {
+            handles_free(table, index);
+        }
+    }
+}
+
+// the object behind a handle, NULL once it was freed; only the table is read, never the object itself
+static inline sp_t* handles_lookup(handle_table_t* table, alloc_handle_t handle) {
+    if (table == NULL || handle == 0) {
+        return NULL;
+    }
+    handle_entry_t* entry = handles_entry(table, handle & HANDLE_INDEX_MASK);
+    if (entry == NULL) {
+        return NULL;
+    }
+    unsigned int generation = handle >> HANDLE_INDEX_BITS;
+    if (atomic_load_explicit(&entry->generation, memory_order_acquire) != generation) {
+        return NULL;
+    }
+    sp_t* sp = atomic_load_explicit(&entry->sp, memory_order_acquire);
+    // an entry detached and handed out again in between has moved on to another generation
+    if (atomic_load_explicit(&entry->generation, memory_order_acquire) != generation) {
+        return NULL;
+    }
+    return sp;
+}
+
+#endif // HANDLES_H
@@ -0,0 +1,89 @@
+#ifndef PAGES_H
+#define PAGES_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+#include "api/alloc.h"
+
+#define HUGE_PAGE_SIZE ((size_t)2 * 1024 * 1024)
+
+#define ALLOC_HUGE_PAGE_MODES (ALLOC_HUGE_PAGES_RESERVED | ALLOC_HUGE_PAGES_TRANSPARENT)
+
+// arenas backed by huge pages are sized in whole huge pages
+static inline size_t pages_arena_size(size_t size, unsigned int flags) {
+    if (!(flags & ALLOC_HUGE_PAGES)) {
+        return size;
+    }
+    return (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+}
+
+// maps an arena of pages_arena_size bytes; with ALLOC_HUGE_PAGES set, *flags records the page mode that was
+// obtained, and once an arena falls back from reserved huge pages later arenas do not try them again
+static inline void* pages_map_arena(size_t size, unsigned int* flags) {
+    void* memory_block = NULL;
+#ifdef _WIN32
+    if ((*flags & ALLOC_HUGE_PAGES) && !(*flags & ALLOC_HUGE_PAGES_TRANSPARENT)) {
+        size_t large_page = GetLargePageMinimum();
+        if (large_page != 0 && size % large_page == 0) {
+            memory_block = VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE | MEM_LARGE_PAGES, PAGE_READWRITE);
+        }
+        if (memory_block != NULL) {
+            *flags |= ALLOC_HUGE_PAGES_RESERVED;
+            return memory_block;
+        }
+        // windows has no transparent huge pages, the arena gets regular pages
+        *flags &= ~(unsigned int)ALLOC_HUGE_PAGES_RESERVED;
+    }
+    memory_block = VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+#else
+    if (!(*flags & ALLOC_HUGE_PAGES)) {
+        memory_block = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        return memory_block == MAP_FAILED ? NULL : memory_block;
+    }
+#ifdef MAP_HUGETLB
+    if (!(*flags & ALLOC_HUGE_PAGES_TRANSPARENT)) {
+        memory_block = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (memory_block != MAP_FAILED) {
+            *flags |= ALLOC_HUGE_PAGES_RESERVED;
+            return memory_block;
+        }
+        *flags &= ~(unsigned int)ALLOC_HUGE_PAGES_RESERVED;
+    }
+#endif
+    // transparent huge pages only back 2MB aligned ranges, so the mapping is trimmed to that alignment
+    char* mapping = mmap(NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED) {
+        return NULL;
+    }
+    char* aligned = (char*)(((uintptr_t)mapping + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+    if (aligned > mapping) {
+        munmap(mapping, (size_t)(aligned - mapping));
+    }
+    munmap(aligned + size, HUGE_PAGE_SIZE - (size_t)(aligned - mapping));
+    memory_block = aligned;
+#ifdef MADV_HUGEPAGE
+    if (madvise(memory_block, size, MADV_HUGEPAGE) == 0) {
+        *flags |= ALLOC_HUGE_PAGES_TRANSPARENT;
+    }
+#endif
+#endif
+    return memory_block;
+}
+
+static inline void pages_unmap_arena(void* ptr, size_t size) {
+#ifdef _WIN32
+    (void)size;
+    VirtualFree(ptr, 0, MEM_RELEASE);
+#else
+    munmap(ptr, size);
+#endif
+}
+
+#endif // PAGES_H
@@ -1,6 +1,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <stdint.h>
 
 #define MEMORY_SIZE (4096 * 100) // 400KB initial memory block
 
@@ -12,85 +14,367 @@
 
 #include "../api/alloc.h"
 #include "../alloc.h"
+#include "../handles.h"
 
 static allocator_ptr_t _init(void);
+static allocator_ptr_t _init_with(unsigned int flags);
 static sp_ptr_t _alloc(const allocator_ptr_t* ptr, size_t size);
+static size_t _alloc_batch(const allocator_ptr_t* ptr, size_t size, size_t count, sp_ptr_t* out);
+static sp_ptr_t _alloc_aligned(const allocator_ptr_t* ptr, size_t size, size_t alignment);
 static void* _retain(const sp_ptr_t* sp);
+static void* _resize(const sp_ptr_t* sp, size_t size);
 static void _release(const sp_ptr_t* sp);
+static void _release_batch(sp_ptr_t* sps, size_t count);
+static alloc_handle_t _handle(const sp_ptr_t* sp);
+static sp_ptr_t _resolve(const allocator_ptr_t* ptr, alloc_handle_t handle);
+static void* _handle_retain(const allocator_ptr_t* ptr, alloc_handle_t handle);
+static void _handle_release(const allocator_ptr_t* ptr, alloc_handle_t handle);
 static void _gc(const allocator_ptr_t* ptr);
+static int _gc_step(const allocator_ptr_t* ptr, size_t max_blocks);
+static size_t _compact(const allocator_ptr_t* ptr, size_t budget);
+static alloc_mark_t _mark(const allocator_ptr_t* ptr);
+static void _rewind(const allocator_ptr_t* ptr, alloc_mark_t mark);
+static void _reset(const allocator_ptr_t* ptr);
+static void _adopt(const allocator_ptr_t* ptr);
+static void _flush(const allocator_ptr_t* ptr);
+static unsigned int _flags(const allocator_ptr_t* ptr);
+static void _stats(const allocator_ptr_t* ptr, alloc_stats_t* stats);
 static void _destroy(const allocator_ptr_t* ptr);
 
+#define PAGE_SIZE 4096
+#define SPAN_CACHE_PAGES 16 // spans up to 64KB are carved from reservations and cached by page count
+#define RESERVATION_SIZE (PAGE_SIZE * 256) // 1MB mapped at a time for cached spans
+#define SPAN_CACHE_LIMIT (4096 * 1024) // cached spans past 4MB give their pages back to the OS
+#define LARGE_ROW SPAN_CACHE_PAGES // stats rows are spans by page count, directly mapped spans share the last one
+
+// sits right before the memory _malloc returns, ptr is the start of the span
 typedef struct memory_block
 {
     void* ptr;
     int size;
 } memory_block_t;
- 
+
+// a free span, written over its own memory_block_t
+typedef struct span {
+    struct span* next;
+    int purged;
+} span_t;
+
+typedef struct reservation {
+    struct reservation* next;
+    size_t size;
+} reservation_t;
+
+typedef struct reference_allocator {
+    allocator_t base;
+    span_t* spans[SPAN_CACHE_PAGES + 1];
+    reservation_t* reservations;
+    char* reserve_ptr;
+    size_t reserve_left;
+    size_t cached_size;
+    class_counters_t counters[LARGE_ROW + 1];
+    size_t reserved_bytes;
+    size_t peak_reserved_bytes;
+    _Atomic(const void*) owner; // the thread that created the allocator, objects are freed on it alone
+    lock_t lock; // guards the handle table, which other threads' last releases detach from
+    // written by foreign threads only, kept off the cache lines the owner uses on every call
+    char remote_free_pad[CACHE_LINE_SIZE];
+    _Atomic(object_t*) remote_free;
+} reference_allocator_t;
+
 static alloc_t reference_counting_allocator = {
     .init = _init,
+    .init_with = _init_with,
     .alloc = _alloc,
+    .alloc_batch = _alloc_batch,
+    .alloc_aligned = _alloc_aligned,
     .retain = _retain,
+    .resize = _resize,
     .release = _release,
+    .release_batch = _release_batch,
+    .handle = _handle,
+    .resolve = _resolve,
+    .handle_retain = _handle_retain,
+    .handle_release = _handle_release,
     .gc = _gc,
+    .gc_step = _gc_step,
+    .compact = _compact,
+    .mark = _mark,
+    .rewind = _rewind,
+    .reset = _reset,
+    .adopt = _adopt,
+    .flush = _flush,
+    .flags = _flags,
+    .stats = _stats,
     .destroy = _destroy
 };
 
 alloc_ptr_t alloc = &reference_counting_allocator;
 
-static void* _malloc(size_t size) {
-    memory_block_t* memory_block_ptr;
+static void* _map_pages(size_t size) {
+    void* memory_block = NULL;
+#ifdef _WIN32
+    memory_block = VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+#else
+    memory_block = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory_block == MAP_FAILED) {
+        memory_block = NULL;
+    }
+#endif
+    return memory_block;
+}
+
+static void _unmap_pages(void* ptr, size_t size) {
+#ifdef _WIN32
+    (void)size;
+    VirtualFree(ptr, 0, MEM_RELEASE);
+#else
+    munmap(ptr, size);
+#endif
+}
+
+static void _reserve(reference_allocator_t* allocator, size_t size) {
+    allocator->reserved_bytes += size;
+    if (allocator->reserved_bytes > allocator->peak_reserved_bytes) {
+        allocator->peak_reserved_bytes = allocator->reserved_bytes;
+    }
+}
+
+static class_counters_t* _span_counters(reference_allocator_t* allocator, size_t pages) {
+    return &allocator->counters[pages <= SPAN_CACHE_PAGES ? pages - 1 : LARGE_ROW];
+}
+
+static void _purge_span(span_t* span, size_t size) {
+    // the first page keeps the span link
+    if (size > PAGE_SIZE) {
 #ifdef _WIN32
-    memory_block_ptr = VirtualAlloc(NULL, sizeof(memory_block_t) + size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+        VirtualAlloc((char*)span + PAGE_SIZE, size - PAGE_SIZE, MEM_RESET, PAGE_READWRITE);
 #else
-    memory_block_ptr = mmap(NULL, sizeof(memory_block_t) + size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        madvise((char*)span + PAGE_SIZE, size - PAGE_SIZE, MADV_DONTNEED);
 #endif
-    memory_block_ptr->size = sizeof(memory_block_t) + size;
-    memory_block_ptr->ptr = (void*)(memory_block_ptr + 1);
-    return memory_block_ptr->ptr;
+    }
+    span->purged = 1;
+}
+
+static void _cache_span(reference_allocator_t* allocator, void* memory, size_t pages) {
+    span_t* span = (span_t*)memory;
+    size_t size = pages * PAGE_SIZE;
+    span->purged = 0;
+    if (allocator->cached_size + size > SPAN_CACHE_LIMIT) {
+        _purge_span(span, size);
+    } else {
+        allocator->cached_size += size;
+    }
+    span->next = allocator->spans[pages];
+    allocator->spans[pages] = span;
+}
+
+static void* _take_span(reference_allocator_t* allocator, size_t pages) {
+    span_t* span = allocator->spans[pages];
+    if (span != NULL) {
+        allocator->spans[pages] = span->next;
+        if (!span->purged) {
+            allocator->cached_size -= pages * PAGE_SIZE;
+        }
+        return span;
+    }
+    size_t size = pages * PAGE_SIZE;
+    if (allocator->reserve_left < size) {
+        reservation_t* reservation = (reservation_t*)_map_pages(RESERVATION_SIZE);
+        if (reservation == NULL) {
+            return NULL;
+        }
+        _reserve(allocator, RESERVATION_SIZE);
+        // the unused tail of the old reservation is still worth keeping
+        if (allocator->reserve_left > 0) {
+            _cache_span(allocator, allocator->reserve_ptr, allocator->reserve_left / PAGE_SIZE);
+        }
+        reservation->next = allocator->reservations;
+        reservation->size = RESERVATION_SIZE;
+        allocator->reservations = reservation;
+        allocator->reserve_ptr = (char*)reservation + PAGE_SIZE;
+        allocator->reserve_left = RESERVATION_SIZE - PAGE_SIZE;
+    }
+    void* memory = allocator->reserve_ptr;
+    allocator->reserve_ptr += size;
+    allocator->reserve_left -= size;
+    return memory;
 }
 
-static void _free(void* ptr) {
+// returns memory whose address plus offset is a multiple of alignment, spans are page aligned so the
+// padding in front only depends on both; spans of up to SPAN_CACHE_PAGES pages come from the allocator's
+// cache, larger ones are mapped directly
+static void* _malloc(reference_allocator_t* allocator, size_t size, size_t alignment, size_t offset) {
+    size_t lead = ((sizeof(memory_block_t) + offset + alignment - 1) & ~(alignment - 1)) - offset;
+    if (size > SIZE_MAX - lead - PAGE_SIZE) return NULL;
+    size_t pages = (lead + size + PAGE_SIZE - 1) / PAGE_SIZE;
+    if ((pages * PAGE_SIZE) > INT_MAX) return NULL;
+    char* span = pages <= SPAN_CACHE_PAGES
+        ? (char*)_take_span(allocator, pages)
+        : (char*)_map_pages(pages * PAGE_SIZE);
+    if (span == NULL) {
+        return NULL;
+    }
+    if (pages > SPAN_CACHE_PAGES) {
+        _reserve(allocator, pages * PAGE_SIZE);
+    }
+    // every caller asks for an object, so everything past its header is payload
+    counters_alloc(_span_counters(allocator, pages), 1, size - OBJECT_HEADER_SIZE, pages * PAGE_SIZE);
+    memory_block_t* memory_block_ptr = (memory_block_t*)(span + lead) - 1;
+    memory_block_ptr->size = (int)(pages * PAGE_SIZE);
+    memory_block_ptr->ptr = span;
+    return span + lead;
+}
+
+static void _free(reference_allocator_t* allocator, void* ptr, size_t live_bytes) {
     memory_block_t* memory_block_ptr = ((memory_block_t*)ptr - 1);
-    #ifdef _WIN32
-        VirtualFree(memory_block_ptr, 0, MEM_RELEASE);
-    #else
-        munmap(memory_block_ptr, memory_block_ptr->size);
-    #endif
+    size_t pages = (size_t)memory_block_ptr->size / PAGE_SIZE;
+    counters_release(_span_counters(allocator, pages), 1, live_bytes, pages * PAGE_SIZE);
+    if (pages <= SPAN_CACHE_PAGES) {
+        _cache_span(allocator, memory_block_ptr->ptr, pages);
+    } else {
+        allocator->reserved_bytes -= (size_t)memory_block_ptr->size;
+        _unmap_pages(memory_block_ptr->ptr, (size_t)memory_block_ptr->size);
+    }
+}
+
+// the handle table changes under the lock, an allocator without one takes none
+static void _attach_handle(reference_allocator_t* allocator, sp_t* sp) {
+    if (allocator->base.handles == NULL) {
+        sp->handle = 0;
+        return;
+    }
+    lock_acquire(&allocator->lock);
+    handles_attach(allocator->base.handles, sp);
+    lock_release(&allocator->lock);
+}
+
+static void _detach_handle(reference_allocator_t* allocator, sp_t* sp) {
+    if (allocator->base.handles == NULL || sp->handle == 0) {
+        return;
+    }
+    lock_acquire(&allocator->lock);
+    handles_detach(allocator->base.handles, sp);
+    lock_release(&allocator->lock);
+}
+
+// a cached span keeps the object's header, which stops passing for an sp_t so that a copy of its pointer released
+// later is turned away by the self check
+static void _free_object(reference_allocator_t* allocator, object_t* object) {
+    _detach_handle(allocator, &object->sp);
+    object->sp.self = NULL;
+    object_t* storage = object_storage(object);
+    if (storage != NULL) {
+        _free(allocator, storage, storage->sp.size);
+    }
+    _free(allocator, object, storage != NULL ? 0 : object->sp.size);
+}
+
+static void _unmap_large(void* ptr) {
+    memory_block_t* memory_block_ptr = (memory_block_t*)ptr - 1;
+    if ((size_t)memory_block_ptr->size > SPAN_CACHE_PAGES * PAGE_SIZE) {
+        _unmap_pages(memory_block_ptr->ptr, (size_t)memory_block_ptr->size);
+    }
+}
+
+static void _unlink_block(allocator_t* allocator, mem_block_t* current) {
+    sweep_skip(allocator, current);
+    if (current->next != NULL) {
+        current->next->prev = current->prev;
+    }
+    if (current->prev != NULL) {
+        current->prev->next = current->next;
+    } else {
+        allocator->block_list = current->next;
+    }
+    allocator->total_blocks--;
+}
+
+static int _is_owner(reference_allocator_t* allocator) {
+    return atomic_load_explicit(&allocator->owner, memory_order_relaxed) == alloc_thread_id();
+}
+
+// frees the objects other threads dropped the last reference to, they are still in block_list; their handles went
+// when they were queued
+static void _drain_remote_free(reference_allocator_t* allocator) {
+    object_t* object = remote_free_take(&allocator->remote_free);
+    while (object != NULL) {
+        object_t* next = object->next;
+        _unlink_block(&allocator->base, &object->block);
+        _free_object(allocator, object);
+        object = next;
+    }
+}
+
+static void _drain_remote_free_if_owner(reference_allocator_t* allocator) {
+    if (atomic_load_explicit(&allocator->remote_free, memory_order_relaxed) != NULL && _is_owner(allocator)) {
+        _drain_remote_free(allocator);
+    }
 }
 
 allocator_ptr_t _init(void) {
-    allocator_t* allocator = _malloc(sizeof(allocator_t));
+    return _init_with(0);
+}
+
+allocator_ptr_t _init_with(unsigned int flags) {
+    reference_allocator_t* allocator = (reference_allocator_t*)_map_pages(sizeof(reference_allocator_t));
     if (!allocator) return NULL;
-    allocator->block_list = NULL;
-    allocator->total_blocks = 0;
-    return allocator;
+    memset(allocator->spans, 0, sizeof(allocator->spans));
+    allocator->reservations = NULL;
+    allocator->reserve_ptr = NULL;
+    allocator->reserve_left = 0;
+    allocator->cached_size = 0;
+    memset(allocator->counters, 0, sizeof(allocator->counters));
+    allocator->reserved_bytes = 0;
+    allocator->peak_reserved_bytes = 0;
+    atomic_init(&allocator->owner, alloc_thread_id());
+    lock_init(&allocator->lock);
+    atomic_init(&allocator->remote_free, NULL);
+    _reserve(allocator, (sizeof(reference_allocator_t) + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1));
+    allocator->base.block_list = NULL;
+    allocator->base.total_blocks = 0;
+    // objects are not carved from arenas here, so huge pages are never used
+    allocator->base.flags = flags & ~(unsigned int)(ALLOC_HUGE_PAGES_RESERVED | ALLOC_HUGE_PAGES_TRANSPARENT);
+    allocator->base.serial = 0;
+    allocator->base.sweep_cursor = NULL;
+    allocator->base.sweeping = 0;
+    rewinds_init(&allocator->base);
+    allocator->base.handles = NULL;
+    if (flags & ALLOC_HANDLE_TABLE) {
+        allocator->base.handles = handles_create();
+        if (allocator->base.handles == NULL) {
+            allocator->base.flags &= ~(unsigned int)ALLOC_HANDLE_TABLE;
+        }
+    }
+    return &allocator->base;
 }
 
 sp_ptr_t _alloc(const allocator_ptr_t* ptr, size_t size) {
-    if (!ptr || !(*ptr)) return NULL;
-    void* _ptr = _malloc(size);
-    if (!_ptr) {
-        return NULL;
-    }
-    mem_block_t* block = _malloc(sizeof(mem_block_t));
-    if (!block) {
-        _free(_ptr);
-        return NULL;
-    }
-    struct sp* smart_pointer = _malloc(sizeof(struct sp));
-    if (!smart_pointer) {
-        _free(_ptr);
-        _free(block);
+    return _alloc_aligned(ptr, size, OBJECT_ALIGNMENT);
+}
+
+sp_ptr_t _alloc_aligned(const allocator_ptr_t* ptr, size_t size, size_t alignment) {
+    alignment = object_alignment(alignment);
+    if (!ptr || !(*ptr) || alignment == 0) return NULL;
+    allocator_t* _allocator = (allocator_t*)(*ptr);
+    // the payload shares one span with its sp_t and mem_block_t
+    if (size > SIZE_MAX - OBJECT_HEADER_SIZE) return NULL;
+    _drain_remote_free_if_owner((reference_allocator_t*)_allocator);
+    object_t* object = _malloc((reference_allocator_t*)_allocator, OBJECT_HEADER_SIZE + size, alignment, OBJECT_HEADER_SIZE);
+    if (!object) {
         return NULL;
     }
-    allocator_t* _allocator = (allocator_t*)(*ptr);
+    struct sp* smart_pointer = &object->sp;
+    mem_block_t* block = &object->block;
     smart_pointer->self = (sp_ptr_t)smart_pointer;
-    smart_pointer->ref_count = 0;
+    atomic_init(&smart_pointer->ref_count, 1);
     smart_pointer->size = size;
-    smart_pointer->ptr = _ptr;
+    smart_pointer->ptr = OBJECT_PAYLOAD(object);
     smart_pointer->allocator = _allocator;
     smart_pointer->block = block;
     block->ptr = smart_pointer;
+    _attach_handle((reference_allocator_t*)_allocator, smart_pointer);
+    object->serial = _allocator->serial++;
     block->next = (*ptr)->block_list;
     block->prev = NULL;
     if ((*ptr)->block_list != NULL) {
@@ -101,59 +385,260 @@ sp_ptr_t _alloc(const allocator_ptr_t* ptr, size_t size) {
     return smart_pointer;
 }
 
+size_t _alloc_batch(const allocator_ptr_t* ptr, size_t size, size_t count, sp_ptr_t* out) {
+    if (!ptr || !(*ptr) || !out) return 0;
+    // every object is its own span, so a batch is no cheaper than single allocations here
+    for (size_t i = 0; i < count; i++) {
+        out[i] = _alloc(ptr, size);
+        if (!out[i]) {
+            return i;
+        }
+    }
+    return count;
+}
+
 void* _retain(const sp_ptr_t* sp) {
     if (!sp || !(*sp) || (*sp)->self != (sp_ptr_t)*sp) return NULL;
     sp_t* ptr = (sp_t*)*sp;
-    ptr->ref_count++;
+    sp_add_reference(ptr);
     return ptr->ptr;
 }
 
+void* _resize(const sp_ptr_t* sp, size_t size) {
+    if (!sp || !(*sp) || (*sp)->self != (sp_ptr_t)*sp) return NULL;
+    if (size > SIZE_MAX - OBJECT_HEADER_SIZE) return NULL;
+    object_t* object = (object_t*)*sp;
+    reference_allocator_t* allocator = (reference_allocator_t*)object->sp.allocator;
+    object_t* storage = object_storage(object);
+    // the span the payload is in right now grows up to its last page without moving
+    object_t* slot = storage != NULL ? storage : object;
+    memory_block_t* memory_block_ptr = (memory_block_t*)slot - 1;
+    size_t capacity = (size_t)((char*)memory_block_ptr->ptr + memory_block_ptr->size - (char*)slot->sp.ptr);
+    if (size <= capacity) {
+        counters_resize(_span_counters(allocator, (size_t)memory_block_ptr->size / PAGE_SIZE), slot->sp.size, size);
+        slot->sp.size = size;
+        object->sp.size = size;
+        return object->sp.ptr;
+    }
+    object_t* moved = _malloc(allocator, OBJECT_HEADER_SIZE + size, OBJECT_ALIGNMENT, OBJECT_HEADER_SIZE);
+    if (!moved) {
+        return NULL;
+    }
+    if (storage == NULL) {
+        counters_resize(_span_counters(allocator, (size_t)memory_block_ptr->size / PAGE_SIZE), object->sp.size, 0);
+    }
+    object_init_storage(moved, object, size);
+    memcpy(OBJECT_PAYLOAD(moved), object->sp.ptr, object->sp.size);
+    object->sp.ptr = OBJECT_PAYLOAD(moved);
+    object->sp.size = size;
+    if (storage != NULL) {
+        _free(allocator, storage, storage->sp.size);
+    }
+    return object->sp.ptr;
+}
+
 void _release(const sp_ptr_t* sp) {
     if (!sp || !(*sp) || (*sp)->self != (sp_ptr_t)*sp) return;
     sp_ptr_t* sp_ptr = (sp_ptr_t*)sp;
     sp_t* ptr = (sp_t*)(*sp);
-    ptr->ref_count--;
-    if (ptr->ref_count <= 0) {
+    if (sp_drop_reference(ptr)) {
         allocator_t* allocator = (allocator_t*)ptr->allocator;
+        // block_list and the span cache belong to the owner, so another thread's last release is queued for it;
+        // its handle goes right away, a queued object must not resolve while it waits for the owner
+        if (!_is_owner((reference_allocator_t*)allocator)) {
+            _detach_handle((reference_allocator_t*)allocator, ptr);
+            remote_free_push(&((reference_allocator_t*)allocator)->remote_free, (object_t*)ptr, (object_t*)ptr);
+            *sp_ptr = NULL;
+            return;
+        }
         mem_block_t* current = ptr->block;
         if (current && current->ptr == ptr) {
-            if (current->next != NULL) {
-                current->next->prev = current->prev;
-            }
-            if (current->prev != NULL) {
-                current->prev->next = current->next;
-            } else {
-                allocator->block_list = current->next;
-            }
-            _free(current);
-            allocator->total_blocks--;
+            _unlink_block(allocator, current);
         }
-        _free(ptr->ptr);
-        _free(ptr);
+        _free_object((reference_allocator_t*)allocator, (object_t*)ptr);
         *sp_ptr = NULL;
     }
 }
 
+void _release_batch(sp_ptr_t* sps, size_t count) {
+    if (!sps) return;
+    for (size_t i = 0; i < count; i++) {
+        _release(&sps[i]);
+    }
+}
+
+alloc_handle_t _handle(const sp_ptr_t* sp) {
+    if (!sp || !(*sp) || (*sp)->self != (sp_ptr_t)*sp) return 0;
+    return (*sp)->handle;
+}
+
+sp_ptr_t _resolve(const allocator_ptr_t* ptr, alloc_handle_t handle) {
+    if (!ptr || !(*ptr)) return NULL;
+    return handles_lookup((*ptr)->handles, handle);
+}
+
+void* _handle_retain(const allocator_ptr_t* ptr, alloc_handle_t handle) {
+    sp_ptr_t sp = _resolve(ptr, handle);
+    return _retain(&sp);
+}
+
+void _handle_release(const allocator_ptr_t* ptr, alloc_handle_t handle) {
+    sp_ptr_t sp = _resolve(ptr, handle);
+    _release(&sp);
+}
+
 void _gc(const allocator_ptr_t* ptr) {
     if (!ptr || !(*ptr) || (*ptr)->block_list == NULL || (*ptr)->total_blocks == 0) return;
+    if (!_is_owner((reference_allocator_t*)(*ptr))) return;
     allocator_t* allocator = (allocator_t*)(*ptr);
+    // queued remote frees are still in block_list and are freed below
+    atomic_store_explicit(&((reference_allocator_t*)allocator)->remote_free, NULL, memory_order_relaxed);
     mem_block_t* current = (mem_block_t*)allocator->block_list;
     while (current) {
         mem_block_t* next = (mem_block_t*)current->next;
-        struct sp* ptr = (struct sp*)current->ptr;
-        _free(ptr->ptr);
-        _free(ptr);
-        _free(current);
+        _free_object((reference_allocator_t*)allocator, (object_t*)current->ptr);
         allocator->total_blocks--;
         current = next;
     }
     allocator->block_list = NULL;
+    sweep_stop(allocator);
+}
+
+int _gc_step(const allocator_ptr_t* ptr, size_t max_blocks) {
+    if (!ptr || !(*ptr) || !_is_owner((reference_allocator_t*)(*ptr))) return 1;
+    allocator_t* allocator = (allocator_t*)(*ptr);
+    // queued remote frees are still in block_list, they are freed here so that the sweep does not free them again
+    _drain_remote_free((reference_allocator_t*)allocator);
+    mem_block_t* current = sweep_start(allocator);
+    for (size_t count = 0; current != NULL && (max_blocks == 0 || count < max_blocks); count++) {
+        _unlink_block(allocator, current);
+        _free_object((reference_allocator_t*)allocator, (object_t*)current->ptr);
+        current = allocator->sweep_cursor;
+    }
+    if (current != NULL) {
+        return 0;
+    }
+    sweep_stop(allocator);
+    return 1;
+}
+
+// every object has a span of its own, so nothing is moved; cached spans give their pages back to the OS
+size_t _compact(const allocator_ptr_t* ptr, size_t budget) {
+    (void)budget;
+    if (!ptr || !(*ptr)) return 0;
+    reference_allocator_t* allocator = (reference_allocator_t*)*ptr;
+    if (!_is_owner(allocator)) return 0;
+    _drain_remote_free(allocator);
+    for (size_t pages = 1; pages <= SPAN_CACHE_PAGES; pages++) {
+        for (span_t* span = allocator->spans[pages]; span != NULL; span = span->next) {
+            if (!span->purged) {
+                _purge_span(span, pages * PAGE_SIZE);
+                allocator->cached_size -= pages * PAGE_SIZE;
+            }
+        }
+    }
+    return 0;
+}
+
+alloc_mark_t _mark(const allocator_ptr_t* ptr) {
+    alloc_mark_t mark = { 0, NULL, 0, 0 };
+    if (!ptr || !(*ptr) || !_is_owner((reference_allocator_t*)(*ptr))) return mark;
+    mark.serial = (*ptr)->serial;
+    mark.epoch = (*ptr)->epoch;
+    return mark;
+}
+
+// every object has a span of its own, so rewinding is a bulk release of every live object allocated after the mark,
+// which form the head of block_list
+void _rewind(const allocator_ptr_t* ptr, alloc_mark_t mark) {
+    if (!ptr || !(*ptr) || !_is_owner((reference_allocator_t*)(*ptr))) return;
+    allocator_t* allocator = (allocator_t*)(*ptr);
+    if (mark_is_stale(allocator, mark)) return;
+    // objects on the remote free list reuse the serial field as a link, so they go first
+    _drain_remote_free((reference_allocator_t*)allocator);
+    mem_block_t* current = allocator->block_list;
+    while (current && ((object_t*)current->ptr)->serial >= mark.serial) {
+        mem_block_t* next = current->next;
+        sweep_skip(allocator, current);
+        _free_object((reference_allocator_t*)allocator, (object_t*)current->ptr);
+        allocator->total_blocks--;
+        current = next;
+    }
+    allocator->block_list = current;
+    if (current != NULL) {
+        current->prev = NULL;
+    }
+    mark_record_rewind(allocator, mark.serial);
+}
+
+// gc, which also makes the marks taken so far stale
+void _reset(const allocator_ptr_t* ptr) {
+    if (!ptr || !(*ptr) || !_is_owner((reference_allocator_t*)(*ptr))) return;
+    _gc(ptr);
+    mark_record_rewind((allocator_t*)(*ptr), 0);
+}
+
+void _adopt(const allocator_ptr_t* ptr) {
+    if (!ptr || !(*ptr)) return;
+    reference_allocator_t* allocator = (reference_allocator_t*)*ptr;
+    atomic_store_explicit(&allocator->owner, alloc_thread_id(), memory_order_relaxed);
+    _drain_remote_free(allocator);
+}
+
+// spans are cached per allocator, not per thread
+void _flush(const allocator_ptr_t* ptr) {
+    (void)ptr;
+}
+
+unsigned int _flags(const allocator_ptr_t* ptr) {
+    if (!ptr || !(*ptr)) return 0;
+    return (*ptr)->flags;
+}
+
+void _stats(const allocator_ptr_t* ptr, alloc_stats_t* stats) {
+    if (!stats) return;
+    memset(stats, 0, sizeof(alloc_stats_t));
+    if (!ptr || !(*ptr)) return;
+    reference_allocator_t* allocator = (reference_allocator_t*)*ptr;
+    stats->class_count = LARGE_ROW + 1;
+    for (size_t row = 0; row <= LARGE_ROW; row++) {
+        alloc_class_stats_t* class_stats = &stats->classes[row];
+        class_stats->block_size = row == LARGE_ROW ? 0 : (row + 1) * PAGE_SIZE;
+        counters_read(&allocator->counters[row], class_stats);
+        if (row != LARGE_ROW) {
+            for (span_t* span = allocator->spans[row + 1]; span != NULL; span = span->next) {
+                class_stats->free_blocks++;
+            }
+        }
+    }
+    stats->reserved_bytes = allocator->reserved_bytes;
+    stats->peak_reserved_bytes = allocator->peak_reserved_bytes;
+    stats_finish(stats);
 }
 
 void _destroy(const allocator_ptr_t* ptr) {
     if (!ptr || !(*ptr)) return;
     allocator_ptr_t* allocator_ptr = (allocator_ptr_t*)ptr;
-    allocator_t* allocator = (allocator_t*)*ptr;
+    reference_allocator_t* allocator = (reference_allocator_t*)*ptr;
     *allocator_ptr = NULL;
-    _free(allocator);
+    // cached and live spans live inside the reservations, only directly mapped spans are unmapped one by one
+    mem_block_t* current = allocator->base.block_list;
+    while (current) {
+        mem_block_t* next = current->next;
+        object_t* storage = object_storage((object_t*)current->ptr);
+        if (storage != NULL) {
+            _unmap_large(storage);
+        }
+        _unmap_large(current->ptr);
+        current = next;
+    }
+    reservation_t* reservation = allocator->reservations;
+    while (reservation) {
+        reservation_t* next = reservation->next;
+        _unmap_pages(reservation, reservation->size);
+        reservation = next;
+    }
+    handles_destroy(allocator->base.handles);
+    lock_destroy(&allocator->lock);
+    _unmap_pages(allocator, sizeof(reference_allocator_t));
 }
@@ -0,0 +1,56 @@
+#ifndef SYNC_H
+#define SYNC_H
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#define CACHE_LINE_SIZE 64
+
+#ifdef _WIN32
+#define THREAD_LOCAL __declspec(thread)
+typedef CRITICAL_SECTION lock_t;
+typedef CONDITION_VARIABLE cond_t;
+
+static inline void lock_init(lock_t* lock) { InitializeCriticalSection(lock); }
+static inline void lock_acquire(lock_t* lock) { EnterCriticalSection(lock); }
+static inline void lock_release(lock_t* lock) { LeaveCriticalSection(lock); }
+static inline void lock_destroy(lock_t* lock) { DeleteCriticalSection(lock); }
+
+static inline void cond_init(cond_t* cond) { InitializeConditionVariable(cond); }
+static inline void cond_wait(cond_t* cond, lock_t* lock) { SleepConditionVariableCS(cond, lock, INFINITE); }
+static inline void cond_signal(cond_t* cond) { WakeConditionVariable(cond); }
+static inline void cond_broadcast(cond_t* cond) { WakeAllConditionVariable(cond); }
+static inline void cond_destroy(cond_t* cond) { (void)cond; }
+
+static inline void cpu_relax(void) { YieldProcessor(); }
+#else
+#define THREAD_LOCAL _Thread_local
+typedef pthread_mutex_t lock_t;
+
+static inline void lock_init(lock_t* lock) { pthread_mutex_init(lock, NULL); }
+static inline void lock_acquire(lock_t* lock) { pthread_mutex_lock(lock); }
+static inline void lock_release(lock_t* lock) { pthread_mutex_unlock(lock); }
+static inline void lock_destroy(lock_t* lock) { pthread_mutex_destroy(lock); }
+
+typedef pthread_cond_t cond_t;
+
+static inline void cond_init(cond_t* cond) { pthread_cond_init(cond, NULL); }
+static inline void cond_wait(cond_t* cond, lock_t* lock) { pthread_cond_wait(cond, lock); }
+static inline void cond_signal(cond_t* cond) { pthread_cond_signal(cond); }
+static inline void cond_broadcast(cond_t* cond) { pthread_cond_broadcast(cond); }
+static inline void cond_destroy(cond_t* cond) { pthread_cond_destroy(cond); }
+
+// tells the core a spin-wait is going on, so a sibling hyperthread gets the pipeline
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+#endif
+
+#endif // SYNC_H
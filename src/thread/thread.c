@@ -1,4 +1,6 @@
 #include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
 
 #ifdef _WIN32
 #include <windows.h>
@@ -6,33 +8,205 @@
 #include <pthread.h>
 #endif
 
+#define DEQUE_SIZE 4096 // tasks a worker's deque holds, must be a power of two
+#define SPIN_COUNT 256 // rounds an idle worker looks for work before it parks
+#define CHUNKS_PER_THREAD 8 // chunks a parallel loop is cut into per thread when no grain is given
+
 #include "../api/alloc.h"
 #include "../api/thread.h"
+#include "../sync.h"
+
+#ifdef _WIN32
+#define WORKER_CALL WINAPI
+#else
+#define WORKER_CALL
+#endif
+
+struct thread_sp;
+
+// what start hands to each thread, the allocator is created on the thread so that the thread owns it
+typedef struct thread_context {
+    struct thread_sp* sp;
+    allocator_ptr_t allocator;
+} thread_context_t;
 
 typedef struct thread_sp {
     handle_ptr_t hThreads;
     int thread_num;
-    allocator_ptr_t allocator;
+    int started;
+    thread_context_t* contexts;
     thread_func_ptr_t func;
     void *param;
 } thread_sp_t;
 
+typedef struct task {
+    thread_task_ptr_t func;
+    void* param;
+    struct task* next;
+} task_t;
+
+struct thread_pool;
+
+// the owner pushes and pops at the bottom, thieves take from the top (Chase-Lev)
+typedef struct deque {
+    atomic_llong top;
+    char top_padding[CACHE_LINE_SIZE - sizeof(atomic_llong)];
+    atomic_llong bottom;
+    char bottom_padding[CACHE_LINE_SIZE - sizeof(atomic_llong)];
+    _Atomic(task_t*) tasks[DEQUE_SIZE];
+} deque_t;
+
+typedef struct worker {
+    deque_t deque;
+    _Atomic(task_t*) inbox; // tasks submitted from outside the pool, taken as a whole by the owner or a thief
+    task_t* overflow; // owner only, inbox tasks that did not fit in the deque
+    struct thread_pool* pool;
+    handle_t handle;
+    allocator_ptr_t allocator;
+    int index;
+} worker_t;
+
+typedef struct thread_pool {
+    worker_t** workers;
+    int thread_num;
+    atomic_uint next_worker; // round-robin over the inboxes for tasks submitted from outside
+    atomic_size_t queued; // tasks submitted and not picked up yet
+    atomic_size_t unfinished; // tasks submitted and not finished yet
+    atomic_int sleepers;
+    atomic_int stop;
+    lock_t lock;
+    cond_t wake; // parked workers
+    cond_t done; // pool_wait callers
+} thread_pool_t;
+
+// one parallel_for or parallel_reduce call, shared by the caller and the runner tasks until the last one lets go
+typedef struct parallel_job {
+    atomic_size_t next_chunk;
+    char next_chunk_padding[CACHE_LINE_SIZE - sizeof(atomic_size_t)];
+    atomic_size_t done_chunks;
+    char done_chunks_padding[CACHE_LINE_SIZE - sizeof(atomic_size_t)];
+    atomic_int refs;
+    atomic_int next_slot;
+    thread_pool_t* pool;
+    size_t begin;
+    size_t end;
+    size_t grain;
+    size_t chunks;
+    thread_range_ptr_t body;
+    thread_reduce_ptr_t reduce;
+    void* ctx;
+    size_t partial_size; // a cache line multiple, so threads never share one
+    char* partials; // one per runner, the caller's is the last
+    char* used; // whether a slot's partial took any chunk
+} parallel_job_t;
+
+typedef struct thread_future {
+    thread_pool_t* pool;
+    thread_future_func_t func;
+    void* param;
+    struct thread_future* antecedent; // the future a continuation waits for, released once it ran
+    struct thread_future* next; // in the antecedent's continuations
+    _Atomic(struct thread_future*) continuations; // FUTURE_DONE once the result is there
+    atomic_int done;
+    atomic_int waiters;
+    atomic_int refs;
+    size_t result_size;
+} thread_future_t;
+
+#define FUTURE_DONE ((thread_future_t*)1)
+#define FUTURE_HEADER_SIZE ((sizeof(thread_future_t) + 15) & ~(size_t)15)
+#define FUTURE_RESULT(future) ((void*)((char*)(future) + FUTURE_HEADER_SIZE))
+
+typedef struct queue_cell {
+    atomic_size_t sequence; // the position a producer may fill the cell at, plus one once it holds a handle
+    sp_ptr_t sp;
+} queue_cell_t;
+
+// a bounded MPMC ring (Vyukov), producers and consumers claim runs of cells by moving their position with one CAS
+typedef struct thread_queue {
+    atomic_size_t enqueue_position;
+    char enqueue_padding[CACHE_LINE_SIZE - sizeof(atomic_size_t)];
+    atomic_size_t dequeue_position;
+    char dequeue_padding[CACHE_LINE_SIZE - sizeof(atomic_size_t)];
+    size_t mask;
+    queue_cell_t* cells;
+} thread_queue_t;
+
+static THREAD_LOCAL worker_t* current_worker = NULL;
+static THREAD_LOCAL allocator_ptr_t current_allocator = NULL;
+
 static thread_sp_ptr_t _create(thread_func_ptr_t func, void* param, int thread_num);
 static void _start(const thread_sp_ptr_t* ptr);
 static void _join(const thread_sp_ptr_t* ptr);
 static void _destroy(const thread_sp_ptr_t* ptr);
+static thread_pool_ptr_t _pool_create(int thread_num);
+static int _pool_submit(const thread_pool_ptr_t* ptr, thread_task_ptr_t func, void* param);
+static void _pool_wait(const thread_pool_ptr_t* ptr);
+static void _pool_destroy(const thread_pool_ptr_t* ptr);
+static allocator_ptr_t _allocator(void);
+static int _parallel_for(const thread_pool_ptr_t* ptr, size_t begin, size_t end, size_t grain, thread_range_ptr_t body, void* ctx);
+static int _parallel_reduce(const thread_pool_ptr_t* ptr, size_t begin, size_t end, size_t grain, thread_reduce_ptr_t body,
+    thread_combine_ptr_t combine, void* result, size_t result_size, void* ctx);
+static thread_future_ptr_t _future_submit(const thread_pool_ptr_t* ptr, thread_future_func_t func, void* param, size_t result_size);
+static thread_future_ptr_t _future_then(const thread_future_ptr_t* ptr, thread_future_func_t func, void* param, size_t result_size);
+static int _future_try_get(const thread_future_ptr_t* ptr, void* result);
+static void _future_wait(const thread_future_ptr_t* ptr, void* result);
+static void _future_release(const thread_future_ptr_t* ptr);
+static thread_queue_ptr_t _queue_create(size_t capacity);
+static int _queue_push(const thread_queue_ptr_t* ptr, const sp_ptr_t* sp);
+static sp_ptr_t _queue_pop(const thread_queue_ptr_t* ptr);
+static size_t _queue_push_batch(const thread_queue_ptr_t* ptr, const sp_ptr_t* sps, size_t count);
+static size_t _queue_pop_batch(const thread_queue_ptr_t* ptr, sp_ptr_t* out, size_t count);
+static void _queue_destroy(const thread_queue_ptr_t* ptr);
 
 static thread_t reference_thread = {
     .create = _create,
     .start = _start,
     .join = _join,
-    .destroy = _destroy
+    .destroy = _destroy,
+    .pool_create = _pool_create,
+    .pool_submit = _pool_submit,
+    .pool_wait = _pool_wait,
+    .pool_destroy = _pool_destroy,
+    .allocator = _allocator,
+    .parallel_for = _parallel_for,
+    .parallel_reduce = _parallel_reduce,
+    .future_submit = _future_submit,
+    .future_then = _future_then,
+    .future_try_get = _future_try_get,
+    .future_wait = _future_wait,
+    .future_release = _future_release,
+    .queue_create = _queue_create,
+    .queue_push = _queue_push,
+    .queue_pop = _queue_pop,
+    .queue_push_batch = _queue_push_batch,
+    .queue_pop_batch = _queue_pop_batch,
+    .queue_destroy = _queue_destroy
 };
 
 thread_ptr_t thread = &reference_thread;
 
+// the thread that owned the allocator has been joined, so the joining thread takes it over
+static void _release_allocator(allocator_ptr_t* allocator) {
+    if (*allocator == NULL) {
+        return;
+    }
+    alloc->adopt(allocator);
+    alloc->gc(allocator);
+    alloc->destroy(allocator);
+    *allocator = NULL;
+}
+
+static thread_func_result WORKER_CALL _thread_main(void* param) {
+    thread_context_t* context = (thread_context_t*)param;
+    context->allocator = alloc->init();
+    current_allocator = context->allocator;
+    thread_func_result result = context->sp->func(context->sp->param);
+    current_allocator = NULL;
+    return result;
+}
+
 thread_sp_ptr_t _create(thread_func_ptr_t func, void* param, int thread_num) {
-    allocator_ptr_t _allocator = alloc->init();
     thread_sp_t* sp = (thread_sp_t*)malloc(sizeof(thread_sp_t));
     if (!sp) {
         return NULL;
@@ -42,27 +216,38 @@ thread_sp_ptr_t _create(thread_func_ptr_t func, void* param, int thread_num) {
         free(sp);
         return NULL;
     }
+    sp->contexts = (thread_context_t*)calloc((size_t)thread_num, sizeof(thread_context_t));
+    if (!sp->contexts) {
+        free(sp->hThreads);
+        free(sp);
+        return NULL;
+    }
+    for (int i = 0; i < thread_num; i++) {
+        sp->contexts[i].sp = sp;
+    }
     sp->thread_num = thread_num;
-    sp->allocator = _allocator;
+    sp->started = 0;
     sp->func = func;
     sp->param = param;
     return (thread_sp_ptr_t)sp;
 }
 
+// threads that fail to start leave the rest unstarted, join waits for the ones that did
 void _start(const thread_sp_ptr_t* ptr) {
     if (!ptr || !*ptr) return;
     thread_sp_t* sp = (thread_sp_t*)*ptr;
-    for (int i = 0; i < sp->thread_num; i++) {
+    for (int i = sp->started; i < sp->thread_num; i++) {
+        thread_context_t* context = &sp->contexts[i];
 #ifdef _WIN32
-        sp->hThreads[i] = CreateThread(NULL, 0, (thread_func_ptr_t)sp->func, sp->param, 0, NULL);
-        if (sp->hThreads[i] == NULL) {
-            _destroy(ptr);
-        }
+        sp->hThreads[i] = CreateThread(NULL, 0, _thread_main, context, 0, NULL);
+        int failed = sp->hThreads[i] == NULL;
 #else
-        if (pthread_create(&sp->hThreads[i], NULL, sp->func, sp->param)) {
-            _destroy(ptr);
-        }
+        int failed = pthread_create(&sp->hThreads[i], NULL, _thread_main, context) != 0;
 #endif
+        if (failed) {
+            break;
+        }
+        sp->started = i + 1;
     }
 }
 
@@ -70,27 +255,695 @@ void _join(const thread_sp_ptr_t* ptr) {
     if (!ptr || !*ptr) return;
     thread_sp_t* sp = (thread_sp_t*)*ptr;
 #ifdef _WIN32
-    WaitForMultipleObjects(sp->thread_num, sp->hThreads, TRUE, INFINITE);
-    for (int i = 0; i < sp->thread_num; i++) {
+    WaitForMultipleObjects(sp->started, sp->hThreads, TRUE, INFINITE);
+    for (int i = 0; i < sp->started; i++) {
         CloseHandle(sp->hThreads[i]);
     }
 #else
-    for (int i = 0; i < sp->thread_num; i++) {
+    for (int i = 0; i < sp->started; i++) {
         pthread_join(sp->hThreads[i], NULL);
     }
 #endif
+    for (int i = 0; i < sp->started; i++) {
+        _release_allocator(&sp->contexts[i].allocator);
+    }
+    sp->started = 0;
 }
 
 void _destroy(const thread_sp_ptr_t* ptr) {
     if (!ptr || !*ptr) return;
     thread_sp_t* sp = (thread_sp_t*)*ptr;
     thread_sp_ptr_t* _ptr = (thread_sp_ptr_t*)ptr;
-    allocator_ptr_t _allocator = sp->allocator;
-    alloc->gc(&_allocator);
-    alloc->destroy(&_allocator);
-    sp->allocator = NULL;
     sp->func = NULL;
+    free(sp->contexts);
     free(sp->hThreads);
     free(sp);
     *_ptr = NULL;
 }
+
+static int _deque_push(deque_t* deque, task_t* task) {
+    long long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    long long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    if (bottom - top >= DEQUE_SIZE) {
+        return 0;
+    }
+    atomic_store_explicit(&deque->tasks[bottom & (DEQUE_SIZE - 1)], task, memory_order_relaxed);
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_release);
+    return 1;
+}
+
+static task_t* _deque_pop(deque_t* deque) {
+    long long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long long top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+    if (top > bottom) {
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        return NULL;
+    }
+    task_t* task = atomic_load_explicit(&deque->tasks[bottom & (DEQUE_SIZE - 1)], memory_order_relaxed);
+    if (top == bottom) {
+        // the last task, a thief may be after it as well
+        if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1, memory_order_seq_cst, memory_order_relaxed)) {
+            task = NULL;
+        }
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    }
+    return task;
+}
+
+static task_t* _deque_steal(deque_t* deque) {
+    long long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long long bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    if (top >= bottom) {
+        return NULL;
+    }
+    task_t* task = atomic_load_explicit(&deque->tasks[top & (DEQUE_SIZE - 1)], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1, memory_order_seq_cst, memory_order_relaxed)) {
+        return NULL;
+    }
+    return task;
+}
+
+static void _inbox_push(worker_t* worker, task_t* task) {
+    task_t* head = atomic_load_explicit(&worker->inbox, memory_order_relaxed);
+    do {
+        task->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&worker->inbox, &head, task, memory_order_release, memory_order_relaxed));
+}
+
+// the inbox is a stack, reversed here so tasks start in the order they were submitted
+static task_t* _inbox_take(worker_t* worker) {
+    if (atomic_load_explicit(&worker->inbox, memory_order_relaxed) == NULL) {
+        return NULL;
+    }
+    task_t* task = atomic_exchange_explicit(&worker->inbox, NULL, memory_order_acquire);
+    task_t* reversed = NULL;
+    while (task != NULL) {
+        task_t* next = task->next;
+        task->next = reversed;
+        reversed = task;
+        task = next;
+    }
+    return reversed;
+}
+
+// the first of the tasks is returned, the rest goes into the deque where thieves can get at it
+static task_t* _keep_tasks(worker_t* worker, task_t* tasks) {
+    task_t* first = tasks;
+    tasks = tasks->next;
+    // a pushed task can be stolen and freed right away, so its link is read first
+    while (tasks != NULL) {
+        task_t* next = tasks->next;
+        if (!_deque_push(&worker->deque, tasks)) {
+            break;
+        }
+        tasks = next;
+    }
+    if (tasks != NULL) {
+        task_t* last = tasks;
+        while (last->next != NULL) {
+            last = last->next;
+        }
+        last->next = worker->overflow;
+        worker->overflow = tasks;
+    }
+    return first;
+}
+
+static task_t* _find_task(worker_t* worker) {
+    task_t* task = _deque_pop(&worker->deque);
+    if (task != NULL) {
+        return task;
+    }
+    if (worker->overflow != NULL) {
+        task_t* tasks = worker->overflow;
+        worker->overflow = NULL;
+        return _keep_tasks(worker, tasks);
+    }
+    task_t* tasks = _inbox_take(worker);
+    if (tasks != NULL) {
+        return _keep_tasks(worker, tasks);
+    }
+    thread_pool_t* pool = worker->pool;
+    for (int i = 1; i < pool->thread_num; i++) {
+        worker_t* victim = pool->workers[(worker->index + i) % pool->thread_num];
+        task = _deque_steal(&victim->deque);
+        if (task != NULL) {
+            return task;
+        }
+        // an inbox waiting behind a busy worker is taken over as a whole
+        tasks = _inbox_take(victim);
+        if (tasks != NULL) {
+            return _keep_tasks(worker, tasks);
+        }
+    }
+    return NULL;
+}
+
+static void _run_task(thread_pool_t* pool, task_t* task) {
+    atomic_fetch_sub_explicit(&pool->queued, 1, memory_order_relaxed);
+    task->func(task->param);
+    free(task);
+    if (atomic_fetch_sub_explicit(&pool->unfinished, 1, memory_order_acq_rel) == 1) {
+        lock_acquire(&pool->lock);
+        cond_broadcast(&pool->done);
+        lock_release(&pool->lock);
+    }
+}
+
+// sleepers and queued are both seq_cst, so either the worker sees the task or the submitter sees the sleeper
+static void _park(thread_pool_t* pool) {
+    lock_acquire(&pool->lock);
+    atomic_fetch_add(&pool->sleepers, 1);
+    if (atomic_load(&pool->queued) == 0 && !atomic_load(&pool->stop)) {
+        cond_wait(&pool->wake, &pool->lock);
+    }
+    atomic_fetch_sub(&pool->sleepers, 1);
+    lock_release(&pool->lock);
+}
+
+static thread_func_result WORKER_CALL _worker_main(void* param) {
+    worker_t* worker = (worker_t*)param;
+    thread_pool_t* pool = worker->pool;
+    current_worker = worker;
+    worker->allocator = alloc->init();
+    current_allocator = worker->allocator;
+    for (;;) {
+        task_t* task = NULL;
+        for (int spin = 0; spin < SPIN_COUNT && task == NULL; spin++) {
+            task = _find_task(worker);
+            if (task == NULL) {
+                cpu_relax();
+            }
+        }
+        if (task != NULL) {
+            _run_task(pool, task);
+            continue;
+        }
+        // the pool stops once everything queued before pool_destroy has run
+        if (atomic_load(&pool->stop) && atomic_load(&pool->queued) == 0) {
+            break;
+        }
+        _park(pool);
+    }
+    current_worker = NULL;
+    current_allocator = NULL;
+    return (thread_func_result)0;
+}
+
+// the workers have been joined, so their allocators are no longer in use
+static void _pool_free(thread_pool_t* pool) {
+    for (int i = 0; i < pool->thread_num; i++) {
+        if (pool->workers[i] != NULL) {
+            _release_allocator(&pool->workers[i]->allocator);
+        }
+        free(pool->workers[i]);
+    }
+    free(pool->workers);
+    cond_destroy(&pool->done);
+    cond_destroy(&pool->wake);
+    lock_destroy(&pool->lock);
+    free(pool);
+}
+
+static void _pool_join(thread_pool_t* pool, int started) {
+    lock_acquire(&pool->lock);
+    atomic_store(&pool->stop, 1);
+    cond_broadcast(&pool->wake);
+    lock_release(&pool->lock);
+    for (int i = 0; i < started; i++) {
+#ifdef _WIN32
+        WaitForSingleObject(pool->workers[i]->handle, INFINITE);
+        CloseHandle(pool->workers[i]->handle);
+#else
+        pthread_join(pool->workers[i]->handle, NULL);
+#endif
+    }
+}
+
+thread_pool_ptr_t _pool_create(int thread_num) {
+    if (thread_num <= 0) return NULL;
+    thread_pool_t* pool = (thread_pool_t*)calloc(1, sizeof(thread_pool_t));
+    if (!pool) {
+        return NULL;
+    }
+    pool->workers = (worker_t**)calloc((size_t)thread_num, sizeof(worker_t*));
+    if (!pool->workers) {
+        free(pool);
+        return NULL;
+    }
+    pool->thread_num = thread_num;
+    lock_init(&pool->lock);
+    cond_init(&pool->wake);
+    cond_init(&pool->done);
+    // workers are allocated one by one, so every deque starts on its own cache lines
+    for (int i = 0; i < thread_num; i++) {
+        pool->workers[i] = (worker_t*)calloc(1, sizeof(worker_t));
+        if (!pool->workers[i]) {
+            _pool_free(pool);
+            return NULL;
+        }
+        pool->workers[i]->pool = pool;
+        pool->workers[i]->index = i;
+    }
+    for (int i = 0; i < thread_num; i++) {
+        worker_t* worker = pool->workers[i];
+#ifdef _WIN32
+        worker->handle = CreateThread(NULL, 0, _worker_main, worker, 0, NULL);
+        int failed = worker->handle == NULL;
+#else
+        int failed = pthread_create(&worker->handle, NULL, _worker_main, worker) != 0;
+#endif
+        if (failed) {
+            _pool_join(pool, i);
+            _pool_free(pool);
+            return NULL;
+        }
+    }
+    return (thread_pool_ptr_t)pool;
+}
+
+int _pool_submit(const thread_pool_ptr_t* ptr, thread_task_ptr_t func, void* param) {
+    if (!ptr || !*ptr || !func) return 0;
+    thread_pool_t* pool = (thread_pool_t*)*ptr;
+    task_t* task = (task_t*)malloc(sizeof(task_t));
+    if (!task) {
+        return 0;
+    }
+    task->func = func;
+    task->param = param;
+    task->next = NULL;
+    atomic_fetch_add_explicit(&pool->unfinished, 1, memory_order_relaxed);
+    atomic_fetch_add(&pool->queued, 1);
+    // a task submitted by a worker of the pool stays with it until someone steals it
+    worker_t* worker = current_worker;
+    if (worker == NULL || worker->pool != pool || !_deque_push(&worker->deque, task)) {
+        unsigned int next = atomic_fetch_add_explicit(&pool->next_worker, 1, memory_order_relaxed);
+        _inbox_push(pool->workers[next % (unsigned int)pool->thread_num], task);
+    }
+    if (atomic_load(&pool->sleepers) > 0) {
+        lock_acquire(&pool->lock);
+        cond_signal(&pool->wake);
+        lock_release(&pool->lock);
+    }
+    return 1;
+}
+
+void _pool_wait(const thread_pool_ptr_t* ptr) {
+    if (!ptr || !*ptr) return;
+    thread_pool_t* pool = (thread_pool_t*)*ptr;
+    lock_acquire(&pool->lock);
+    while (atomic_load_explicit(&pool->unfinished, memory_order_acquire) > 0) {
+        cond_wait(&pool->done, &pool->lock);
+    }
+    lock_release(&pool->lock);
+}
+
+void _pool_destroy(const thread_pool_ptr_t* ptr) {
+    if (!ptr || !*ptr) return;
+    thread_pool_t* pool = (thread_pool_t*)*ptr;
+    thread_pool_ptr_t* _ptr = (thread_pool_ptr_t*)ptr;
+    _pool_join(pool, pool->thread_num);
+    _pool_free(pool);
+    *_ptr = NULL;
+}
+
+allocator_ptr_t _allocator(void) {
+    return current_allocator;
+}
+
+static void _job_release(parallel_job_t* job) {
+    if (atomic_fetch_sub_explicit(&job->refs, 1, memory_order_acq_rel) == 1) {
+        free(job);
+    }
+}
+
+// claims chunks until none are left, the one finishing the last chunk wakes the caller
+static void _job_run(parallel_job_t* job, int slot) {
+    void* partial = job->partials + (size_t)slot * job->partial_size;
+    for (;;) {
+        size_t chunk = atomic_fetch_add_explicit(&job->next_chunk, 1, memory_order_relaxed);
+        if (chunk >= job->chunks) {
+            break;
+        }
+        size_t begin = job->begin + chunk * job->grain;
+        size_t end = job->end - begin > job->grain ? begin + job->grain : job->end;
+        if (job->reduce != NULL) {
+            job->used[slot] = 1;
+            job->reduce(begin, end, job->ctx, partial);
+        } else {
+            job->body(begin, end, job->ctx);
+        }
+        if (atomic_fetch_add_explicit(&job->done_chunks, 1, memory_order_acq_rel) == job->chunks - 1) {
+            lock_acquire(&job->pool->lock);
+            cond_broadcast(&job->pool->done);
+            lock_release(&job->pool->lock);
+        }
+    }
+}
+
+static void _job_runner(void* param) {
+    parallel_job_t* job = (parallel_job_t*)param;
+    _job_run(job, atomic_fetch_add_explicit(&job->next_slot, 1, memory_order_relaxed));
+    _job_release(job);
+}
+
+// a worker of the pool keeps running tasks while it waits, the runners may well be queued behind it
+static void _job_wait(parallel_job_t* job) {
+    thread_pool_t* pool = job->pool;
+    worker_t* worker = current_worker != NULL && current_worker->pool == pool ? current_worker : NULL;
+    for (int spin = 0; atomic_load_explicit(&job->done_chunks, memory_order_acquire) < job->chunks; spin++) {
+        task_t* task = worker != NULL ? _find_task(worker) : NULL;
+        if (task != NULL) {
+            _run_task(pool, task);
+        } else if (worker != NULL || spin < SPIN_COUNT) {
+            cpu_relax();
+        } else {
+            lock_acquire(&pool->lock);
+            while (atomic_load_explicit(&job->done_chunks, memory_order_acquire) < job->chunks) {
+                cond_wait(&pool->done, &pool->lock);
+            }
+            lock_release(&pool->lock);
+        }
+    }
+}
+
+static int _parallel_run(const thread_pool_ptr_t* ptr, size_t begin, size_t end, size_t grain, thread_range_ptr_t body,
+    thread_reduce_ptr_t reduce, thread_combine_ptr_t combine, void* result, size_t result_size, void* ctx) {
+    if (!ptr || !*ptr || begin >= end) return 0;
+    thread_pool_t* pool = (thread_pool_t*)*ptr;
+    size_t count = end - begin;
+    if (grain == 0) {
+        grain = count / ((size_t)(pool->thread_num + 1) * CHUNKS_PER_THREAD);
+        grain = grain == 0 ? 1 : grain;
+    }
+    size_t chunks = count / grain + (count % grain != 0);
+    // the caller takes part, so one chunk less than there are runners is enough for all of them to get one
+    int runners = chunks - 1 < (size_t)pool->thread_num ? (int)(chunks - 1) : pool->thread_num;
+    size_t slots = (size_t)runners + 1;
+    size_t partial_size = (result_size + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1);
+    size_t header_size = (sizeof(parallel_job_t) + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1);
+    parallel_job_t* job = (parallel_job_t*)malloc(header_size + slots * partial_size + slots);
+    if (!job) {
+        return 0;
+    }
+    atomic_init(&job->next_chunk, 0);
+    atomic_init(&job->done_chunks, 0);
+    atomic_init(&job->refs, 1);
+    atomic_init(&job->next_slot, 0);
+    job->pool = pool;
+    job->begin = begin;
+    job->end = end;
+    job->grain = grain;
+    job->chunks = chunks;
+    job->body = body;
+    job->reduce = reduce;
+    job->ctx = ctx;
+    job->partial_size = partial_size;
+    job->partials = (char*)job + header_size;
+    job->used = job->partials + slots * partial_size;
+    memset(job->used, 0, slots);
+    for (size_t slot = 0; slot < slots && reduce != NULL; slot++) {
+        memcpy(job->partials + slot * partial_size, result, result_size);
+    }
+    for (int i = 0; i < runners; i++) {
+        atomic_fetch_add_explicit(&job->refs, 1, memory_order_relaxed);
+        // a runner that cannot be queued leaves its chunks to the others
+        if (!_pool_submit(ptr, _job_runner, job)) {
+            atomic_fetch_sub_explicit(&job->refs, 1, memory_order_relaxed);
+            atomic_fetch_add_explicit(&job->next_slot, 1, memory_order_relaxed);
+        }
+    }
+    _job_run(job, runners);
+    _job_wait(job);
+    // partials are combined in slot order, which slot ran which chunks is up to the scheduling
+    for (size_t slot = 0; slot < slots && reduce != NULL; slot++) {
+        if (job->used[slot]) {
+            combine(result, job->partials + slot * partial_size, ctx);
+        }
+    }
+    _job_release(job);
+    return 1;
+}
+
+int _parallel_for(const thread_pool_ptr_t* ptr, size_t begin, size_t end, size_t grain, thread_range_ptr_t body, void* ctx) {
+    if (!body) return 0;
+    return _parallel_run(ptr, begin, end, grain, body, NULL, NULL, NULL, 0, ctx);
+}
+
+int _parallel_reduce(const thread_pool_ptr_t* ptr, size_t begin, size_t end, size_t grain, thread_reduce_ptr_t body,
+    thread_combine_ptr_t combine, void* result, size_t result_size, void* ctx) {
+    if (!body || !combine || !result || result_size == 0) return 0;
+    return _parallel_run(ptr, begin, end, grain, NULL, body, combine, result, result_size, ctx);
+}
+
+static void _future_drop(thread_future_t* future) {
+    if (atomic_fetch_sub_explicit(&future->refs, 1, memory_order_acq_rel) == 1) {
+        free(future);
+    }
+}
+
+static thread_future_t* _future_new(thread_pool_t* pool, thread_future_func_t func, void* param, size_t result_size) {
+    thread_future_t* future = (thread_future_t*)malloc(FUTURE_HEADER_SIZE + result_size);
+    if (!future) {
+        return NULL;
+    }
+    future->pool = pool;
+    future->func = func;
+    future->param = param;
+    future->antecedent = NULL;
+    future->next = NULL;
+    atomic_init(&future->continuations, NULL);
+    atomic_init(&future->done, 0);
+    atomic_init(&future->waiters, 0);
+    // one for the caller, one for the task
+    atomic_init(&future->refs, 2);
+    future->result_size = result_size;
+    memset(FUTURE_RESULT(future), 0, result_size);
+    return future;
+}
+
+static void _future_run(void* param);
+
+// a continuation that cannot be queued runs right away on the calling thread
+static void _future_schedule(thread_future_t* future) {
+    thread_pool_ptr_t pool = (thread_pool_ptr_t)future->pool;
+    if (!_pool_submit(&pool, _future_run, future)) {
+        _future_run(future);
+    }
+}
+
+static void _future_run(void* param) {
+    thread_future_t* future = (thread_future_t*)param;
+    thread_future_t* antecedent = future->antecedent;
+    future->func(antecedent != NULL ? FUTURE_RESULT(antecedent) : NULL, future->param, FUTURE_RESULT(future));
+    if (antecedent != NULL) {
+        future->antecedent = NULL;
+        _future_drop(antecedent);
+    }
+    // done and waiters are both seq_cst, so either the waiter sees the result or this sees the waiter
+    atomic_store(&future->done, 1);
+    thread_future_t* continuation = atomic_exchange_explicit(&future->continuations, FUTURE_DONE, memory_order_acq_rel);
+    while (continuation != NULL) {
+        thread_future_t* next = continuation->next;
+        _future_schedule(continuation);
+        continuation = next;
+    }
+    if (atomic_load(&future->waiters) > 0) {
+        lock_acquire(&future->pool->lock);
+        cond_broadcast(&future->pool->done);
+        lock_release(&future->pool->lock);
+    }
+    _future_drop(future);
+}
+
+thread_future_ptr_t _future_submit(const thread_pool_ptr_t* ptr, thread_future_func_t func, void* param, size_t result_size) {
+    if (!ptr || !*ptr || !func) return NULL;
+    thread_future_t* future = _future_new((thread_pool_t*)*ptr, func, param, result_size);
+    if (!future) {
+        return NULL;
+    }
+    if (!_pool_submit(ptr, _future_run, future)) {
+        free(future);
+        return NULL;
+    }
+    return (thread_future_ptr_t)future;
+}
+
+thread_future_ptr_t _future_then(const thread_future_ptr_t* ptr, thread_future_func_t func, void* param, size_t result_size) {
+    if (!ptr || !*ptr || !func) return NULL;
+    thread_future_t* antecedent = (thread_future_t*)*ptr;
+    thread_future_t* future = _future_new(antecedent->pool, func, param, result_size);
+    if (!future) {
+        return NULL;
+    }
+    atomic_fetch_add_explicit(&antecedent->refs, 1, memory_order_relaxed);
+    future->antecedent = antecedent;
+    thread_future_t* head = atomic_load_explicit(&antecedent->continuations, memory_order_acquire);
+    while (head != FUTURE_DONE) {
+        future->next = head;
+        if (atomic_compare_exchange_weak_explicit(&antecedent->continuations, &head, future, memory_order_release, memory_order_acquire)) {
+            return (thread_future_ptr_t)future;
+        }
+    }
+    // the antecedent finished already
+    _future_schedule(future);
+    return (thread_future_ptr_t)future;
+}
+
+int _future_try_get(const thread_future_ptr_t* ptr, void* result) {
+    if (!ptr || !*ptr) return 0;
+    thread_future_t* future = (thread_future_t*)*ptr;
+    if (!atomic_load_explicit(&future->done, memory_order_acquire)) {
+        return 0;
+    }
+    if (result != NULL) {
+        memcpy(result, FUTURE_RESULT(future), future->result_size);
+    }
+    return 1;
+}
+
+// a worker of the pool keeps running tasks while it waits, the future's task may be queued behind it
+void _future_wait(const thread_future_ptr_t* ptr, void* result) {
+    if (!ptr || !*ptr) return;
+    thread_future_t* future = (thread_future_t*)*ptr;
+    thread_pool_t* pool = future->pool;
+    worker_t* worker = current_worker != NULL && current_worker->pool == pool ? current_worker : NULL;
+    for (int spin = 0; !atomic_load_explicit(&future->done, memory_order_acquire); spin++) {
+        task_t* task = worker != NULL ? _find_task(worker) : NULL;
+        if (task != NULL) {
+            _run_task(pool, task);
+        } else if (worker != NULL || spin < SPIN_COUNT) {
+            cpu_relax();
+        } else {
+            atomic_fetch_add(&future->waiters, 1);
+            lock_acquire(&pool->lock);
+            while (!atomic_load(&future->done)) {
+                cond_wait(&pool->done, &pool->lock);
+            }
+            lock_release(&pool->lock);
+            atomic_fetch_sub(&future->waiters, 1);
+        }
+    }
+    _future_try_get(ptr, result);
+}
+
+void _future_release(const thread_future_ptr_t* ptr) {
+    if (!ptr || !*ptr) return;
+    thread_future_ptr_t* _ptr = (thread_future_ptr_t*)ptr;
+    _future_drop((thread_future_t*)*ptr);
+    *_ptr = NULL;
+}
+
+thread_queue_ptr_t _queue_create(size_t capacity) {
+    if (capacity == 0 || capacity > ((size_t)1 << (sizeof(size_t) * 8 - 2))) return NULL;
+    size_t size = 1;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    thread_queue_t* queue = (thread_queue_t*)malloc(sizeof(thread_queue_t));
+    if (!queue) {
+        return NULL;
+    }
+    queue->cells = (queue_cell_t*)malloc(sizeof(queue_cell_t) * size);
+    if (!queue->cells) {
+        free(queue);
+        return NULL;
+    }
+    for (size_t i = 0; i < size; i++) {
+        atomic_init(&queue->cells[i].sequence, i);
+        queue->cells[i].sp = NULL;
+    }
+    queue->mask = size - 1;
+    atomic_init(&queue->enqueue_position, 0);
+    atomic_init(&queue->dequeue_position, 0);
+    return (thread_queue_ptr_t)queue;
+}
+
+// claims up to count cells in a row whose sequence is their position plus offset: 0 finds free cells, 1 full ones;
+// cells only ever turn the way the caller waits for, so the run counted before the CAS is still there after it
+static size_t _queue_claim(thread_queue_t* queue, atomic_size_t* position, size_t offset, size_t count, size_t* first) {
+    size_t start = atomic_load_explicit(position, memory_order_relaxed);
+    for (;;) {
+        size_t claimed = 0;
+        while (claimed < count) {
+            queue_cell_t* cell = &queue->cells[(start + claimed) & queue->mask];
+            if (atomic_load_explicit(&cell->sequence, memory_order_acquire) != start + claimed + offset) {
+                break;
+            }
+            claimed++;
+        }
+        if (claimed == 0) {
+            // either the queue is full or empty, or another thread moved the position past what was read
+            size_t current = atomic_load_explicit(position, memory_order_relaxed);
+            if (current == start) {
+                return 0;
+            }
+            start = current;
+            continue;
+        }
+        if (atomic_compare_exchange_weak_explicit(position, &start, start + claimed, memory_order_relaxed, memory_order_relaxed)) {
+            *first = start;
+            return claimed;
+        }
+    }
+}
+
+size_t _queue_push_batch(const thread_queue_ptr_t* ptr, const sp_ptr_t* sps, size_t count) {
+    if (!ptr || !*ptr || !sps || count == 0) return 0;
+    thread_queue_t* queue = (thread_queue_t*)*ptr;
+    // a NULL handle ends the batch before anything is claimed
+    size_t valid = 0;
+    while (valid < count && sps[valid] != NULL) {
+        valid++;
+    }
+    size_t first = 0;
+    size_t claimed = valid == 0 ? 0 : _queue_claim(queue, &queue->enqueue_position, 0, valid, &first);
+    for (size_t i = 0; i < claimed; i++) {
+        queue_cell_t* cell = &queue->cells[(first + i) & queue->mask];
+        alloc->retain(&sps[i]);
+        cell->sp = sps[i];
+        atomic_store_explicit(&cell->sequence, first + i + 1, memory_order_release);
+    }
+    return claimed;
+}
+
+size_t _queue_pop_batch(const thread_queue_ptr_t* ptr, sp_ptr_t* out, size_t count) {
+    if (!ptr || !*ptr || !out || count == 0) return 0;
+    thread_queue_t* queue = (thread_queue_t*)*ptr;
+    size_t first = 0;
+    size_t claimed = _queue_claim(queue, &queue->dequeue_position, 1, count, &first);
+    for (size_t i = 0; i < claimed; i++) {
+        queue_cell_t* cell = &queue->cells[(first + i) & queue->mask];
+        out[i] = cell->sp;
+        cell->sp = NULL;
+        atomic_store_explicit(&cell->sequence, first + i + queue->mask + 1, memory_order_release);
+    }
+    return claimed;
+}
+
+int _queue_push(const thread_queue_ptr_t* ptr, const sp_ptr_t* sp) {
+    if (!sp) return 0;
+    return _queue_push_batch(ptr, sp, 1) == 1;
+}
+
+sp_ptr_t _queue_pop(const thread_queue_ptr_t* ptr) {
+    sp_ptr_t sp = NULL;
+    _queue_pop_batch(ptr, &sp, 1);
+    return sp;
+}
+
+void _queue_destroy(const thread_queue_ptr_t* ptr) {
+    if (!ptr || !*ptr) return;
+    thread_queue_t* queue = (thread_queue_t*)*ptr;
+    thread_queue_ptr_t* _ptr = (thread_queue_ptr_t*)ptr;
+    sp_ptr_t sp = NULL;
+    while ((sp = _queue_pop(ptr)) != NULL) {
+        alloc->release(&sp);
+    }
+    free(queue->cells);
+    free(queue);
+    *_ptr = NULL;
+}
@@ -0,0 +1,274 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#include "../src/api/alloc.h"
+#include "../src/alloc.h"
+
+// the same source is built once per backend and once with BENCH_MALLOC, BENCH_BACKEND names the rows
+#ifndef BENCH_BACKEND
+#define BENCH_BACKEND alloc
+#endif
+#define BENCH_STRING(name) #name
+#define BENCH_NAME(name) BENCH_STRING(name)
+
+#define ROUNDS 64
+#define ROUND_OPS 4096 // every workload does this many timed operations per round
+#define WINDOW 1024 // objects the mixed workload keeps live
+#define STORM_OBJECTS 16
+
+#ifdef BENCH_MALLOC
+// system malloc with a reference count in front of the payload, the work a non-atomic sp_t does
+typedef struct malloc_object {
+    unsigned long ref_count;
+    size_t size;
+} malloc_object_t;
+
+typedef malloc_object_t* handle_t;
+typedef void* bench_ptr_t;
+#else
+typedef sp_ptr_t handle_t;
+typedef allocator_ptr_t bench_ptr_t;
+#endif
+
+typedef void (*workload_t)(bench_ptr_t* ptr, handle_t* slots, unsigned int* seed, double* samples);
+
+static handle_t bench_slots[ROUND_OPS];
+static double bench_samples[ROUNDS * ROUND_OPS];
+
+static double now_ns(void) {
+#ifdef _WIN32
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart * 1e9 / (double)frequency.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+#endif
+}
+
+// with samples set every operation is timed on its own, otherwise the round runs untouched
+#define TIMED(samples, count, op) \
+    do { \
+        if (samples) { \
+            double start = now_ns(); \
+            op; \
+            (samples)[(count)++] = now_ns() - start; \
+        } else { \
+            op; \
+        } \
+    } while (0)
+
+static bench_ptr_t bench_init(void) {
+#ifdef BENCH_MALLOC
+    return NULL;
+#else
+    allocator_ptr_t ptr = alloc->init();
+    if (ptr == NULL) {
+        fprintf(stderr, "init failed\n");
+        exit(1);
+    }
+    return ptr;
+#endif
+}
+
+static handle_t bench_alloc(bench_ptr_t* ptr, size_t size) {
+#ifdef BENCH_MALLOC
+    (void)ptr;
+    handle_t handle = malloc(sizeof(malloc_object_t) + size);
+    if (handle != NULL) {
+        handle->ref_count = 1;
+        handle->size = size;
+    }
+#else
+    handle_t handle = alloc->alloc(ptr, size);
+#endif
+    if (handle == NULL) {
+        fprintf(stderr, "alloc of %zu bytes failed\n", size);
+        exit(1);
+    }
+    return handle;
+}
+
+static void bench_retain(handle_t* handle) {
+#ifdef BENCH_MALLOC
+    (*handle)->ref_count++;
+#else
+    alloc->retain(handle);
+#endif
+}
+
+static void bench_release(handle_t* handle) {
+#ifdef BENCH_MALLOC
+    if (--(*handle)->ref_count == 0) {
+        free(*handle);
+        *handle = NULL;
+    }
+#else
+    alloc->release(handle);
+#endif
+}
+
+// rounds end with nothing live, the reset between them keeps the bump backend from growing without bound
+static void bench_reset(bench_ptr_t* ptr) {
+#ifdef BENCH_MALLOC
+    (void)ptr;
+#else
+    alloc->reset(ptr);
+#endif
+}
+
+static void bench_destroy(bench_ptr_t* ptr) {
+#ifdef BENCH_MALLOC
+    (void)ptr;
+#else
+    alloc->destroy(ptr);
+#endif
+}
+
+static unsigned int next_random(unsigned int* seed) {
+    *seed = *seed * 1103515245u + 12345u;
+    return *seed >> 8;
+}
+
+// mostly small objects across the size classes, one in 64 is between 8KB and 64KB
+static size_t mixed_size(unsigned int* seed) {
+    unsigned int r = next_random(seed);
+    if (r % 64 == 0) {
+        return 8192 + (r >> 6) % 57344;
+    }
+    return ((size_t)16 << (r % 8)) + (r >> 3) % 16;
+}
+
+static void churn(bench_ptr_t* ptr, handle_t* slots, unsigned int* seed, double* samples) {
+    (void)seed;
+    size_t count = 0;
+    for (size_t i = 0; i < ROUND_OPS / 2; i++) {
+        TIMED(samples, count, slots[0] = bench_alloc(ptr, 64));
+        TIMED(samples, count, bench_release(&slots[0]));
+    }
+}
+
+static void mixed(bench_ptr_t* ptr, handle_t* slots, unsigned int* seed, double* samples) {
+    size_t count = 0;
+    for (size_t i = 0; i < WINDOW; i++) {
+        size_t size = mixed_size(seed);
+        TIMED(samples, count, slots[i] = bench_alloc(ptr, size));
+    }
+    for (size_t i = 0; i < (ROUND_OPS - 2 * WINDOW) / 2; i++) {
+        size_t slot = next_random(seed) % WINDOW;
+        size_t size = mixed_size(seed);
+        TIMED(samples, count, bench_release(&slots[slot]));
+        TIMED(samples, count, slots[slot] = bench_alloc(ptr, size));
+    }
+    for (size_t i = 0; i < WINDOW; i++) {
+        TIMED(samples, count, bench_release(&slots[i]));
+    }
+}
+
+static void lifo(bench_ptr_t* ptr, handle_t* slots, unsigned int* seed, double* samples) {
+    (void)seed;
+    size_t count = 0;
+    for (size_t i = 0; i < ROUND_OPS / 2; i++) {
+        TIMED(samples, count, slots[i] = bench_alloc(ptr, 64));
+    }
+    for (size_t i = ROUND_OPS / 2; i > 0; i--) {
+        TIMED(samples, count, bench_release(&slots[i - 1]));
+    }
+}
+
+static void fifo(bench_ptr_t* ptr, handle_t* slots, unsigned int* seed, double* samples) {
+    (void)seed;
+    size_t count = 0;
+    for (size_t i = 0; i < ROUND_OPS / 2; i++) {
+        TIMED(samples, count, slots[i] = bench_alloc(ptr, 64));
+    }
+    for (size_t i = 0; i < ROUND_OPS / 2; i++) {
+        TIMED(samples, count, bench_release(&slots[i]));
+    }
+}
+
+// objects are allocated and dropped outside the timed operations, only the reference counting is measured
+static void retain_release(bench_ptr_t* ptr, handle_t* slots, unsigned int* seed, double* samples) {
+    size_t count = 0;
+    for (size_t i = 0; i < STORM_OBJECTS; i++) {
+        slots[i] = bench_alloc(ptr, 64);
+    }
+    for (size_t i = 0; i < ROUND_OPS / 2; i++) {
+        size_t slot = next_random(seed) % STORM_OBJECTS;
+        TIMED(samples, count, bench_retain(&slots[slot]));
+        TIMED(samples, count, bench_release(&slots[slot]));
+    }
+    for (size_t i = 0; i < STORM_OBJECTS; i++) {
+        bench_release(&slots[i]);
+    }
+}
+
+static int compare_samples(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const double* sorted, size_t count, double p) {
+    return sorted[(size_t)(p * (double)(count - 1))];
+}
+
+// the median cost of reading the clock twice, taken off every sample
+static double timer_overhead(void) {
+    double* samples = bench_samples;
+    size_t count = 0;
+    for (size_t i = 0; i < ROUND_OPS; i++) {
+        TIMED(samples, count, (void)0);
+    }
+    qsort(bench_samples, count, sizeof(double), compare_samples);
+    return percentile(bench_samples, count, 0.5);
+}
+
+static void bench(const char* name, workload_t workload, double overhead) {
+    bench_ptr_t ptr = bench_init();
+    unsigned int seed = 1;
+    // a warm-up round maps what the first timed round would otherwise pay for
+    workload(&ptr, bench_slots, &seed, NULL);
+    bench_reset(&ptr);
+    double elapsed = 0;
+    for (size_t round = 0; round < ROUNDS; round++) {
+        double start = now_ns();
+        workload(&ptr, bench_slots, &seed, NULL);
+        elapsed += now_ns() - start;
+        bench_reset(&ptr);
+    }
+    for (size_t round = 0; round < ROUNDS; round++) {
+        workload(&ptr, bench_slots, &seed, bench_samples + round * ROUND_OPS);
+        bench_reset(&ptr);
+    }
+    bench_destroy(&ptr);
+    size_t count = ROUNDS * ROUND_OPS;
+    for (size_t i = 0; i < count; i++) {
+        bench_samples[i] = bench_samples[i] > overhead ? bench_samples[i] - overhead : 0;
+    }
+    qsort(bench_samples, count, sizeof(double), compare_samples);
+    printf("%s,%s,%zu,%.2f,%.0f,%.0f,%.0f\n", BENCH_NAME(BENCH_BACKEND), name, count, elapsed / (double)count,
+        percentile(bench_samples, count, 0.5), percentile(bench_samples, count, 0.99), percentile(bench_samples, count, 0.999));
+}
+
+int main(int argc, char** argv) {
+    // with an argument the header is left out, so the output of every backend can be appended to one file
+    if (argc < 2 || strcmp(argv[1], "--no-header") != 0) {
+        printf("backend,workload,ops,ns_per_op,p50_ns,p99_ns,p999_ns\n");
+    }
+    double overhead = timer_overhead();
+    bench("churn", churn, overhead);
+    bench("mixed", mixed, overhead);
+    bench("lifo", lifo, overhead);
+    bench("fifo", fifo, overhead);
+    bench("retain_release", retain_release, overhead);
+    return 0;
+}
@@ -0,0 +1,76 @@
+#include <stdio.h>
+#include <time.h>
+
+#include "../src/api/alloc.h"
+#include "../src/api/thread.h"
+#include "../src/alloc.h"
+
+#define ITERATIONS 10000000
+#define NUM_THREADS 4
+
+typedef struct shared {
+    sp_ptr_t sp;
+    int iterations;
+} shared_t;
+
+static double now_ns(void) {
+#ifdef _WIN32
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart * 1e9 / (double)frequency.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+#endif
+}
+
+static void retain_release(sp_ptr_t sp, int iterations) {
+    for (int i = 0; i < iterations; i++) {
+        alloc->retain(&sp);
+        alloc->release(&sp);
+    }
+}
+
+thread_func_result thread_func(void* param) {
+    shared_t* shared = (shared_t*)param;
+    retain_release(shared->sp, shared->iterations);
+    return (thread_func_result)0;
+}
+
+static void bench_single_thread(const char* name, unsigned int flags) {
+    allocator_ptr_t ptr = alloc->init_with(flags);
+    sp_ptr_t sp = alloc->alloc(&ptr, 64);
+    double start = now_ns();
+    retain_release(sp, ITERATIONS);
+    double elapsed = now_ns() - start;
+    printf("%-24s threads=1 %8.2f ns/op (ref_count=%lu)\n", name, elapsed / ITERATIONS, (unsigned long)sp->ref_count);
+    alloc->release(&sp);
+    alloc->gc(&ptr);
+    alloc->destroy(&ptr);
+}
+
+static void bench_shared(const char* name, unsigned int flags) {
+    allocator_ptr_t ptr = alloc->init_with(flags);
+    shared_t shared = { .sp = alloc->alloc(&ptr, 64), .iterations = ITERATIONS / NUM_THREADS };
+    thread_sp_ptr_t threads = thread->create(thread_func, &shared, NUM_THREADS);
+    double start = now_ns();
+    thread->start(&threads);
+    thread->join(&threads);
+    double elapsed = now_ns() - start;
+    printf("%-24s threads=%d %8.2f ns/op (ref_count=%lu)\n", name, NUM_THREADS, elapsed / ITERATIONS, (unsigned long)shared.sp->ref_count);
+    thread->destroy(&threads);
+    alloc->release(&shared.sp);
+    alloc->gc(&ptr);
+    alloc->destroy(&ptr);
+}
+
+int main(void) {
+    printf("retain/release pairs on one object, %d iterations\n", ITERATIONS);
+    bench_single_thread("non-atomic", 0);
+    bench_single_thread("atomic", ALLOC_ATOMIC_REF_COUNT);
+    // the non-atomic mode is not safe to share, so only the atomic mode is measured across threads
+    bench_shared("atomic shared", ALLOC_ATOMIC_REF_COUNT);
+    return 0;
+}
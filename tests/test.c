@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
 #include <assert.h>
 
 #ifdef _WIN32
@@ -10,6 +11,7 @@
 #endif
 
 #include "../src/api/alloc.h"
+#include "../src/api/thread.h"
 #include "../src/alloc.h"
 
 static int tests_run = 0;
@@ -448,6 +450,37 @@ void test_release_already_freed_memory() {
         ASSERT_PTR_NULL(ptr);
     } END_TEST;
 }
+void test_release_after_gc() {
+    TEST(test_release_after_gc) {
+        allocator_ptr_t ptr = alloc->init();
+        sp_ptr_t str = alloc->alloc(&ptr, 20);
+        ASSERT_PTR_NOT_NULL(str);
+        sp_ptr_t copy = str;
+
+        // gc and gc_step free the slot, a copy released afterwards must not free it a second time
+        alloc->gc(&ptr);
+        alloc->release(&copy);
+        ASSERT_EQ(0, ptr->total_blocks);
+        str = alloc->alloc(&ptr, 20);
+        copy = str;
+        while (!alloc->gc_step(&ptr, 1)) {
+        }
+        alloc->release(&copy);
+        ASSERT_EQ(0, ptr->total_blocks);
+
+        sp_ptr_t first = alloc->alloc(&ptr, 20);
+        sp_ptr_t second = alloc->alloc(&ptr, 20);
+        ASSERT_PTR_NOT_NULL(first);
+        ASSERT_PTR_NOT_NULL(second);
+        ASSERT_PTR_NOT_EQ(first, second);
+        ASSERT_EQ(2, ptr->total_blocks);
+        alloc->gc(&ptr);
+        ASSERT_EQ(0, ptr->total_blocks);
+        alloc->destroy(&ptr);
+        ASSERT_PTR_NULL(ptr);
+    } END_TEST;
+}
+
 void test_rc_gc_no_blocks() {
     TEST(test_rc_gc_no_blocks) {
         allocator_ptr_t ptr = alloc->init();
@@ -690,6 +723,1508 @@ void test_retain_after_release() {
     } END_TEST;
 }
 
+void test_atomic_ref_count_mode() {
+    TEST(test_atomic_ref_count_mode) {
+        allocator_ptr_t ptr = alloc->init_with(ALLOC_ATOMIC_REF_COUNT);
+        ASSERT_PTR_NOT_NULL(ptr);
+        ASSERT_EQ(ALLOC_ATOMIC_REF_COUNT, ptr->flags);
+        sp_ptr_t sp = alloc->alloc(&ptr, 20);
+        ASSERT_PTR_NOT_NULL(sp);
+        ASSERT_EQ(1, sp->ref_count);
+
+        const void* result = alloc->retain(&sp);
+        ASSERT_PTR_EQ(sp->ptr, result);
+        ASSERT_EQ(2, sp->ref_count);
+
+        alloc->release(&sp);
+        ASSERT_PTR_NOT_NULL(sp);
+        ASSERT_EQ(1, sp->ref_count);
+        alloc->release(&sp);
+        ASSERT_PTR_NULL(sp);
+        ASSERT_EQ(0, ptr->total_blocks);
+        ASSERT_PTR_NULL(ptr->block_list);
+
+        alloc->gc(&ptr);
+        ASSERT_PTR_NOT_NULL(ptr);
+        ASSERT_PTR_EQ(NULL, ptr->block_list);
+        ASSERT_EQ(0, ptr->total_blocks);
+        alloc->destroy(&ptr);
+        ASSERT_PTR_NULL(ptr);
+    } END_TEST;
+}
+
+void test_alloc_batch_release_batch() {
+    TEST(test_alloc_batch_release_batch) {
+        allocator_ptr_t ptr = alloc->init();
+        sp_ptr_t sps[8];
+        size_t count = alloc->alloc_batch(&ptr, 24, 8, sps);
+        ASSERT_EQ(8, count);
+        ASSERT_EQ(8, ptr->total_blocks);
+        for (int i = 0; i < 8; i++) {
+            ASSERT_PTR_NOT_NULL(sps[i]);
+            ASSERT_EQ(24, sps[i]->size);
+            ASSERT_EQ(1, sps[i]->ref_count);
+        }
+        ASSERT_PTR_EQ(sps[7]->block, ptr->block_list);
+        ASSERT_PTR_EQ(sps[6]->block, ptr->block_list->next);
+
+        alloc->retain(&sps[3]);
+        alloc->release_batch(sps, 8);
+        ASSERT_EQ(1, ptr->total_blocks);
+        ASSERT_PTR_NOT_NULL(sps[3]);
+        ASSERT_PTR_NULL(sps[0]);
+        ASSERT_PTR_NULL(sps[7]);
+        ASSERT_PTR_EQ(sps[3]->block, ptr->block_list);
+
+        alloc->gc(&ptr);
+        ASSERT_PTR_NOT_NULL(ptr);
+        ASSERT_PTR_EQ(NULL, ptr->block_list);
+        ASSERT_EQ(0, ptr->total_blocks);
+        alloc->destroy(&ptr);
+        ASSERT_PTR_NULL(ptr);
+    } END_TEST;
+}
+
+void test_allocate_beyond_initial_memory() {
+    TEST(test_allocate_beyond_initial_memory) {
+        allocator_ptr_t ptr = alloc->init();
+        sp_ptr_t small[64];
+        for (int i = 0; i < 64; i++) {
+            small[i] = alloc->alloc(&ptr, 200);
+            ASSERT_PTR_NOT_NULL(small[i]);
+            if (small[i]) {
+                memset(small[i]->ptr, i, 200);
+            }
+        }
+        sp_ptr_t large = alloc->alloc(&ptr, 70000);
+        ASSERT_PTR_NOT_NULL(large);
+        if (large) {
+            memset(large->ptr, 0xff, 70000);
+        }
+        ASSERT_EQ(65, ptr->total_blocks);
+        for (int i = 0; i < 64; i++) {
+            if (small[i]) {
+                ASSERT_EQ(i, ((unsigned char*)small[i]->ptr)[199]);
+            }
+        }
+
+        alloc->release(&large);
+        ASSERT_PTR_NULL(large);
+        ASSERT_EQ(64, ptr->total_blocks);
+
+        alloc->gc(&ptr);
+        ASSERT_PTR_NOT_NULL(ptr);
+        ASSERT_PTR_EQ(NULL, ptr->block_list);
+        ASSERT_EQ(0, ptr->total_blocks);
+        alloc->destroy(&ptr);
+        ASSERT_PTR_NULL(ptr);
+    } END_TEST;
+}
+
+void test_independent_allocators() {
+    TEST(test_independent_allocators) {
+        allocator_ptr_t first = alloc->init();
+        sp_ptr_t a = alloc->alloc(&first, 20);
+        allocator_ptr_t second = alloc->init();
+        sp_ptr_t b = alloc->alloc(&second, 20);
+        ASSERT_PTR_NOT_NULL(a);
+        ASSERT_PTR_NOT_NULL(b);
+        ASSERT_PTR_NOT_EQ(a, b);
+        ASSERT_PTR_NOT_EQ(first, second);
+        ASSERT_EQ(1, first->total_blocks);
+        ASSERT_EQ(1, second->total_blocks);
+        ASSERT_PTR_EQ(a->block, first->block_list);
+        ASSERT_PTR_EQ(b->block, second->block_list);
+
+        alloc->gc(&second);
+        alloc->destroy(&second);
+        ASSERT_PTR_NULL(second);
+        ASSERT_EQ(1, first->total_blocks);
+        ASSERT_PTR_EQ(a->block, first->block_list);
+
+        alloc->gc(&first);
+        alloc->destroy(&first);
+        ASSERT_PTR_NULL(first);
+    } END_TEST;
+}
+
+void test_mark_rewind_reset() {
+    TEST(test_mark_rewind_reset) {
+        allocator_ptr_t ptr = alloc->init();
+        sp_ptr_t kept = alloc->alloc(&ptr, 20);
+        ASSERT_PTR_NOT_NULL(kept);
+        alloc_mark_t mark = alloc->mark(&ptr);
+        for (int i = 0; i < 3; i++) {
+            ASSERT_PTR_NOT_NULL(alloc->alloc(&ptr, 20));
+        }
+        ASSERT_EQ(4, ptr->total_blocks);
+
+        alloc->rewind(&ptr, mark);
+        ASSERT_EQ(1, ptr->total_blocks);
+        ASSERT_PTR_EQ(kept->block, ptr->block_list);
+        ASSERT_PTR_NULL(ptr->block_list->prev);
+        ASSERT_EQ(1, kept->ref_count);
+
+        ASSERT_PTR_NOT_NULL(alloc->alloc(&ptr, 20));
+        ASSERT_EQ(2, ptr->total_blocks);
+        alloc->release(&kept);
+        alloc->reset(&ptr);
+        ASSERT_EQ(0, ptr->total_blocks);
+        ASSERT_PTR_NULL(ptr->block_list);
+
+        alloc->destroy(&ptr);
+        ASSERT_PTR_NULL(ptr);
+    } END_TEST;
+}
+
+void test_stale_marks() {
+    TEST(test_stale_marks) {
+        allocator_ptr_t ptr = alloc->init();
+        sp_ptr_t kept = alloc->alloc(&ptr, 20);
+        alloc_mark_t outer = alloc->mark(&ptr);
+        ASSERT_PTR_NOT_NULL(alloc->alloc(&ptr, 20));
+        alloc_mark_t inner = alloc->mark(&ptr);
+        ASSERT_PTR_NOT_NULL(alloc->alloc(&ptr, 20));
+        // nested marks rewind innermost first, and a mark stays good for another round
+        alloc->rewind(&ptr, inner);
+        ASSERT_EQ(2, ptr->total_blocks);
+        ASSERT_PTR_NOT_NULL(alloc->alloc(&ptr, 20));
+        alloc->rewind(&ptr, inner);
+        ASSERT_EQ(2, ptr->total_blocks);
+        alloc->rewind(&ptr, outer);
+        ASSERT_EQ(1, ptr->total_blocks);
+        // serials start over from the mark, so the next mark is the same one again
+        alloc_mark_t again = alloc->mark(&ptr);
+        ASSERT_EQ(outer.serial, again.serial);
+
+        // the outer rewind went back past inner, so rewinding to it leaves the new objects alone
+        for (int i = 0; i < 3; i++) {
+            ASSERT_PTR_NOT_NULL(alloc->alloc(&ptr, 20));
+        }
+        alloc->rewind(&ptr, inner);
+        ASSERT_EQ(4, ptr->total_blocks);
+        alloc_mark_t empty = { 0, NULL, 0, 0 };
+        alloc->rewind(&ptr, empty);
+        ASSERT_EQ(4, ptr->total_blocks);
+        alloc->rewind(&ptr, again);
+        ASSERT_EQ(1, ptr->total_blocks);
+
+        // more rewinds than the history holds still leave the oldest mark good
+        for (int i = 0; i < 40; i++) {
+            ASSERT_PTR_NOT_NULL(alloc->alloc(&ptr, 20));
+            alloc_mark_t frame = alloc->mark(&ptr);
+            ASSERT_PTR_NOT_NULL(alloc->alloc(&ptr, 20));
+            alloc->rewind(&ptr, frame);
+        }
+        ASSERT_EQ(41, ptr->total_blocks);
+        alloc->rewind(&ptr, outer);
+        ASSERT_EQ(1, ptr->total_blocks);
+        ASSERT_PTR_EQ(kept->block, ptr->block_list);
+
+        // after a reset only a mark of the empty allocator is left
+        alloc->reset(&ptr);
+        ASSERT_EQ(0, ptr->total_blocks);
+        ASSERT_PTR_NOT_NULL(alloc->alloc(&ptr, 20));
+        alloc->rewind(&ptr, outer);
+        ASSERT_EQ(1, ptr->total_blocks);
+        alloc->destroy(&ptr);
+        ASSERT_PTR_NULL(ptr);
+    } END_TEST;
+}
+
+void test_huge_pages_mode() {
+    TEST(test_huge_pages_mode) {
+        allocator_ptr_t plain = alloc->init();
+        ASSERT_EQ(0, alloc->flags(&plain));
+        alloc->destroy(&plain);
+
+        allocator_ptr_t ptr = alloc->init_with(ALLOC_HUGE_PAGES);
+        ASSERT_PTR_NOT_NULL(ptr);
+        unsigned int flags = alloc->flags(&ptr);
+        ASSERT(flags & ALLOC_HUGE_PAGES);
+        // at most one page mode is reported
+        ASSERT((flags & ALLOC_HUGE_PAGES_RESERVED) == 0 || (flags & ALLOC_HUGE_PAGES_TRANSPARENT) == 0);
+        for (int i = 0; i < 1000; i++) {
+            sp_ptr_t sp = alloc->alloc(&ptr, 4000);
+            ASSERT_PTR_NOT_NULL(sp);
+            memset(alloc->retain(&sp), i, 4000);
+            alloc->release(&sp);
+        }
+        ASSERT_EQ(1000, ptr->total_blocks);
+        alloc->gc(&ptr);
+        ASSERT_EQ(0, ptr->total_blocks);
+        alloc->destroy(&ptr);
+        ASSERT_PTR_NULL(ptr);
+    } END_TEST;
+}
+
+void test_alloc_aligned() {
+    TEST(test_alloc_aligned) {
+        allocator_ptr_t ptr = alloc->init();
+        const size_t sizes[] = { 1, 100, 4000, 10000 };
+        int live = 0;
+        for (size_t alignment = 8; alignment <= 4096; alignment *= 2) {
+            for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+                sp_ptr_t sp = alloc->alloc_aligned(&ptr, sizes[i], alignment);
+                ASSERT_PTR_NOT_NULL(sp);
+                ASSERT_EQ(0, (uintptr_t)sp->ptr % alignment);
+                ASSERT_EQ(sizes[i], sp->size);
+                memset(alloc->retain(&sp), 0xA5, sizes[i]);
+                alloc->release(&sp);
+                // every other object is released right away, the rest stay until gc
+                if (i % 2 == 0) {
+                    alloc->release(&sp);
+                    ASSERT_PTR_NULL(sp);
+                } else {
+                    live++;
+                }
+            }
+        }
+        ASSERT_EQ(live, ptr->total_blocks);
+
+        ASSERT_PTR_NULL(alloc->alloc_aligned(&ptr, 16, 0));
+        ASSERT_PTR_NULL(alloc->alloc_aligned(&ptr, 16, 48));
+        ASSERT_PTR_NULL(alloc->alloc_aligned(&ptr, 16, 8192));
+        ASSERT_EQ(live, ptr->total_blocks);
+
+        alloc->gc(&ptr);
+        ASSERT_EQ(0, ptr->total_blocks);
+        alloc->destroy(&ptr);
+        ASSERT_PTR_NULL(ptr);
+    } END_TEST;
+}
+
+void test_resize() {
+    TEST(test_resize) {
+        allocator_ptr_t ptr = alloc->init();
+        sp_ptr_t sp = alloc->alloc(&ptr, 70);
+        ASSERT_PTR_NOT_NULL(sp);
+        sp_ptr_t other = sp;
+        alloc->retain(&other);
+        for (int i = 0; i < 70; i++) {
+            ((unsigned char*)sp->ptr)[i] = (unsigned char)i;
+        }
+
+        const size_t sizes[] = { 100, 10000, 200000, 10, 3000 };
+        size_t kept = 70;
+        for (size_t n = 0; n < sizeof(sizes) / sizeof(sizes[0]); n++) {
+            void* payload = alloc->resize(&sp, sizes[n]);
+            ASSERT_PTR_NOT_NULL(payload);
+            ASSERT_PTR_EQ(sp->ptr, payload);
+            ASSERT_PTR_EQ(sp, other);
+            ASSERT_EQ(sizes[n], other->size);
+            ASSERT_EQ(0, (uintptr_t)payload % 16);
+            if (sizes[n] < kept) {
+                kept = sizes[n];
+            }
+            for (size_t i = 0; i < kept; i++) {
+                ASSERT_EQ((unsigned char)i, ((unsigned char*)payload)[i]);
+            }
+            memset((char*)payload + kept, 0xA5, sizes[n] - kept);
+        }
+        ASSERT_EQ(1, ptr->total_blocks);
+        ASSERT_EQ(2, sp->ref_count);
+
+        alloc->release(&other);
+        alloc->release(&sp);
+        ASSERT_PTR_NULL(sp);
+        ASSERT_PTR_NULL(alloc->resize(&sp, 10));
+        ASSERT_EQ(0, ptr->total_blocks);
+
+        // shrinking never moves the payload, whatever class the smaller size would get
+        const size_t shrinks[] = { 1000, 500, 100, 40, 1 };
+        sp = alloc->alloc(&ptr, 2000);
+        void* payload = sp->ptr;
+        memset(payload, 0x3C, 2000);
+        for (size_t n = 0; n < sizeof(shrinks) / sizeof(shrinks[0]); n++) {
+            ASSERT_PTR_EQ(payload, alloc->resize(&sp, shrinks[n]));
+            ASSERT_EQ(0x3C, ((unsigned char*)sp->ptr)[shrinks[n] - 1]);
+        }
+        alloc_stats_t stats;
+        alloc->stats(&ptr, &stats);
+        ASSERT_EQ(1, stats.live_bytes);
+        alloc->release(&sp);
+        ASSERT_EQ(0, ptr->total_blocks);
+
+        alloc->gc(&ptr);
+        alloc->destroy(&ptr);
+        ASSERT_PTR_NULL(ptr);
+    } END_TEST;
+}
+
+// fills a payload with a pattern that tells its bytes apart, and checks it is still there
+static void fill_pattern(sp_ptr_t sp, size_t size, unsigned char seed) {
+    for (size_t i = 0; i < size; i++) {
+        ((unsigned char*)sp->ptr)[i] = (unsigned char)(seed + i);
+    }
+}
+
+static int has_pattern(sp_ptr_t sp, size_t size, unsigned char seed) {
+    for (size_t i = 0; i < size; i++) {
+        if (((unsigned char*)sp->ptr)[i] != (unsigned char)(seed + i)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void test_resize_across_rewind() {
+    TEST(test_resize_across_rewind) {
+        allocator_ptr_t ptr = alloc->init();
+        sp_ptr_t older = alloc->alloc(&ptr, 32);
+        sp_ptr_t newest = alloc->alloc(&ptr, 32);
+        ASSERT_PTR_NOT_NULL(older);
+        ASSERT_PTR_NOT_NULL(newest);
+        alloc_mark_t outer = alloc->mark(&ptr);
+        sp_ptr_t between = alloc->alloc(&ptr, 32);
+        alloc_mark_t mark = alloc->mark(&ptr);
+
+        // the newest slot at the mark grows, the older one and the large one move, all after the mark
+        const size_t sizes[] = { 200, 3000, 200000 };
+        sp_ptr_t* sps[] = { &newest, &older, &between };
+        for (int i = 0; i < 3; i++) {
+            ASSERT_PTR_NOT_NULL(alloc->resize(sps[i], sizes[i]));
+            fill_pattern(*sps[i], sizes[i], (unsigned char)(i * 50));
+        }
+
+        // rewinding gives back what came after the mark, never the payloads of objects older than it
+        for (int round = 0; round < 2; round++) {
+            alloc->rewind(&ptr, mark);
+            ASSERT_EQ(3, ptr->total_blocks);
+            for (int i = 0; i < 3; i++) {
+                sp_ptr_t sp = alloc->alloc(&ptr, sizes[i]);
+                ASSERT_PTR_NOT_NULL(sp);
+                memset(sp->ptr, 0, sizes[i]);
+            }
+            for (int i = 0; i < 3; i++) {
+                ASSERT(has_pattern(*sps[i], sizes[i], (unsigned char)(i * 50)));
+            }
+        }
+
+        // once the rewind reaches past an object its payload goes with it, the older ones still stay
+        alloc->rewind(&ptr, outer);
+        ASSERT_EQ(2, ptr->total_blocks);
+        ASSERT_PTR_NOT_NULL(alloc->alloc(&ptr, 200000));
+        ASSERT(has_pattern(newest, sizes[0], 0));
+        ASSERT(has_pattern(older, sizes[1], 50));
+
+        alloc->reset(&ptr);
+        ASSERT_EQ(0, ptr->total_blocks);
+        alloc->destroy(&ptr);
+        ASSERT_PTR_NULL(ptr);
+    } END_TEST;
+}
+
+void test_stats() {
+    TEST(test_stats) {
+        alloc_stats_t stats;
+        alloc->stats(NULL, &stats);
+        ASSERT_EQ(0, stats.allocs);
+        ASSERT_EQ(0, stats.reserved_bytes);
+
+        allocator_ptr_t ptr = alloc->init();
+        alloc->stats(&ptr, &stats);
+        ASSERT_EQ(0, stats.allocs);
+        ASSERT_EQ(0, stats.live_bytes);
+        ASSERT(stats.reserved_bytes > 0);
+        ASSERT(stats.class_count >= 1 && stats.class_count <= ALLOC_STATS_CLASSES);
+
+        sp_ptr_t sps[10];
+        for (int i = 0; i < 10; i++) {
+            sps[i] = alloc->alloc(&ptr, 100);
+            ASSERT_PTR_NOT_NULL(sps[i]);
+        }
+        sp_ptr_t large = alloc->alloc(&ptr, 100000);
+        ASSERT_PTR_NOT_NULL(large);
+        alloc->stats(&ptr, &stats);
+        ASSERT_EQ(11, stats.allocs);
+        ASSERT_EQ(0, stats.releases);
+        ASSERT_EQ(10 * 100 + 100000, stats.live_bytes);
+        ASSERT(stats.slot_bytes >= stats.live_bytes + 11 * OBJECT_HEADER_SIZE);
+        ASSERT_EQ(stats.slot_bytes - stats.live_bytes - 11 * OBJECT_HEADER_SIZE, stats.fragmentation);
+        ASSERT(stats.peak_reserved_bytes >= stats.reserved_bytes);
+        ASSERT(stats.reserved_bytes >= stats.slot_bytes);
+        unsigned long row_allocs = 0;
+        size_t row_live_bytes = 0;
+        for (size_t i = 0; i < stats.class_count; i++) {
+            row_allocs += stats.classes[i].allocs;
+            row_live_bytes += stats.classes[i].live_bytes;
+        }
+        ASSERT_EQ(stats.allocs, row_allocs);
+        ASSERT_EQ(stats.live_bytes, row_live_bytes);
+
+        ASSERT_PTR_NOT_NULL(alloc->resize(&sps[0], 5000));
+        alloc->stats(&ptr, &stats);
+        ASSERT_EQ(9 * 100 + 5000 + 100000, stats.live_bytes);
+        for (int i = 0; i < 5; i++) {
+            alloc->release(&sps[i]);
+        }
+        alloc->stats(&ptr, &stats);
+        ASSERT_EQ(5 * 100 + 100000, stats.live_bytes);
+        ASSERT_EQ(6, stats.allocs - stats.releases);
+
+        alloc->reset(&ptr);
+        alloc->stats(&ptr, &stats);
+        ASSERT_EQ(0, stats.live_bytes);
+        ASSERT_EQ(0, stats.slot_bytes);
+        ASSERT_EQ(stats.allocs, stats.releases);
+        ASSERT(stats.peak_reserved_bytes >= stats.reserved_bytes);
+
+        alloc->destroy(&ptr);
+        ASSERT_PTR_NULL(ptr);
+    } END_TEST;
+}
+
+void test_handle_table() {
+    TEST(test_handle_table) {
+        allocator_ptr_t plain = alloc->init();
+        sp_ptr_t unhandled = alloc->alloc(&plain, 20);
+        ASSERT_EQ(0, alloc->handle(&unhandled));
+        sp_ptr_t resolved = alloc->resolve(&plain, 1);
+        ASSERT_PTR_NULL(resolved);
+        alloc->destroy(&plain);
+
+        allocator_ptr_t ptr = alloc->init_with(ALLOC_HANDLE_TABLE);
+        ASSERT_PTR_NOT_NULL(ptr);
+        ASSERT(alloc->flags(&ptr) & ALLOC_HANDLE_TABLE);
+        ASSERT_EQ(4, sizeof(alloc_handle_t));
+        sp_ptr_t sp = alloc->alloc(&ptr, 20);
+        alloc_handle_t handle = alloc->handle(&sp);
+        ASSERT(handle != 0);
+        resolved = alloc->resolve(&ptr, handle);
+        ASSERT_PTR_EQ(sp, resolved);
+
+        void* payload = alloc->handle_retain(&ptr, handle);
+        ASSERT_PTR_EQ(sp->ptr, payload);
+        ASSERT_EQ(2, sp->ref_count);
+        alloc->handle_release(&ptr, handle);
+        ASSERT_EQ(1, sp->ref_count);
+        alloc->handle_release(&ptr, handle);
+        ASSERT_EQ(0, ptr->total_blocks);
+
+        // the table catches the stale handle, the freed object is not read again
+        resolved = alloc->resolve(&ptr, handle);
+        ASSERT_PTR_NULL(resolved);
+        payload = alloc->handle_retain(&ptr, handle);
+        ASSERT_PTR_NULL(payload);
+        alloc->handle_release(&ptr, handle);
+
+        // the entry is reused with another generation
+        sp_ptr_t next = alloc->alloc(&ptr, 20);
+        alloc_handle_t next_handle = alloc->handle(&next);
+        ASSERT(next_handle != 0 && next_handle != handle);
+        resolved = alloc->resolve(&ptr, handle);
+        ASSERT_PTR_NULL(resolved);
+        resolved = alloc->resolve(&ptr, next_handle);
+        ASSERT_PTR_EQ(next, resolved);
+        alloc->gc(&ptr);
+        resolved = alloc->resolve(&ptr, next_handle);
+        ASSERT_PTR_NULL(resolved);
+
+        sp_ptr_t sps[8];
+        alloc_handle_t handles[8];
+        ASSERT_EQ(8, alloc->alloc_batch(&ptr, 24, 8, sps));
+        for (int i = 0; i < 8; i++) {
+            handles[i] = alloc->handle(&sps[i]);
+            resolved = alloc->resolve(&ptr, handles[i]);
+            ASSERT_PTR_EQ(sps[i], resolved);
+        }
+        alloc->reset(&ptr);
+        for (int i = 0; i < 8; i++) {
+            resolved = alloc->resolve(&ptr, handles[i]);
+            ASSERT_PTR_NULL(resolved);
+        }
+        alloc->destroy(&ptr);
+        ASSERT_PTR_NULL(ptr);
+    } END_TEST;
+}
+
+void test_compact() {
+    TEST(test_compact) {
+        allocator_ptr_t ptr = alloc->init();
+        ASSERT_EQ(0, alloc->compact(&ptr, 0));
+        // payloads that outgrow their slot move out, then most of them are released again
+        sp_ptr_t sps[300];
+        for (int i = 0; i < 300; i++) {
+            sps[i] = alloc->alloc(&ptr, 16);
+            ASSERT_PTR_NOT_NULL(sps[i]);
+            unsigned char* payload = alloc->resize(&sps[i], 200);
+            ASSERT_PTR_NOT_NULL(payload);
+            memset(payload, i & 0xFF, 200);
+        }
+        sp_ptr_t large = alloc->alloc(&ptr, 100000);
+        alloc->release(&large);
+        for (int i = 0; i < 180; i++) {
+            alloc->release(&sps[i]);
+        }
+        alloc_stats_t before;
+        alloc->stats(&ptr, &before);
+
+        size_t moved = alloc->compact(&ptr, 1);
+        ASSERT(moved <= 200);
+        int rounds = 0;
+        while (alloc->compact(&ptr, 0) > 0 && rounds < 10) {
+            rounds++;
+        }
+        ASSERT(rounds < 10);
+        alloc_stats_t after;
+        alloc->stats(&ptr, &after);
+        ASSERT_EQ(before.live_bytes, after.live_bytes);
+        ASSERT_EQ(before.allocs - before.releases, after.allocs - after.releases);
+        ASSERT(after.reserved_bytes <= before.reserved_bytes);
+        ASSERT_EQ(120, ptr->total_blocks);
+        for (int i = 180; i < 300; i++) {
+            ASSERT_EQ(200, sps[i]->size);
+            const unsigned char* payload = sps[i]->ptr;
+            int intact = 1;
+            for (int j = 0; j < 200; j++) {
+                intact &= payload[j] == (unsigned char)(i & 0xFF);
+            }
+            ASSERT(intact);
+            alloc->release(&sps[i]);
+        }
+        ASSERT_EQ(0, ptr->total_blocks);
+        alloc->gc(&ptr);
+        alloc->destroy(&ptr);
+        ASSERT_PTR_NULL(ptr);
+    } END_TEST;
+}
+
+#define SCATTERED_OBJECTS 2000
+
+// distinct 64KB windows the objects sit in, which is how many bucket slabs they keep
+static size_t count_windows(allocator_ptr_t* ptr, const alloc_handle_t* handles, size_t count) {
+    uintptr_t windows[SCATTERED_OBJECTS];
+    size_t distinct = 0;
+    for (size_t i = 0; i < count; i++) {
+        uintptr_t window = (uintptr_t)alloc->resolve(ptr, handles[i]) >> 16;
+        size_t j = 0;
+        while (j < distinct && windows[j] != window) {
+            j++;
+        }
+        if (j == distinct) {
+            windows[distinct++] = window;
+        }
+    }
+    return distinct;
+}
+
+void test_compact_handles() {
+    TEST(test_compact_handles) {
+        allocator_ptr_t ptr = alloc->init_with(ALLOC_HANDLE_TABLE);
+        ASSERT(alloc->flags(&ptr) & ALLOC_HANDLE_TABLE);
+        // every eighth object stays, so each slab they were carved from ends up mostly free
+        static sp_ptr_t sps[SCATTERED_OBJECTS];
+        for (int i = 0; i < SCATTERED_OBJECTS; i++) {
+            sps[i] = alloc->alloc(&ptr, 48);
+            ASSERT_PTR_NOT_NULL(sps[i]);
+            memset(sps[i]->ptr, i & 0xFF, 48);
+        }
+        alloc_handle_t handles[SCATTERED_OBJECTS / 8];
+        size_t kept = 0;
+        for (int i = 0; i < SCATTERED_OBJECTS; i++) {
+            if (i % 8 == 0) {
+                handles[kept++] = alloc->handle(&sps[i]);
+            } else {
+                alloc->release(&sps[i]);
+            }
+        }
+        alloc_stats_t before;
+        alloc->stats(&ptr, &before);
+        size_t windows_before = count_windows(&ptr, handles, kept);
+
+        size_t moved = 0;
+        size_t step;
+        int rounds = 0;
+        while ((step = alloc->compact(&ptr, 0)) > 0 && rounds < 10) {
+            moved += step;
+            rounds++;
+        }
+        ASSERT(rounds < 10);
+        // the objects are found through their handles wherever they went, in the same block_list order
+        alloc_stats_t after;
+        alloc->stats(&ptr, &after);
+        ASSERT_EQ(before.live_bytes, after.live_bytes);
+        ASSERT_EQ(before.allocs - before.releases, after.allocs - after.releases);
+        ASSERT_EQ((int)kept, ptr->total_blocks);
+        mem_block_t* block = ptr->block_list;
+        for (size_t i = kept; i-- > 0;) {
+            sp_ptr_t sp = alloc->resolve(&ptr, handles[i]);
+            ASSERT_PTR_NOT_NULL(sp);
+            ASSERT_PTR_EQ(sp, sp->self);
+            ASSERT_PTR_EQ(sp->block, block);
+            ASSERT_PTR_EQ(sp, block->ptr);
+            ASSERT_EQ(1, sp->ref_count);
+            ASSERT_EQ(48, sp->size);
+            const unsigned char* payload = sp->ptr;
+            int intact = 1;
+            for (int j = 0; j < 48; j++) {
+                intact &= payload[j] == (unsigned char)((i * 8) & 0xFF);
+            }
+            ASSERT(intact);
+            block = block->next;
+        }
+        ASSERT_PTR_NULL(block);
+        size_t windows_after = count_windows(&ptr, handles, kept);
+        ASSERT(windows_after <= windows_before);
+        ASSERT(moved == 0 || windows_after < windows_before);
+
+        for (size_t i = 0; i < kept; i++) {
+            alloc->handle_release(&ptr, handles[i]);
+            ASSERT_PTR_NULL(alloc->resolve(&ptr, handles[i]));
+        }
+        ASSERT_EQ(0, ptr->total_blocks);
+        alloc->destroy(&ptr);
+        ASSERT_PTR_NULL(ptr);
+    } END_TEST;
+}
+
+#define COMPACT_BUDGET 256
+
+void test_compact_budget() {
+    TEST(test_compact_budget) {
+        allocator_ptr_t ptr = alloc->init_with(ALLOC_HANDLE_TABLE);
+        static sp_ptr_t sps[SCATTERED_OBJECTS];
+        alloc_handle_t handles[SCATTERED_OBJECTS / 8];
+        size_t kept = 0;
+        for (int i = 0; i < SCATTERED_OBJECTS; i++) {
+            sps[i] = alloc->alloc(&ptr, 48);
+            ASSERT_PTR_NOT_NULL(sps[i]);
+        }
+        for (int i = 0; i < SCATTERED_OBJECTS; i++) {
+            if (i % 8 == 0) {
+                handles[kept++] = alloc->handle(&sps[i]);
+            } else {
+                alloc->release(&sps[i]);
+            }
+        }
+        size_t windows_before = count_windows(&ptr, handles, kept);
+
+        // a call moves at most one object past its budget, and the calls together get as far as an unlimited one
+        size_t moved = 0;
+        int within = 1;
+        for (int call = 0; call < 1000; call++) {
+            size_t step = alloc->compact(&ptr, COMPACT_BUDGET);
+            within &= step <= COMPACT_BUDGET + OBJECT_HEADER_SIZE + 48;
+            moved += step;
+        }
+        ASSERT(within);
+        ASSERT_EQ(0, alloc->compact(&ptr, 0));
+        size_t windows_after = count_windows(&ptr, handles, kept);
+        ASSERT(windows_after <= windows_before);
+        ASSERT(moved == 0 || windows_after < windows_before);
+
+        // objects released and allocated between the calls are taken in stride
+        for (size_t i = 0; i < kept; i += 2) {
+            alloc->handle_release(&ptr, handles[i]);
+        }
+        for (int i = 0; i < 100; i++) {
+            ASSERT_PTR_NOT_NULL(alloc->alloc(&ptr, 48));
+            alloc->compact(&ptr, COMPACT_BUDGET);
+        }
+        ASSERT_EQ((int)(kept / 2 + 100), ptr->total_blocks);
+        for (size_t i = 1; i < kept; i += 2) {
+            ASSERT_PTR_NOT_NULL(alloc->resolve(&ptr, handles[i]));
+        }
+        alloc->gc(&ptr);
+        ASSERT_EQ(0, alloc->compact(&ptr, COMPACT_BUDGET));
+        ASSERT_EQ(0, ptr->total_blocks);
+        alloc->destroy(&ptr);
+        ASSERT_PTR_NULL(ptr);
+    } END_TEST;
+}
+
+void test_gc_step() {
+    TEST(test_gc_step) {
+        allocator_ptr_t ptr = alloc->init();
+        ASSERT_EQ(1, alloc->gc_step(&ptr, 4));
+        sp_ptr_t sps[10];
+        for (int i = 0; i < 10; i++) {
+            sps[i] = alloc->alloc(&ptr, 32);
+            ASSERT_PTR_NOT_NULL(sps[i]);
+        }
+        // the sweep starts at the newest object and works its way to the oldest
+        ASSERT_EQ(0, alloc->gc_step(&ptr, 3));
+        ASSERT_EQ(7, ptr->total_blocks);
+        ASSERT_PTR_EQ(sps[6]->block, ptr->block_list);
+
+        // newer objects are left alone, released ones are skipped, including the one under the cursor
+        sp_ptr_t fresh = alloc->alloc(&ptr, 32);
+        alloc->release(&sps[6]);
+        alloc->release(&sps[2]);
+        ASSERT_EQ(6, ptr->total_blocks);
+        ASSERT_EQ(0, alloc->gc_step(&ptr, 2));
+        ASSERT_EQ(4, ptr->total_blocks);
+        ASSERT_EQ(1, alloc->gc_step(&ptr, 0));
+        ASSERT_EQ(1, ptr->total_blocks);
+        ASSERT_PTR_EQ(fresh->block, ptr->block_list);
+        ASSERT_EQ(1, fresh->ref_count);
+
+        // the next step starts another sweep, a gc in between finishes one at once
+        for (int i = 0; i < 4; i++) {
+            sps[i] = alloc->alloc(&ptr, 32);
+        }
+        ASSERT_EQ(0, alloc->gc_step(&ptr, 1));
+        alloc->gc(&ptr);
+        ASSERT_EQ(0, ptr->total_blocks);
+        sps[0] = alloc->alloc(&ptr, 32);
+        ASSERT_EQ(1, alloc->gc_step(&ptr, 1));
+        ASSERT_EQ(1, alloc->gc_step(&ptr, 1));
+        ASSERT_EQ(0, ptr->total_blocks);
+        ASSERT_PTR_NULL(ptr->block_list);
+
+        alloc_stats_t stats;
+        alloc->stats(&ptr, &stats);
+        ASSERT_EQ(stats.allocs, stats.releases);
+        ASSERT_EQ(0, stats.live_bytes);
+        alloc->destroy(&ptr);
+        ASSERT_PTR_NULL(ptr);
+    } END_TEST;
+}
+
+#define REMOTE_OBJECTS 100
+
+thread_func_result release_on_thread(void* param) {
+    sp_ptr_t* sps = (sp_ptr_t*)param;
+    for (int i = 0; i < REMOTE_OBJECTS; i++) {
+        alloc->release(&sps[i]);
+    }
+    return (thread_func_result)0;
+}
+
+void test_release_on_other_thread() {
+    TEST(test_release_on_other_thread) {
+        allocator_ptr_t ptr = alloc->init_with(ALLOC_ATOMIC_REF_COUNT);
+        sp_ptr_t sps[REMOTE_OBJECTS];
+        size_t allocated = alloc->alloc_batch(&ptr, 24, REMOTE_OBJECTS, sps);
+        ASSERT_EQ(REMOTE_OBJECTS, allocated);
+        thread_sp_ptr_t threads = thread->create(release_on_thread, sps, 1);
+        thread->start(&threads);
+        thread->join(&threads);
+        thread->destroy(&threads);
+        // the objects wait for the owner, still linked and counted as live
+        for (int i = 0; i < REMOTE_OBJECTS; i++) {
+            ASSERT_PTR_NULL(sps[i]);
+        }
+        ASSERT_EQ(REMOTE_OBJECTS, ptr->total_blocks);
+
+        // the owner's next alloc frees them
+        sp_ptr_t sp = alloc->alloc(&ptr, 24);
+        ASSERT_PTR_NOT_NULL(sp);
+        ASSERT_EQ(1, ptr->total_blocks);
+        ASSERT_PTR_EQ(sp->block, ptr->block_list);
+        ASSERT_PTR_NULL(ptr->block_list->next);
+        alloc_stats_t stats;
+        alloc->stats(&ptr, &stats);
+        ASSERT_EQ(REMOTE_OBJECTS + 1, stats.allocs);
+        ASSERT_EQ(REMOTE_OBJECTS, stats.releases);
+        ASSERT_EQ(24, stats.live_bytes);
+        alloc->release(&sp);
+        alloc->destroy(&ptr);
+        ASSERT_PTR_NULL(ptr);
+    } END_TEST;
+}
+
+void test_handles_released_off_owner() {
+    TEST(test_handles_released_off_owner) {
+        allocator_ptr_t ptr = alloc->init_with(ALLOC_ATOMIC_REF_COUNT | ALLOC_HANDLE_TABLE);
+        sp_ptr_t sps[REMOTE_OBJECTS];
+        alloc_handle_t handles[REMOTE_OBJECTS];
+        ASSERT_EQ(REMOTE_OBJECTS, alloc->alloc_batch(&ptr, 24, REMOTE_OBJECTS, sps));
+        for (int i = 0; i < REMOTE_OBJECTS; i++) {
+            handles[i] = alloc->handle(&sps[i]);
+            ASSERT(handles[i] != 0);
+        }
+        thread_sp_ptr_t threads = thread->create(release_on_thread, sps, 1);
+        thread->start(&threads);
+        thread->join(&threads);
+        thread->destroy(&threads);
+
+        // the objects still wait for the owner, but their handles went with the last release
+        ASSERT_EQ(REMOTE_OBJECTS, ptr->total_blocks);
+        int resolved = 0;
+        for (int i = 0; i < REMOTE_OBJECTS; i++) {
+            resolved += alloc->resolve(&ptr, handles[i]) != NULL;
+            resolved += alloc->handle_retain(&ptr, handles[i]) != NULL;
+        }
+        ASSERT_EQ(0, resolved);
+
+        sp_ptr_t sp = alloc->alloc(&ptr, 24);
+        ASSERT_EQ(1, ptr->total_blocks);
+        ASSERT_PTR_EQ(sp, alloc->resolve(&ptr, alloc->handle(&sp)));
+        alloc->release(&sp);
+        alloc->destroy(&ptr);
+        ASSERT_PTR_NULL(ptr);
+    } END_TEST;
+}
+
+typedef struct handoff {
+    allocator_ptr_t ptr;
+    sp_ptr_t shared;
+    int blocks_after_release;
+    unsigned long releases;
+} handoff_t;
+
+thread_func_result adopt_on_thread(void* param) {
+    handoff_t* handoff = (handoff_t*)param;
+    alloc->adopt(&handoff->ptr);
+    // the thread owns the allocator now, so its releases free at once
+    for (int i = 0; i < 100; i++) {
+        sp_ptr_t sp = alloc->alloc(&handoff->ptr, 48);
+        alloc->release(&sp);
+    }
+    alloc->release(&handoff->shared);
+    handoff->blocks_after_release = handoff->ptr->total_blocks;
+    alloc->flush(&handoff->ptr);
+    alloc_stats_t stats;
+    alloc->stats(&handoff->ptr, &stats);
+    handoff->releases = stats.releases;
+    return (thread_func_result)0;
+}
+
+void test_adopt() {
+    TEST(test_adopt) {
+        handoff_t handoff;
+        handoff.ptr = alloc->init_with(ALLOC_ATOMIC_REF_COUNT);
+        sp_ptr_t kept = alloc->alloc(&handoff.ptr, 16);
+        handoff.shared = alloc->alloc(&handoff.ptr, 16);
+        thread_sp_ptr_t threads = thread->create(adopt_on_thread, &handoff, 1);
+        thread->start(&threads);
+        thread->join(&threads);
+        thread->destroy(&threads);
+        ASSERT_PTR_NULL(handoff.shared);
+        ASSERT_EQ(1, handoff.blocks_after_release);
+        ASSERT_EQ(101, handoff.releases);
+
+        // this thread gave the allocator away, so its last release waits until it takes it back
+        alloc->release(&kept);
+        ASSERT_PTR_NULL(kept);
+        ASSERT_EQ(1, handoff.ptr->total_blocks);
+        alloc->adopt(&handoff.ptr);
+        ASSERT_EQ(0, handoff.ptr->total_blocks);
+        ASSERT_PTR_NULL(handoff.ptr->block_list);
+        alloc_stats_t stats;
+        alloc->stats(&handoff.ptr, &stats);
+        ASSERT_EQ(102, stats.allocs);
+        ASSERT_EQ(102, stats.releases);
+        ASSERT_EQ(0, stats.live_bytes);
+        alloc->destroy(&handoff.ptr);
+        ASSERT_PTR_NULL(handoff.ptr);
+    } END_TEST;
+}
+
+#define WORKER_PAIRS 20000
+
+typedef struct worker_usage {
+    int owned; // the allocator freed the worker's own releases at once
+    int total_blocks;
+    unsigned long allocs;
+    unsigned long releases;
+    size_t live_bytes;
+} worker_usage_t;
+
+void use_worker_allocator(void* param) {
+    worker_usage_t* usage = (worker_usage_t*)param;
+    allocator_ptr_t ptr = thread->allocator();
+    usage->owned = 1;
+    for (int i = 0; i < WORKER_PAIRS; i++) {
+        sp_ptr_t sp = alloc->alloc(&ptr, 64);
+        int before = ptr->total_blocks;
+        alloc->release(&sp);
+        usage->owned &= ptr->total_blocks == before - 1;
+    }
+    usage->total_blocks = ptr->total_blocks;
+    alloc_stats_t stats;
+    alloc->stats(&ptr, &stats);
+    usage->allocs = stats.allocs;
+    usage->releases = stats.releases;
+    usage->live_bytes = stats.live_bytes;
+}
+
+thread_func_result use_thread_allocator(void* param) {
+    use_worker_allocator(param);
+    return (thread_func_result)0;
+}
+
+void test_worker_allocators() {
+    TEST(test_worker_allocators) {
+        worker_usage_t usages[2];
+        memset(usages, 0, sizeof(usages));
+        thread_sp_ptr_t threads = thread->create(use_thread_allocator, &usages[0], 1);
+        thread->start(&threads);
+        thread->join(&threads);
+        thread->destroy(&threads);
+        thread_pool_ptr_t pool = thread->pool_create(1);
+        ASSERT_PTR_NOT_NULL(pool);
+        ASSERT_EQ(1, thread->pool_submit(&pool, use_worker_allocator, &usages[1]));
+        thread->pool_wait(&pool);
+        thread->pool_destroy(&pool);
+        for (int i = 0; i < 2; i++) {
+            ASSERT_EQ(1, usages[i].owned);
+            ASSERT_EQ(0, usages[i].total_blocks);
+            ASSERT_EQ(WORKER_PAIRS, usages[i].allocs);
+            ASSERT_EQ(WORKER_PAIRS, usages[i].releases);
+            ASSERT_EQ(0, usages[i].live_bytes);
+        }
+    } END_TEST;
+}
+
+typedef struct maintenance {
+    allocator_ptr_t ptr;
+    alloc_mark_t owner_mark;
+    alloc_mark_t mark;
+    int gc_step_result;
+    size_t compacted;
+} maintenance_t;
+
+thread_func_result maintain_on_thread(void* param) {
+    maintenance_t* maintenance = (maintenance_t*)param;
+    maintenance->mark = alloc->mark(&maintenance->ptr);
+    alloc->rewind(&maintenance->ptr, maintenance->owner_mark);
+    maintenance->gc_step_result = alloc->gc_step(&maintenance->ptr, 1);
+    maintenance->compacted = alloc->compact(&maintenance->ptr, 0);
+    alloc->gc(&maintenance->ptr);
+    alloc->reset(&maintenance->ptr);
+    return (thread_func_result)0;
+}
+
+void test_maintenance_off_owner() {
+    TEST(test_maintenance_off_owner) {
+        maintenance_t maintenance;
+        maintenance.ptr = alloc->init_with(ALLOC_ATOMIC_REF_COUNT);
+        sp_ptr_t kept = alloc->alloc(&maintenance.ptr, 32);
+        maintenance.owner_mark = alloc->mark(&maintenance.ptr);
+        sp_ptr_t sps[10];
+        ASSERT_EQ(10, alloc->alloc_batch(&maintenance.ptr, 32, 10, sps));
+        thread_sp_ptr_t threads = thread->create(maintain_on_thread, &maintenance, 1);
+        thread->start(&threads);
+        thread->join(&threads);
+        thread->destroy(&threads);
+        // none of the calls touched the owner's objects
+        ASSERT_EQ(11, maintenance.ptr->total_blocks);
+        ASSERT_EQ(1, maintenance.gc_step_result);
+        ASSERT_EQ(0, maintenance.compacted);
+        ASSERT_EQ(0, maintenance.mark.serial);
+        ASSERT_PTR_NULL(maintenance.mark.region);
+        ASSERT_EQ(1, kept->ref_count);
+
+        alloc->rewind(&maintenance.ptr, maintenance.owner_mark);
+        ASSERT_EQ(1, maintenance.ptr->total_blocks);
+        ASSERT_PTR_EQ(kept->block, maintenance.ptr->block_list);
+        alloc->release(&kept);
+        alloc->destroy(&maintenance.ptr);
+        ASSERT_PTR_NULL(maintenance.ptr);
+    } END_TEST;
+}
+
+void test_ref_count_lifecycle() {
+    TEST(test_ref_count_lifecycle) {
+        allocator_ptr_t ptr = alloc->init();
+        // every way to allocate hands out the one reference the caller owns
+        sp_ptr_t sps[4];
+        sps[0] = alloc->alloc(&ptr, 24);
+        sps[1] = alloc->alloc_aligned(&ptr, 24, 256);
+        ASSERT_EQ(2, alloc->alloc_batch(&ptr, 24, 2, &sps[2]));
+        for (int i = 0; i < 4; i++) {
+            ASSERT_PTR_NOT_NULL(sps[i]);
+            ASSERT_EQ(1, sps[i]->ref_count);
+        }
+        ASSERT_EQ(4, ptr->total_blocks);
+
+        // a retained object outlives the first release and goes with the second
+        alloc->retain(&sps[0]);
+        ASSERT_EQ(2, sps[0]->ref_count);
+        sp_ptr_t copy = sps[0];
+        alloc->release(&copy);
+        ASSERT_PTR_NOT_NULL(sps[0]);
+        ASSERT_EQ(1, sps[0]->ref_count);
+        ASSERT_EQ(4, ptr->total_blocks);
+
+        // a single release frees an object nobody retained
+        for (int i = 0; i < 4; i++) {
+            alloc->release(&sps[i]);
+            ASSERT_PTR_NULL(sps[i]);
+            ASSERT_EQ(3 - i, ptr->total_blocks);
+        }
+        alloc_stats_t stats;
+        alloc->stats(&ptr, &stats);
+        ASSERT_EQ(4, stats.allocs);
+        ASSERT_EQ(4, stats.releases);
+        ASSERT_EQ(0, stats.live_bytes);
+        alloc->destroy(&ptr);
+        ASSERT_PTR_NULL(ptr);
+    } END_TEST;
+}
+
+static size_t free_blocks_of(const alloc_stats_t* stats) {
+    size_t free_blocks = 0;
+    for (size_t i = 0; i < stats->class_count; i++) {
+        free_blocks += stats->classes[i].free_blocks;
+    }
+    return free_blocks;
+}
+
+void test_span_reuse() {
+    TEST(test_span_reuse) {
+        allocator_ptr_t ptr = alloc->init();
+        // one, three and eight pages with the header, all small enough to be cached
+        const size_t sizes[] = { 3000, 10000, 30000 };
+        for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+            sp_ptr_t sp = alloc->alloc(&ptr, sizes[i]);
+            ASSERT_PTR_NOT_NULL(sp);
+            sp_ptr_t first = sp;
+            alloc->release(&sp);
+            alloc_stats_t stats;
+            alloc->stats(&ptr, &stats);
+            size_t reserved = stats.reserved_bytes;
+            size_t cached = free_blocks_of(&stats);
+
+            // a backend that keeps released memory around hands the same span out again without mapping more
+            for (int round = 0; round < 100; round++) {
+                sp = alloc->alloc(&ptr, sizes[i]);
+                ASSERT_PTR_NOT_NULL(sp);
+                if (cached > 0) {
+                    ASSERT_PTR_EQ(first, sp);
+                }
+                memset(sp->ptr, round, sizes[i]);
+                alloc->release(&sp);
+            }
+            alloc->stats(&ptr, &stats);
+            if (cached > 0) {
+                ASSERT_EQ(reserved, stats.reserved_bytes);
+                ASSERT_EQ(cached, free_blocks_of(&stats));
+            }
+
+            // compact gives the pages of cached spans back, whatever is handed out afterwards is as good as new
+            alloc->compact(&ptr, 0);
+            alloc_stats_t compacted;
+            alloc->stats(&ptr, &compacted);
+            ASSERT(compacted.reserved_bytes <= stats.reserved_bytes);
+            sp = alloc->alloc(&ptr, sizes[i]);
+            ASSERT_PTR_NOT_NULL(sp);
+            memset(sp->ptr, 0xAB, sizes[i]);
+            ASSERT_EQ(0xAB, ((unsigned char*)sp->ptr)[sizes[i] - 1]);
+            alloc->release(&sp);
+        }
+        alloc_stats_t stats;
+        alloc->stats(&ptr, &stats);
+        ASSERT_EQ(stats.allocs, stats.releases);
+        ASSERT_EQ(0, stats.live_bytes);
+        ASSERT(stats.peak_reserved_bytes >= stats.reserved_bytes);
+        alloc->destroy(&ptr);
+        ASSERT_PTR_NULL(ptr);
+    } END_TEST;
+}
+
+#define HEAP_OBJECTS 20000
+
+// the heap maps more memory once the first mapping is used up, and keeps every payload where it was
+void test_heap_growth() {
+    TEST(test_heap_growth) {
+        allocator_ptr_t ptr = alloc->init();
+        alloc_stats_t stats;
+        alloc->stats(&ptr, &stats);
+        size_t initial = stats.reserved_bytes;
+        // a few MB of live objects, well past what any backend maps up front
+        static sp_ptr_t sps[HEAP_OBJECTS];
+        for (int i = 0; i < HEAP_OBJECTS; i++) {
+            sps[i] = alloc->alloc(&ptr, 100);
+            ASSERT_PTR_NOT_NULL(sps[i]);
+            memset(sps[i]->ptr, i & 0xFF, 100);
+        }
+        ASSERT_EQ(HEAP_OBJECTS, ptr->total_blocks);
+        alloc->stats(&ptr, &stats);
+        ASSERT(stats.reserved_bytes > initial);
+        ASSERT(stats.reserved_bytes >= stats.slot_bytes);
+        ASSERT_EQ((size_t)HEAP_OBJECTS * 100, stats.live_bytes);
+        int intact = 1;
+        for (int i = 0; i < HEAP_OBJECTS; i++) {
+            intact &= ((unsigned char*)sps[i]->ptr)[99] == (unsigned char)(i & 0xFF);
+        }
+        ASSERT(intact);
+        alloc->gc(&ptr);
+        ASSERT_EQ(0, ptr->total_blocks);
+        alloc->destroy(&ptr);
+        ASSERT_PTR_NULL(ptr);
+    } END_TEST;
+}
+
+// objects over a page come from page-rounded spans, which gc recycles and block_list still counts
+void test_large_objects() {
+    TEST(test_large_objects) {
+        allocator_ptr_t ptr = alloc->init();
+        static const size_t sizes[] = { 8 * 1024, 64 * 1024, 256 * 1024, 1024 * 1024 };
+        const size_t count = sizeof(sizes) / sizeof(sizes[0]);
+        size_t total = 0;
+        for (int round = 0; round < 2; round++) {
+            for (size_t i = 0; i < count; i++) {
+                sp_ptr_t sp = alloc->alloc(&ptr, sizes[i]);
+                ASSERT_PTR_NOT_NULL(sp);
+                ASSERT(sp->size >= sizes[i]);
+                memset(sp->ptr, 0xAB, sizes[i]);
+                ASSERT_EQ(0xAB, ((unsigned char*)sp->ptr)[sizes[i] - 1]);
+                total += sizes[i];
+            }
+            ASSERT_EQ(count * (round + 1), (size_t)ptr->total_blocks);
+        }
+        alloc_stats_t stats;
+        alloc->stats(&ptr, &stats);
+        ASSERT_EQ(total, stats.live_bytes);
+        alloc->gc(&ptr);
+        ASSERT_EQ(0, ptr->total_blocks);
+        // whatever the collection kept or gave back, the same sizes are handed out again afterwards
+        for (size_t i = 0; i < count; i++) {
+            sp_ptr_t sp = alloc->alloc(&ptr, sizes[i]);
+            ASSERT_PTR_NOT_NULL(sp);
+            memset(sp->ptr, 0xCD, sizes[i]);
+        }
+        ASSERT_EQ(count, (size_t)ptr->total_blocks);
+        alloc->stats(&ptr, &stats);
+        ASSERT_EQ(total / 2, stats.live_bytes);
+        alloc->destroy(&ptr);
+        ASSERT_PTR_NULL(ptr);
+    } END_TEST;
+}
+
+#define REUSED_OBJECTS 64
+
+void test_block_reuse() {
+    TEST(test_block_reuse) {
+        allocator_ptr_t ptr = alloc->init();
+        sp_ptr_t sps[REUSED_OBJECTS];
+        const void* released[REUSED_OBJECTS];
+        for (int round = 0; round < 3; round++) {
+            ASSERT_EQ(REUSED_OBJECTS, alloc->alloc_batch(&ptr, 40, REUSED_OBJECTS, sps));
+            alloc_stats_t stats;
+            alloc->stats(&ptr, &stats);
+            size_t free_before = free_blocks_of(&stats);
+            size_t reserved = stats.reserved_bytes;
+            for (int i = 0; i < REUSED_OBJECTS; i++) {
+                released[i] = sps[i];
+                alloc->release(&sps[i]);
+            }
+            alloc->stats(&ptr, &stats);
+            if (free_blocks_of(&stats) < free_before + REUSED_OBJECTS) {
+                continue;
+            }
+            // blocks that went back to a free list come out again, the last one released first
+            for (int i = REUSED_OBJECTS - 1; i >= 0; i--) {
+                sp_ptr_t sp = alloc->alloc(&ptr, 40);
+                ASSERT_PTR_EQ(released[i], sp);
+                alloc->release(&sp);
+                sps[i] = alloc->alloc(&ptr, 40);
+                ASSERT_PTR_EQ(released[i], sps[i]);
+            }
+            alloc->stats(&ptr, &stats);
+            ASSERT_EQ(reserved, stats.reserved_bytes);
+            ASSERT_EQ(free_before, free_blocks_of(&stats));
+            alloc->release_batch(sps, REUSED_OBJECTS);
+        }
+        ASSERT_EQ(0, ptr->total_blocks);
+        alloc->destroy(&ptr);
+        ASSERT_PTR_NULL(ptr);
+    } END_TEST;
+}
+
+void test_size_class_rounding() {
+    TEST(test_size_class_rounding) {
+        allocator_ptr_t ptr = alloc->init();
+        alloc_stats_t before;
+        alloc->stats(&ptr, &before);
+        size_t last_block_size = 0;
+        for (size_t size = 1; size + OBJECT_HEADER_SIZE <= 4096; size += 13) {
+            sp_ptr_t sp = alloc->alloc(&ptr, size);
+            ASSERT_PTR_NOT_NULL(sp);
+            alloc_stats_t stats;
+            alloc->stats(&ptr, &stats);
+            // the slot comes from the smallest class it fits, or the next one for a backend that keeps a few bytes
+            // of its own in the slot; a bigger request never gets a smaller class
+            size_t row = 0;
+            while (row < stats.class_count && stats.classes[row].allocs == before.classes[row].allocs) {
+                row++;
+            }
+            ASSERT(row < stats.class_count);
+            size_t block_size = stats.classes[row].block_size;
+            if (block_size != 0) {
+                ASSERT(block_size >= OBJECT_HEADER_SIZE + size);
+                ASSERT(block_size >= last_block_size);
+                last_block_size = block_size;
+                int skipped = 0;
+                for (size_t other = 0; other < stats.class_count; other++) {
+                    size_t other_size = stats.classes[other].block_size;
+                    skipped += other_size >= OBJECT_HEADER_SIZE + size && other_size < block_size;
+                }
+                ASSERT(skipped <= 1);
+            }
+            alloc->release(&sp);
+            alloc->stats(&ptr, &before);
+        }
+        alloc->destroy(&ptr);
+        ASSERT_PTR_NULL(ptr);
+    } END_TEST;
+}
+
+void test_queue() {
+    TEST(test_queue) {
+        ASSERT_PTR_NULL(thread->queue_create(0));
+        allocator_ptr_t ptr = alloc->init();
+        thread_queue_ptr_t queue = thread->queue_create(3);
+        ASSERT_PTR_NOT_NULL(queue);
+        ASSERT_PTR_NULL(thread->queue_pop(&queue));
+
+        // the capacity is rounded up to 4, each push holds a reference of its own
+        sp_ptr_t sps[5];
+        for (int i = 0; i < 5; i++) {
+            sps[i] = alloc->alloc(&ptr, 16);
+        }
+        for (int i = 0; i < 4; i++) {
+            ASSERT_EQ(1, thread->queue_push(&queue, &sps[i]));
+            ASSERT_EQ(2, sps[i]->ref_count);
+        }
+        ASSERT_EQ(0, thread->queue_push(&queue, &sps[4]));
+        ASSERT_EQ(1, sps[4]->ref_count);
+
+        // first in, first out, and popping hands the queue's reference over
+        sp_ptr_t popped = thread->queue_pop(&queue);
+        ASSERT_PTR_EQ(sps[0], popped);
+        alloc->release(&popped);
+        ASSERT_EQ(1, sps[0]->ref_count);
+        sp_ptr_t out[4];
+        ASSERT_EQ(2, thread->queue_pop_batch(&queue, out, 2));
+        ASSERT_PTR_EQ(sps[1], out[0]);
+        ASSERT_PTR_EQ(sps[2], out[1]);
+        alloc->release(&out[0]);
+        alloc->release(&out[1]);
+        ASSERT_EQ(2, thread->queue_push_batch(&queue, &sps[3], 2));
+        // a batch that does not fit pushes what does
+        ASSERT_EQ(1, thread->queue_push_batch(&queue, sps, 3));
+        ASSERT_EQ(0, thread->queue_push(&queue, &sps[2]));
+
+        // destroy drops the references still queued: sps[3] twice, sps[4] and sps[0] once
+        thread->queue_destroy(&queue);
+        ASSERT_PTR_NULL(queue);
+        for (int i = 0; i < 5; i++) {
+            ASSERT_EQ(1, sps[i]->ref_count);
+            alloc->release(&sps[i]);
+        }
+        ASSERT_EQ(0, ptr->total_blocks);
+        alloc->destroy(&ptr);
+        ASSERT_PTR_NULL(ptr);
+    } END_TEST;
+}
+
+#define NESTED_TASKS 8
+
+typedef struct nested_tasks {
+    thread_pool_ptr_t pool;
+    atomic_int ran;
+} nested_tasks_t;
+
+static void run_leaf_task(void* param) {
+    atomic_fetch_add(&((nested_tasks_t*)param)->ran, 1);
+}
+
+static void run_branch_task(void* param) {
+    nested_tasks_t* tasks = (nested_tasks_t*)param;
+    for (int i = 0; i < NESTED_TASKS; i++) {
+        thread->pool_submit(&tasks->pool, run_leaf_task, tasks);
+    }
+    atomic_fetch_add(&tasks->ran, 1);
+}
+
+static void run_root_task(void* param) {
+    nested_tasks_t* tasks = (nested_tasks_t*)param;
+    for (int i = 0; i < NESTED_TASKS; i++) {
+        thread->pool_submit(&tasks->pool, run_branch_task, tasks);
+    }
+    atomic_fetch_add(&tasks->ran, 1);
+}
+
+void test_pool() {
+    TEST(test_pool) {
+        ASSERT_PTR_NULL(thread->pool_create(0));
+        nested_tasks_t tasks;
+        tasks.pool = thread->pool_create(4);
+        ASSERT_PTR_NOT_NULL(tasks.pool);
+        ASSERT_EQ(0, thread->pool_submit(&tasks.pool, NULL, &tasks));
+
+        // tasks submitted from inside tasks count as well, pool_wait returns once the whole tree ran
+        for (int round = 1; round <= 3; round++) {
+            atomic_init(&tasks.ran, 0);
+            for (int i = 0; i < round; i++) {
+                ASSERT_EQ(1, thread->pool_submit(&tasks.pool, run_root_task, &tasks));
+            }
+            thread->pool_wait(&tasks.pool);
+            ASSERT_EQ(round * (1 + NESTED_TASKS + NESTED_TASKS * NESTED_TASKS), atomic_load(&tasks.ran));
+        }
+        // nothing pending returns at once
+        thread->pool_wait(&tasks.pool);
+
+        // destroy runs what is still queued before it joins
+        atomic_init(&tasks.ran, 0);
+        thread->pool_submit(&tasks.pool, run_root_task, &tasks);
+        thread->pool_destroy(&tasks.pool);
+        ASSERT_PTR_NULL(tasks.pool);
+        ASSERT_EQ(1 + NESTED_TASKS + NESTED_TASKS * NESTED_TASKS, atomic_load(&tasks.ran));
+    } END_TEST;
+}
+
+#define PARALLEL_INDEXES 10007 // prime, so that no grain divides the range evenly
+
+static void visit_range(size_t begin, size_t end, void* ctx) {
+    atomic_uchar* visits = (atomic_uchar*)ctx;
+    for (size_t i = begin; i < end; i++) {
+        atomic_fetch_add(&visits[i], 1);
+    }
+}
+
+static void sum_range(size_t begin, size_t end, void* ctx, void* partial) {
+    (void)ctx;
+    for (size_t i = begin; i < end; i++) {
+        *(unsigned long long*)partial += i;
+    }
+}
+
+static void combine_sums(void* result, const void* partial, void* ctx) {
+    (void)ctx;
+    *(unsigned long long*)result += *(const unsigned long long*)partial;
+}
+
+void test_parallel() {
+    TEST(test_parallel) {
+        thread_pool_ptr_t pool = thread->pool_create(4);
+        ASSERT_PTR_NOT_NULL(pool);
+        static atomic_uchar visits[PARALLEL_INDEXES];
+        const size_t grains[] = { 0, 1, 7, 1000, PARALLEL_INDEXES * 2 };
+        for (size_t g = 0; g < sizeof(grains) / sizeof(grains[0]); g++) {
+            // every index of the range is visited exactly once, none outside of it
+            for (size_t i = 0; i < PARALLEL_INDEXES; i++) {
+                atomic_init(&visits[i], 0);
+            }
+            ASSERT_EQ(1, thread->parallel_for(&pool, 3, PARALLEL_INDEXES - 2, grains[g], visit_range, visits));
+            int covered = 1;
+            for (size_t i = 0; i < PARALLEL_INDEXES; i++) {
+                covered &= atomic_load(&visits[i]) == (i >= 3 && i < PARALLEL_INDEXES - 2 ? 1 : 0);
+            }
+            ASSERT(covered);
+
+            // the partials of whatever threads ran the chunks add up to the sum over the whole range
+            unsigned long long expected = 0;
+            for (size_t i = 5; i < PARALLEL_INDEXES; i++) {
+                expected += i;
+            }
+            unsigned long long sum = 0;
+            ASSERT_EQ(1, thread->parallel_reduce(&pool, 5, PARALLEL_INDEXES, grains[g], sum_range, combine_sums, &sum, sizeof(sum), NULL));
+            ASSERT_EQ(expected, sum);
+        }
+
+        // an empty range runs nothing
+        ASSERT_EQ(0, thread->parallel_for(&pool, 10, 10, 1, visit_range, visits));
+        unsigned long long sum = 0;
+        ASSERT_EQ(0, thread->parallel_reduce(&pool, 10, 5, 1, sum_range, combine_sums, &sum, sizeof(sum), NULL));
+        ASSERT_EQ(0, sum);
+        thread->pool_destroy(&pool);
+        ASSERT_PTR_NULL(pool);
+    } END_TEST;
+}
+
+typedef struct stage_result {
+    int value;
+    int order; // when the stage ran, counted over every stage of the test
+} stage_result_t;
+
+typedef struct stages {
+    atomic_int open; // the first stage waits for it, so that its future is seen unfinished first
+    atomic_int ran;
+} stages_t;
+
+static void run_first_stage(const void* input, void* param, void* result) {
+    (void)input;
+    stages_t* stages = (stages_t*)param;
+    while (!atomic_load(&stages->open)) {
+    }
+    ((stage_result_t*)result)->value = 1;
+    ((stage_result_t*)result)->order = atomic_fetch_add(&stages->ran, 1);
+}
+
+// appends a digit to the value of the stage before
+static void run_next_stage(const void* input, void* param, void* result) {
+    stages_t* stages = (stages_t*)param;
+    const stage_result_t* before = (const stage_result_t*)input;
+    ((stage_result_t*)result)->value = before->value * 10 + before->value % 10 + 1;
+    ((stage_result_t*)result)->order = atomic_fetch_add(&stages->ran, 1);
+}
+
+void test_futures() {
+    TEST(test_futures) {
+        thread_pool_ptr_t pool = thread->pool_create(2);
+        ASSERT_PTR_NOT_NULL(pool);
+        stages_t stages;
+        atomic_init(&stages.open, 0);
+        atomic_init(&stages.ran, 0);
+        stage_result_t result = { 0, 0 };
+
+        // the chain is set up while its first stage is still blocked, so no stage has a result yet
+        thread_future_ptr_t first = thread->future_submit(&pool, run_first_stage, &stages, sizeof(stage_result_t));
+        ASSERT_PTR_NOT_NULL(first);
+        thread_future_ptr_t second = thread->future_then(&first, run_next_stage, &stages, sizeof(stage_result_t));
+        thread_future_ptr_t third = thread->future_then(&second, run_next_stage, &stages, sizeof(stage_result_t));
+        ASSERT_PTR_NOT_NULL(second);
+        ASSERT_PTR_NOT_NULL(third);
+        ASSERT_EQ(0, thread->future_try_get(&first, &result));
+        ASSERT_EQ(0, thread->future_try_get(&third, &result));
+        ASSERT_EQ(0, result.value);
+
+        // each stage runs once the one before it is done and sees its result
+        atomic_store(&stages.open, 1);
+        thread->future_wait(&third, &result);
+        ASSERT_EQ(123, result.value);
+        ASSERT_EQ(2, result.order);
+        ASSERT_EQ(1, thread->future_try_get(&first, &result));
+        ASSERT_EQ(1, result.value);
+        ASSERT_EQ(0, result.order);
+        ASSERT_EQ(1, thread->future_try_get(&second, &result));
+        ASSERT_EQ(12, result.value);
+        ASSERT_EQ(1, result.order);
+        ASSERT_EQ(1, thread->future_try_get(&third, NULL));
+
+        // a continuation of a future that is done already still runs, on the pool or right away
+        thread_future_ptr_t late = thread->future_then(&first, run_next_stage, &stages, sizeof(stage_result_t));
+        ASSERT_PTR_NOT_NULL(late);
+        thread->future_wait(&late, &result);
+        ASSERT_EQ(12, result.value);
+        ASSERT_EQ(3, result.order);
+
+        thread->future_release(&first);
+        thread->future_release(&second);
+        thread->future_release(&third);
+        thread->future_release(&late);
+        ASSERT_PTR_NULL(first);
+        ASSERT_PTR_NULL(late);
+        thread->pool_destroy(&pool);
+        ASSERT_PTR_NULL(pool);
+    } END_TEST;
+}
+
+void test_alloc_huge_size() {
+    TEST(test_alloc_huge_size) {
+        allocator_ptr_t ptr = alloc->init();
+        // sizes whose slot cannot be represented or mapped fail instead of wrapping around
+        size_t sizes[] = { SIZE_MAX, SIZE_MAX - 8, SIZE_MAX / 2 + 1, SIZE_MAX / 2 };
+        for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+            ASSERT_PTR_NULL(alloc->alloc(&ptr, sizes[i]));
+            sp_ptr_t sps[2];
+            ASSERT_EQ(0, alloc->alloc_batch(&ptr, sizes[i], 2, sps));
+        }
+        ASSERT_EQ(0, ptr->total_blocks);
+        sp_ptr_t sp = alloc->alloc(&ptr, 64);
+        ASSERT_PTR_NOT_NULL(sp);
+        alloc->release(&sp);
+        alloc->destroy(&ptr);
+        ASSERT_PTR_NULL(ptr);
+    } END_TEST;
+}
+
 int main() {
     setup_console();
     printf("running unit tests for reference counting allocator\n");
@@ -710,6 +2245,7 @@ int main() {
     test_release_one_reference_to_array();
     test_release_final_reference_to_array();
     test_release_already_freed_memory();
+    test_release_after_gc();
 
     test_rc_gc_no_blocks();
     test_rc_gc_single_block();
@@ -720,6 +2256,38 @@ int main() {
     test_rc_gc_free_one_block();
     test_double_linked_list_functionality();
     test_retain_after_release();
+    test_atomic_ref_count_mode();
+    test_alloc_batch_release_batch();
+    test_allocate_beyond_initial_memory();
+    test_independent_allocators();
+    test_mark_rewind_reset();
+    test_stale_marks();
+    test_huge_pages_mode();
+    test_alloc_aligned();
+    test_resize();
+    test_resize_across_rewind();
+    test_stats();
+    test_handle_table();
+    test_compact();
+    test_compact_handles();
+    test_compact_budget();
+    test_gc_step();
+    test_release_on_other_thread();
+    test_handles_released_off_owner();
+    test_adopt();
+    test_worker_allocators();
+    test_maintenance_off_owner();
+    test_alloc_huge_size();
+    test_queue();
+    test_pool();
+    test_parallel();
+    test_futures();
+    test_ref_count_lifecycle();
+    test_span_reuse();
+    test_size_class_rounding();
+    test_block_reuse();
+    test_heap_growth();
+    test_large_objects();
 
     printf("\n==========================================\n");
     printf("tests run: %d\n", tests_run);